@@ -1,16 +1,38 @@
 // #include <editline/history.h>
 // #include <editline/readline.h>
 #include <editline.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "mpc/mpc.h"
+#include "trace/trace_events.h"
+#ifdef MUMBLE_TRACE_EVENTS
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #define LISPVAL_ASSERT(cond, err) \
     if (!(cond)) {                \
         return lispval_err(err);  \
     }
+// For functions which own l, e.g., the special forms: frees it first
+#define LISPVAL_ASSERT_CONSUMING(cond, l, err) \
+    if (!(cond)) {                             \
+        delete_lispval(l);                     \
+        return lispval_err(err);               \
+    }
 int VERBOSE = 0;
+__thread int PARALLEL_WORKER = 0; // see the "Parallel map" section
 #define printfln(...)                                    \
     do {                                                 \
         if (VERBOSE == 2) {                              \
@@ -36,6 +58,41 @@ typedef lispval* (*lispbuiltin)(lispval*, lispenv*);
 // this defines the lispbuiltin type
 // which seems to be a pointer to a function which takes in a lispenv*
 // and a lispval* and returns a lispval*
+typedef double (*lispjit_func)(double*);
+typedef long long (*lispjit_integer_func)(long long*);
+// natively compiled user-defined function, see the "Just-in-time compilation" section
+
+// Information shared by all the clones of a user-defined function.
+// get_from_lispenv clones functions each time they are called,
+// so anything that should persist between calls goes here.
+typedef struct lispfunc_info {
+    int refcount;
+    char* name; // symbol the function was def'd to, or NULL
+    unsigned long long body_hash; // 0 until computed, see format_lispfunc_name
+    // Type feedback: how often, and with which types of arguments, it was called
+    int calls;
+    int seen_types; // bitmask of 1 << LISPVAL_*
+    // Numeric body, see the "Unboxed evaluation" section
+    int unboxed_tried;
+    struct unboxed_expr* unboxed;
+    int unboxed_self_calls; // whether unboxed calls the function by name, see unboxed_self_calls_resolve
+    int unboxed_operators; // bitmask of 1 << UNBOXED_*: the builtins unboxed calls, see unboxed_operators_resolve
+    int unboxed_types; // bitmask of 1 << LISPVAL_NUM or LISPVAL_INT: arguments it can be evaluated unboxed on
+    // Machine code, see the "Just-in-time compilation" section
+    int jit_tried; // bitmask, as unboxed_types
+    lispjit_func jit_func;
+    size_t jit_size;
+    lispjit_integer_func jit_integer_func;
+    size_t jit_integer_size;
+    // Profile, see the "Profiling" section
+    long prof_calls;
+    long prof_self_samples;
+    long prof_total_samples;
+    long prof_last_sample;
+    int prof_active; // calls currently in progress
+    long long prof_entered_ns;
+    long long prof_time_ns;
+} lispfunc_info;
 
 // Types
 enum {
@@ -46,973 +103,6897 @@ enum {
     LISPVAL_USER_FUNC,
     LISPVAL_SEXPR,
     LISPVAL_QEXPR,
+    LISPVAL_INT,
+    LISPVAL_BIGINT,
+    LISPVAL_VEC,
+    LISPVAL_RANGE,
+    LISPVAL_MAP,
+    LISPVAL_STR,
+    LISPVAL_STREAM,
+    LISPVAL_TRANSIENT,
 };
-int LARGEST_LISPVAL = LISPVAL_QEXPR; // for checking out of bounds.
+#define LARGEST_LISPVAL LISPVAL_TRANSIENT // for checking out of bounds.
 
 typedef struct lispval {
     int type;
+    int count; // of cells for expressions, of elements for vectors
 
-    // Basic types
-    double num;
-    char* err;
-    char* sym;
+    // The payload, according to type
+    union {
+        // Basic types
+        double num;
+        long long integer;
+        char* err;
+        char* sym;
 
-    // Functions
-    // Built-in
-    lispbuiltin builtin_func;
-    char* builtin_func_name;
-    // User-defined
-    lispenv* env;
-    lispval* variables;
-    lispval* manipulation;
+        // Big integers, see the "Big integers" section
+        struct {
+            int bigint_sign; // 1 or -1
+            int bigint_size; // in limbs
+            uint32_t* bigint_limbs;
+        };
 
-    // Expression
-    int count;
-    struct lispval** cell; // list of lisval*
+        // Vectors, see the "Vectors" section. Their length is count.
+        struct {
+            struct lispvec_buffer* vec_buffer;
+            double* vec;
+        };
+
+        // Ranges, see the "Ranges" section: range_start + i * range_step, for i < range_length
+        struct {
+            long long range_start;
+            long long range_step;
+            long long range_length;
+        };
+
+        // Hash maps, see the "Hash maps" section. Their number of entries is map->count.
+        struct lispmap* map;
+
+        // Strings, see the "Strings" section
+        struct {
+            char str_inline[24]; // LISPSTR_INLINE_SIZE bytes, if str_node is NULL
+            struct lispstr_node* str_node;
+            long long str_offset;
+            long long str_length;
+        };
+
+        // Streams, see the "Streams" section
+        struct lispstream* stream;
+
+        // Transients, see the "Transients" section
+        struct lisptransient* transient;
+
+        // Functions
+        // Built-in
+        struct {
+            lispbuiltin builtin_func;
+            char* builtin_func_name;
+        };
+        // User-defined
+        struct {
+            lispenv* env;
+            lispval* variables;
+            lispval* manipulation;
+            lispfunc_info* func_info;
+        };
+
+        // Expression
+        struct {
+            struct lispval** cell; // list of lisval*
+            unsigned long long cell_hash; // of the cells, 0 until computed, see hash_lispval
+        };
+    };
 } lispval;
 
 // Function types
 void print_lispval_tree(lispval* v, int indent_level);
+lispfunc_info* new_lispfunc_info(void);
+void release_lispfunc_info(lispfunc_info* info);
 lispenv* new_lispenv();
 void destroy_lispenv(lispenv* env);
 lispval* clone_lispval(lispval* old);
 lispval* evaluate_lispval(lispval* l, lispenv* env);
+lispval* call_lispval_func(lispval* f, lispval** args, int n, lispenv* env);
+typedef struct lispfunc_frame lispfunc_frame;
+lispfunc_frame* new_lispfunc_frame(lispval* f, int n, lispenv* caller);
+lispval* call_lispfunc_frame(lispfunc_frame* frame, lispval** args);
+void delete_lispfunc_frame(lispfunc_frame* frame);
+int is_truthy(lispval* v);
+lispval* add_lispstream_stage(lispval* stream, int kind, lispval* f, long long n);
+lispval* usable_lisptransient(lispval* t, int type);
+lispval* run_lispstream(lispval* stream, lispval* reducer, lispval* initial, lispenv* e);
+void delete_lispval(lispval* v);
+unsigned long long hash_lispval(lispval* v);
+int lispvals_equal(lispval* a, lispval* b);
+int lispval_is_number(lispval* v);
+struct unboxed_expr* get_unboxed_body(lispval* f);
+void start_thread_evaluation_limits(size_t usable_stack);
+extern int PROFILING;
+extern int TRACING;
 
-// Constructors
-lispval* lispval_num(double x)
+// Trace events
+// Allocations, frees, environment inserts and lookups, and calls and returns
+// are recorded in a ring buffer, but only in builds with -DMUMBLE_TRACE_EVENTS
+// (make trace). Otherwise TRACE_EVENT compiles to nothing, so that the
+// constructors don't pay for it. The binary format is in trace/trace_events.h.
+// With VERBOSE=1 or VERBOSE=2, the events of each evaluation are printed after it.
+// DUMP=file writes the buffer to a file, and so does a crash, to
+// mumble-events.bin; tracedump decodes them.
+#ifdef MUMBLE_TRACE_EVENTS
+trace_event trace_events[TRACE_EVENTS_SIZE];
+uint64_t trace_events_count = 0; // events recorded, including overwritten ones
+uint64_t trace_events_dumped = 0;
+
+void record_trace_event(int kind, lispval* v)
 {
-    if (VERBOSE)
-        printfln("Allocating num");
-    lispval* v = malloc(sizeof(lispval));
-    v->type = LISPVAL_NUM;
-    v->count = 0;
-    v->num = x;
-    if (VERBOSE)
-        printfln("Allocated num");
-    if (VERBOSE > 1)
-        print_lispval_tree(v, 2);
-    return v;
+    // Claiming a slot is the only shared write, so recording stays lock-free
+    uint64_t i = __atomic_fetch_add(&trace_events_count, 1, __ATOMIC_RELAXED);
+    trace_event* event = &trace_events[i & (TRACE_EVENTS_SIZE - 1)];
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    event->timestamp_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    event->pointer = (uint64_t)(uintptr_t)v;
+    event->kind = kind;
+    event->type = v->type;
 }
+#define TRACE_EVENT(kind, v) record_trace_event(kind, v)
+_Static_assert(sizeof(trace_event_type_names) / sizeof(trace_event_type_names[0]) == LARGEST_LISPVAL + 1, "trace_event_type_names should have a name for each LISPVAL_* type");
 
-lispval* lispval_err(char* message)
+void dump_trace_events(void)
 {
-    if (VERBOSE)
-        printfln("Allocating err");
-    lispval* v = malloc(sizeof(lispval));
-    v->type = LISPVAL_ERR;
-    v->count = 0;
-    v->err = malloc(strlen(message) + 1);
-    strcpy(v->err, message);
-    if (VERBOSE)
-        printfln("Allocated err");
-    if (VERBOSE > 1)
-        print_lispval_tree(v, 2);
-    return v;
+    if (trace_events_count - trace_events_dumped > TRACE_EVENTS_SIZE) {
+        printfln("(%llu earlier events were overwritten)", (unsigned long long)(trace_events_count - trace_events_dumped - TRACE_EVENTS_SIZE));
+        trace_events_dumped = trace_events_count - TRACE_EVENTS_SIZE;
+    }
+    for (; trace_events_dumped < trace_events_count; trace_events_dumped++) {
+        trace_event* event = &trace_events[trace_events_dumped & (TRACE_EVENTS_SIZE - 1)];
+        printfln("%s %s %p", trace_event_kind_names[event->kind], event->type <= LARGEST_LISPVAL ? trace_event_type_names[event->type] : "?", (void*)(uintptr_t)event->pointer);
+    }
 }
 
-lispval* lispval_sym(char* symbol)
+// Only uses write(2), so that it can be called from a signal handler
+int write_trace_events(int fd)
 {
-    if (VERBOSE)
-        printfln("Allocating sym");
-    lispval* v = malloc(sizeof(lispval));
-    v->type = LISPVAL_SYM;
-    v->count = 0;
-    v->sym = malloc(strlen(symbol) + 1);
-    strcpy(v->sym, symbol);
-    if (VERBOSE)
-        printfln("Allocated sym");
-    if (VERBOSE > 1)
-        print_lispval_tree(v, 2);
-    return v;
+    uint64_t recorded = __atomic_load_n(&trace_events_count, __ATOMIC_RELAXED);
+    uint64_t count = recorded < TRACE_EVENTS_SIZE ? recorded : TRACE_EVENTS_SIZE;
+    trace_events_header header = { .version = TRACE_EVENTS_VERSION, .event_size = sizeof(trace_event), .recorded = recorded, .count = count };
+    memcpy(header.magic, TRACE_EVENTS_MAGIC, 8);
+    if (write(fd, &header, sizeof(header)) != sizeof(header))
+        return 0;
+    // Oldest first: the part after the write position, then the part before it
+    uint64_t start = (recorded - count) & (TRACE_EVENTS_SIZE - 1);
+    uint64_t tail = count < TRACE_EVENTS_SIZE - start ? count : TRACE_EVENTS_SIZE - start;
+    if (write(fd, &trace_events[start], tail * sizeof(trace_event)) != (ssize_t)(tail * sizeof(trace_event)))
+        return 0;
+    if (write(fd, trace_events, (count - tail) * sizeof(trace_event)) != (ssize_t)((count - tail) * sizeof(trace_event)))
+        return 0;
+    return 1;
 }
 
-lispval* lispval_builtin_func(lispbuiltin func, char* builtin_func_name)
+int save_trace_events(char* filename)
 {
-    if (VERBOSE)
-        printfln("Allocating func name:%s, pointer: %p", builtin_func_name, func);
-    lispval* v = malloc(sizeof(lispval));
-    v->type = LISPVAL_BUILTIN_FUNC;
-    v->count = 0;
-    v->builtin_func_name = malloc(strlen(builtin_func_name) + 1);
-    strcpy(v->builtin_func_name, builtin_func_name);
-    v->builtin_func = func;
-    if (VERBOSE)
-        printfln("Allocated func");
-    if (VERBOSE > 1)
-        print_lispval_tree(v, 2);
-    return v;
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return 0;
+    int ok = write_trace_events(fd);
+    close(fd);
+    return ok;
 }
 
-lispval* lispval_lambda_func(lispval* variables, lispval* manipulation, lispenv* env)
+void save_trace_events_on_crash(int signal_number)
 {
-    /* correct idiom for calling this:
-    lispval* variables = clone_lispval(v->cell[0]);
-    lispval* manipulation = clone_lispval(v->cell[1]);
-		lispenv* env = NULL; // clone_lispval(blah)
-    lispval* lambda = lispval_lambda_func(variables, manipulation, NULL);
-		 */
-    if (VERBOSE) {
-        printfln("Allocating user-defined function");
-    }
-    lispval* v = malloc(sizeof(lispval));
-    v->type = LISPVAL_USER_FUNC;
-    v->builtin_func = NULL;
-    v->env = (env == NULL ? new_lispenv() : env);
-    v->variables = variables;
-    v->manipulation = manipulation;
-    // Previously: unclear how to garbage-collect this. Maybe add to a list and collect at the end?
-    // Now: Hah! Lambda functions are just added to the environment, so they will just
-    // be destroyed when it is destroyed.
-		// But no! in def {id} (@ {x} {x}), there is a copy of a lambda function in 
-		// the arguments to def. Aarg!
-    if (VERBOSE) {
-        printfln("Allocated user-defined function");
+    int fd = open(TRACE_EVENTS_CRASH_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        write_trace_events(fd);
+        close(fd);
     }
-    if (VERBOSE > 1)
-        print_lispval_tree(v, 2);
-    return v;
+    signal(signal_number, SIG_DFL);
+    raise(signal_number);
 }
 
-lispval* lispval_sexpr(void)
+void install_crash_handlers(void)
 {
-    if (VERBOSE)
-        printfln("Allocating sexpr");
-    lispval* v = malloc(sizeof(lispval));
-    v->type = LISPVAL_SEXPR;
-    v->count = 0;
-    v->cell = NULL;
-    if (VERBOSE)
-        printfln("Allocated sexpr");
-    if (VERBOSE > 1)
-        print_lispval_tree(v, 2);
-    return v;
+    signal(SIGSEGV, save_trace_events_on_crash);
+    signal(SIGBUS, save_trace_events_on_crash);
+    signal(SIGABRT, save_trace_events_on_crash);
 }
+#else
+#define TRACE_EVENT(kind, v) \
+    do {                     \
+    } while (0)
 
-lispval* lispval_qexpr(void)
+void dump_trace_events(void)
 {
-    if (VERBOSE)
-        printfln("Allocating qexpr");
-    lispval* v = malloc(sizeof(lispval));
-    v->type = LISPVAL_QEXPR;
-    v->count = 0;
-    v->cell = NULL;
-    if (VERBOSE > 1)
-        print_lispval_tree(v, 2);
-    return v;
 }
 
-// Destructor
-void delete_lispval(lispval* v)
+int save_trace_events(char* filename)
 {
-    if (v == NULL || v->type > LARGEST_LISPVAL)
-        return;
-    // print_lispval_tree(v, 0);
-    if (VERBOSE)
-        printfln("\nDeleting object of type %i", v->type);
-    switch (v->type) {
-    case LISPVAL_NUM:
-        if (VERBOSE)
-            printfln("Freeing num");
-        if (v != NULL)
-            free(v);
-        if (VERBOSE)
-            printfln("Freed num");
-        break;
-    case LISPVAL_ERR:
-        if (VERBOSE)
-            printfln("Freeing err");
-        if (v->err != NULL)
-            free(v->err);
-        v->err = NULL;
-        if (v != NULL)
-            free(v);
-        if (VERBOSE)
-            printfln("Freed err");
-        break;
-    case LISPVAL_SYM:
-        if (VERBOSE)
-            printfln("Freeing sym");
-        if (v->sym != NULL)
-            free(v->sym);
-        v->sym = NULL;
-        if (v != NULL)
-            free(v);
-        if (VERBOSE)
-            printfln("Freed sym");
-        break;
-    case LISPVAL_BUILTIN_FUNC:
-        if (v->builtin_func_name != NULL) {
-            if (VERBOSE) {
-                printfln("Freeing builtin func");
-            }
-            free(v->builtin_func_name);
-            v->builtin_func_name = NULL;
-        }
-        if (v != NULL)
-            free(v);
-        if (VERBOSE)
-            printfln("Freed builtin func");
-        // Don't do anything with v->func for now
-        // Though we could delete the pointer to the function later
-        // free(v->func);
-        break;
-    case LISPVAL_USER_FUNC:
-        if(VERBOSE) printfln("This shouldn't fire until the end, unless we are deleting the operands of a builtin function. E.g,. in def {id} (@ {x} {x}), there is a lambda function in the arguments, which should get collected.");
-        // for now, do nothing
-        if (VERBOSE)
-            printfln("Freeing user-defined func");
-        if (v->env != NULL) {
-            destroy_lispenv(v->env);
-            // ^ free(v->env) is not necessary; taken care of by destroy_lispenv
-            v->env = NULL;
-        }
-        if (v->variables != NULL) {
-					  // not deleting these for now.
-						// delete_lispval(v->variables);
-						// free(v->variables)
-            // v->variables = NULL;
-        }
-        if (v->manipulation != NULL) {
-					  // not deleting these for now.
-            // delete_lispval(v->manipulation);
-            // free(v->manipulation);
-            // v->manipulation = NULL;
-        }
-        if (v != NULL)
-            free(v);
-        if (VERBOSE)
-            printfln("Freed user-defined func");
-        // Don't do anything with v->func for now
-        // Though we could delete the pointer to the function later
-        // 
-				// free(v->func);
-        /*
-        */
-        break;
-    case LISPVAL_SEXPR:
-    case LISPVAL_QEXPR:
-        if (VERBOSE)
-            printfln("Freeing sexpr|qexpr");
-        if (VERBOSE)
-            printfln("Freed sexpr|qexpr cells");
-        for (int i = 0; i < v->count; i++) {
-            if (v->cell[i] != NULL)
-                delete_lispval(v->cell[i]);
-            v->cell[i] = NULL;
-        }
-        if (VERBOSE)
-            printfln("Setting v->count to 0");
-        v->count = 0;
+    return 0;
+}
 
-        if (VERBOSE)
-            printfln("Freeing v->cell");
-        if (v->cell != NULL)
-            free(v->cell);
-        v->cell = NULL;
+void install_crash_handlers(void)
+{
+}
+#endif
 
-        if (VERBOSE)
-            printfln("Freeing the v pointer");
-        if (v != NULL)
-            free(v);
-        if (VERBOSE)
-            printfln("Freed sexpr|qexpr");
-        break;
-    default:
-        if (VERBOSE)
-            printfln("Error: Unknown expression type for pointer %p of type %i. This is probably indicative that you are trying to delete a previously deleted object", v, v->type);
+// Big integers
+// Integers which don't fit in a long long are LISPVAL_BIGINTs: a sign and a
+// magnitude, stored as limbs in base 10^9, least significant first. The
+// decimal base makes printing linear, with no radix conversion.
+// A LISPVAL_BIGINT is always normalized: it has no leading zero limbs, and
+// its value doesn't fit in a long long, or it would be a LISPVAL_INT.
+// Multiplication is schoolbook for small operands, and Karatsuba above
+// BIGINT_KARATSUBA_THRESHOLD limbs. Limb arrays come from a pool with a free
+// list for each power-of-two size class, and each thread.
+#define BIGINT_BASE 1000000000U
+#define BIGINT_BASE_DIGITS 9
+#define BIGINT_KARATSUBA_THRESHOLD 32
+#define BIGINT_POOL_CLASSES 24 // up to 2^23 limbs; larger arrays are malloc'd and freed directly
+__thread uint32_t* bigint_pool[BIGINT_POOL_CLASSES];
+
+uint32_t* bigint_alloc_limbs(int n)
+{
+    // Space for at least n limbs. The two words before them hold the size
+    // class, and, once freed, the next array in the free list.
+    int size_class = 1;
+    while ((1LL << size_class) < n)
+        size_class++;
+    uint32_t* block;
+    if (size_class < BIGINT_POOL_CLASSES && bigint_pool[size_class] != NULL) {
+        block = bigint_pool[size_class];
+        bigint_pool[size_class] = *(uint32_t**)block;
+    } else {
+        block = malloc(sizeof(uint32_t) * ((1LL << size_class) + 2));
     }
-    // v = NULL; this is only our local pointer, sadly.
+    block[0] = size_class;
+    return block + 2;
 }
 
-// Environment
-struct lispenv {
-    int count;
-    char** syms; // list of strings
-    lispval** vals; // list of pointers to vals
-    lispenv* parent;
-};
+void bigint_free_limbs(uint32_t* limbs)
+{
+    uint32_t* block = limbs - 2;
+    int size_class = block[0];
+    if (size_class >= BIGINT_POOL_CLASSES) {
+        free(block);
+        return;
+    }
+    *(uint32_t**)block = bigint_pool[size_class];
+    bigint_pool[size_class] = block;
+}
 
-lispenv* new_lispenv()
+// Operations on magnitudes, i.e., on limb arrays and their sizes
+int bigint_trim(uint32_t* a, int n)
 {
-    lispenv* e = malloc(sizeof(lispenv));
-    e->count = 0;
-    e->syms = NULL;
-    e->vals = NULL;
-    e->parent = NULL;
-    return e;
+    while (n > 0 && a[n - 1] == 0)
+        n--;
+    return n;
 }
 
-void destroy_lispenv(lispenv* env)
+int bigint_compare_magnitudes(uint32_t* a, int na, uint32_t* b, int nb)
 {
-    for (int i = 0; i < env->count; i++) {
-        free(env->syms[i]);
-        free(env->vals[i]);
-        // to do: delete_lispval(vals[i])?
-        env->syms[i] = NULL;
-        env->vals[i] = NULL;
+    // a and b trimmed
+    if (na != nb)
+        return na > nb ? 1 : -1;
+    for (int i = na - 1; i >= 0; i--) {
+        if (a[i] != b[i])
+            return a[i] > b[i] ? 1 : -1;
     }
-    free(env->syms);
-    env->syms = NULL;
-    free(env->vals);
-    env->vals = NULL;
-    free(env);
-    env = NULL;
-    // parent is it's own environment
-    // so it isn't destroyed
+    return 0;
 }
 
-lispval* get_from_lispenv(char* sym, lispenv* env)
+int bigint_add_magnitudes(uint32_t* a, int na, uint32_t* b, int nb, uint32_t* out)
 {
-    for (int i = 0; i < env->count; i++) {
-        if (strcmp(env->syms[i], sym) == 0) {
-            return clone_lispval(env->vals[i]);
-            // return env->vals[i];
-            // to do: make sure that the clone is deleted.
-        }
+    // out has space for max(na, nb) + 1 limbs, and can be a or b. Returns its size.
+    if (na < nb) {
+        uint32_t* t = a;
+        a = b;
+        b = t;
+        int n = na;
+        na = nb;
+        nb = n;
     }
+    uint32_t carry = 0;
+    for (int i = 0; i < na; i++) {
+        uint32_t sum = a[i] + (i < nb ? b[i] : 0) + carry;
+        carry = sum >= BIGINT_BASE;
+        out[i] = carry ? sum - BIGINT_BASE : sum;
+    }
+    out[na] = carry;
+    return bigint_trim(out, na + 1);
+}
 
-    if (env->parent != NULL) {
-        return get_from_lispenv(sym, env->parent);
-    } else {
-        if (VERBOSE)
-            printfln("Unbound symbol %s", sym);
-        return lispval_err("Error: unbound symbol");
+int bigint_substract_magnitudes(uint32_t* a, int na, uint32_t* b, int nb, uint32_t* out)
+{
+    // a >= b. out has space for na limbs, and can be a. Returns its size.
+    int64_t borrow = 0;
+    for (int i = 0; i < na; i++) {
+        int64_t difference = (int64_t)a[i] - (i < nb ? b[i] : 0) - borrow;
+        borrow = difference < 0;
+        out[i] = difference < 0 ? difference + BIGINT_BASE : difference;
     }
-    // and this explains shadowing!
+    return bigint_trim(out, na);
 }
 
-void insert_in_current_lispenv(char* sym, lispval* v, lispenv* env)
+void bigint_add_shifted(uint32_t* out, int n, uint32_t* x, int nx, int shift)
 {
-    int found = 0;
-    for (int i = 0; i < env->count; i++) {
-        if (strcmp(env->syms[i], sym) == 0) {
-            delete_lispval(env->vals[i]);
-            env->vals[i] = clone_lispval(v);
-            found = 1;
-        }
+    // out += x * BIGINT_BASE^shift, where the result fits in n limbs
+    uint32_t carry = 0;
+    for (int i = 0; i < nx; i++) {
+        uint32_t sum = out[shift + i] + x[i] + carry;
+        carry = sum >= BIGINT_BASE;
+        out[shift + i] = carry ? sum - BIGINT_BASE : sum;
+    }
+    for (int i = shift + nx; carry && i < n; i++) {
+        out[i]++;
+        carry = out[i] == BIGINT_BASE;
+        if (carry)
+            out[i] = 0;
     }
-    if (found == 0) {
-        // Expand memory *for the arrays*
-        env->count++;
-        env->syms = realloc(env->syms, sizeof(char*) * env->count);
-        env->vals = realloc(env->vals, sizeof(lispval*) * env->count);
+}
 
-        // Copy contents over
-        env->vals[env->count - 1] = clone_lispval(v);
-        env->syms[env->count - 1] = malloc(strlen(sym) + 1);
-        strcpy(env->syms[env->count - 1], sym);
+void bigint_multiply_schoolbook(uint32_t* a, int na, uint32_t* b, int nb, uint32_t* out)
+{
+    memset(out, 0, sizeof(uint32_t) * (na + nb));
+    for (int i = 0; i < na; i++) {
+        uint64_t ai = a[i];
+        uint64_t carry = 0;
+        if (ai == 0)
+            continue;
+        for (int j = 0; j < nb; j++) {
+            uint64_t t = out[i + j] + ai * b[j] + carry;
+            out[i + j] = t % BIGINT_BASE;
+            carry = t / BIGINT_BASE;
+        }
+        out[i + nb] = carry;
     }
 }
 
-void insert_in_parentmost_lispenv(char* sym, lispval* v, lispenv* env)
+void bigint_multiply_magnitudes(uint32_t* a, int na, uint32_t* b, int nb, uint32_t* out)
 {
-    // note that you could have two chains of envs, though hopefully not.
-    while (env->parent != NULL) {
-        env = env->parent;
+    // out has space for na + nb limbs, and isn't a or b. It isn't trimmed.
+    if (na < nb) {
+        uint32_t* t = a;
+        a = b;
+        b = t;
+        int n = na;
+        na = nb;
+        nb = n;
     }
-    insert_in_current_lispenv(sym, v, env);
+    if (nb < BIGINT_KARATSUBA_THRESHOLD) {
+        bigint_multiply_schoolbook(a, na, b, nb, out);
+        return;
+    }
+    // a = a1 * BIGINT_BASE^m + a0
+    int m = na / 2;
+    int n = na + nb;
+    if (nb <= m) {
+        // b is too short to split: a * b = a1 * b * BIGINT_BASE^m + a0 * b
+        uint32_t* product = bigint_alloc_limbs(na - m + nb);
+        memset(out, 0, sizeof(uint32_t) * n);
+        bigint_multiply_magnitudes(a, m, b, nb, product);
+        bigint_add_shifted(out, n, product, bigint_trim(product, m + nb), 0);
+        bigint_multiply_magnitudes(a + m, na - m, b, nb, product);
+        bigint_add_shifted(out, n, product, bigint_trim(product, na - m + nb), m);
+        bigint_free_limbs(product);
+        return;
+    }
+    // b = b1 * BIGINT_BASE^m + b0. With z0 = a0 * b0 and z2 = a1 * b1,
+    // a * b = z2 * BIGINT_BASE^2m + z1 * BIGINT_BASE^m + z0,
+    // where z1 = (a0 + a1) * (b0 + b1) - z0 - z2 takes one multiplication instead of two.
+    uint32_t* z0 = out;
+    uint32_t* z2 = out + 2 * m;
+    bigint_multiply_magnitudes(a, m, b, m, z0);
+    bigint_multiply_magnitudes(a + m, na - m, b + m, nb - m, z2);
+    uint32_t* sum_a = bigint_alloc_limbs(na - m + 1);
+    uint32_t* sum_b = bigint_alloc_limbs((m > nb - m ? m : nb - m) + 1);
+    int n_sum_a = bigint_add_magnitudes(a, m, a + m, na - m, sum_a);
+    int n_sum_b = bigint_add_magnitudes(b, m, b + m, nb - m, sum_b);
+    uint32_t* z1 = bigint_alloc_limbs(n_sum_a + n_sum_b + 1);
+    int n_z1 = 0;
+    if (n_sum_a > 0 && n_sum_b > 0) {
+        bigint_multiply_magnitudes(sum_a, n_sum_a, sum_b, n_sum_b, z1);
+        n_z1 = bigint_trim(z1, n_sum_a + n_sum_b);
+    }
+    n_z1 = bigint_substract_magnitudes(z1, n_z1, z0, bigint_trim(z0, 2 * m), z1);
+    n_z1 = bigint_substract_magnitudes(z1, n_z1, z2, bigint_trim(z2, n - 2 * m), z1);
+    bigint_add_shifted(out, n, z1, n_z1, m);
+    bigint_free_limbs(sum_a);
+    bigint_free_limbs(sum_b);
+    bigint_free_limbs(z1);
 }
 
-lispenv* clone_lispenv(lispenv* origin_env)
+int bigint_divide_magnitudes(uint32_t* u, int nu, uint32_t* v, int nv, uint32_t* q)
+{
+    // q = u / v, for u and v trimmed, nu >= nv > 0. q has space for
+    // nu - nv + 1 limbs. Returns whether the division is exact.
+    // Knuth's algorithm D, from The Art of Computer Programming, 4.3.1.
+    if (nv == 1) {
+        uint64_t remainder = 0;
+        for (int i = nu - 1; i >= 0; i--) {
+            uint64_t current = remainder * BIGINT_BASE + u[i];
+            q[i] = current / v[0];
+            remainder = current % v[0];
+        }
+        return remainder == 0;
+    }
+    // Scale u and v so that the top limb of v is at least BIGINT_BASE / 2,
+    // which keeps the estimates of each limb of q off by at most 2.
+    uint32_t d = BIGINT_BASE / (v[nv - 1] + 1);
+    uint32_t* un = bigint_alloc_limbs(nu + 1);
+    uint32_t* vn = bigint_alloc_limbs(nv);
+    uint64_t carry = 0;
+    for (int i = 0; i < nu; i++) {
+        uint64_t t = (uint64_t)u[i] * d + carry;
+        un[i] = t % BIGINT_BASE;
+        carry = t / BIGINT_BASE;
+    }
+    un[nu] = carry;
+    carry = 0;
+    for (int i = 0; i < nv; i++) {
+        uint64_t t = (uint64_t)v[i] * d + carry;
+        vn[i] = t % BIGINT_BASE;
+        carry = t / BIGINT_BASE;
+    }
+    for (int j = nu - nv; j >= 0; j--) {
+        uint64_t top = (uint64_t)un[j + nv] * BIGINT_BASE + un[j + nv - 1];
+        uint64_t qhat = top / vn[nv - 1];
+        uint64_t rhat = top % vn[nv - 1];
+        while (qhat >= BIGINT_BASE || qhat * vn[nv - 2] > rhat * BIGINT_BASE + un[j + nv - 2]) {
+            qhat--;
+            rhat += vn[nv - 1];
+            if (rhat >= BIGINT_BASE)
+                break;
+        }
+        // un[j .. j + nv] -= qhat * vn
+        int64_t borrow = 0;
+        carry = 0;
+        for (int i = 0; i < nv; i++) {
+            uint64_t product = qhat * vn[i] + carry;
+            carry = product / BIGINT_BASE;
+            int64_t t = (int64_t)un[i + j] - (int64_t)(product % BIGINT_BASE) - borrow;
+            borrow = t < 0;
+            un[i + j] = t < 0 ? t + BIGINT_BASE : t;
+        }
+        int64_t t = (int64_t)un[j + nv] - (int64_t)carry - borrow;
+        un[j + nv] = t < 0 ? t + BIGINT_BASE : t;
+        if (t < 0) {
+            // qhat was one too large: add vn back
+            qhat--;
+            uint32_t add_carry = 0;
+            for (int i = 0; i < nv; i++) {
+                uint32_t sum = un[i + j] + vn[i] + add_carry;
+                add_carry = sum >= BIGINT_BASE;
+                un[i + j] = add_carry ? sum - BIGINT_BASE : sum;
+            }
+            un[j + nv] = (un[j + nv] + add_carry) % BIGINT_BASE;
+        }
+        q[j] = qhat;
+    }
+    // The remainder, scaled by d, is left in un[0 .. nv)
+    int exact = bigint_trim(un, nv) == 0;
+    bigint_free_limbs(un);
+    bigint_free_limbs(vn);
+    return exact;
+}
+
+#define BIGINT_DOUBLE_LIMBS 36 // enough for any finite double: 2^1024 < 10^(9 * 36)
+int bigint_magnitude_of_double(double x, uint32_t limbs[BIGINT_DOUBLE_LIMBS])
+{
+    // The magnitude of x, a finite, integral double, exactly. Returns its size.
+    // |x| = mantissa * 2^exponent, with a 53 bit mantissa
+    int exponent;
+    double fraction = frexp(fabs(x), &exponent);
+    unsigned long long mantissa = (unsigned long long)ldexp(fraction, 53);
+    exponent -= 53;
+    if (exponent < 0)
+        mantissa >>= -exponent; // x is integral, so no bits are lost
+    int size = 0;
+    for (; mantissa > 0; mantissa /= BIGINT_BASE) {
+        limbs[size++] = mantissa % BIGINT_BASE;
+    }
+    // Multiplied by 2^shift, 29 bits at a time, so that a limb times 2^shift fits in 64 bits
+    for (; exponent > 0; exponent -= 29) {
+        int shift = exponent < 29 ? exponent : 29;
+        uint64_t carry = 0;
+        for (int i = 0; i < size; i++) {
+            uint64_t t = ((uint64_t)limbs[i] << shift) + carry;
+            limbs[i] = t % BIGINT_BASE;
+            carry = t / BIGINT_BASE;
+        }
+        for (; carry > 0; carry /= BIGINT_BASE) {
+            limbs[size++] = carry % BIGINT_BASE;
+        }
+    }
+    return size;
+}
+
+// Vectors
+// A LISPVAL_VEC is a view of count contiguous doubles in a lispvec_buffer.
+// Buffers are 64-byte aligned, and refcounted, so that clones share them:
+// vectors are never modified once built.
+// The elementwise kernels work on 4 doubles at a time, with GCC's vector
+// extensions. On x86-64, they are compiled both for AVX2 and for the
+// baseline SSE2, and the version to run is picked at startup with cpuid.
+#define VEC_ALIGNMENT 64
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__TINYC__)
+#define VEC_KERNEL __attribute__((target_clones("avx2", "default")))
+#define VEC_LANES static inline __attribute__((always_inline))
+#else
+#define VEC_KERNEL
+#define VEC_LANES static inline
+#endif
+typedef double vec_lanes __attribute__((vector_size(4 * sizeof(double))));
+
+typedef struct lispvec_buffer {
+    int refcount;
+    double* data;
+} lispvec_buffer;
+
+lispvec_buffer* new_lispvec_buffer(long n)
+{
+    lispvec_buffer* buffer = malloc(sizeof(lispvec_buffer));
+    size_t size = ((n * sizeof(double) + VEC_ALIGNMENT - 1) / VEC_ALIGNMENT) * VEC_ALIGNMENT;
+    buffer->refcount = 1;
+    buffer->data = aligned_alloc(VEC_ALIGNMENT, size > 0 ? size : VEC_ALIGNMENT);
+    return buffer;
+}
+
+void release_lispvec_buffer(lispvec_buffer* buffer)
+{
+    // Atomically, since pmap's threads share buffers
+    if (__atomic_sub_fetch(&buffer->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    free(buffer->data);
+    free(buffer);
+}
+
+// acc[i] = acc[i] op y[i], or acc[i] op scalar if y is NULL.
+// The lanes are loaded and stored with memcpy, since views needn't be aligned.
+#define VEC_ELEMENTWISE_KERNEL(name, op)                              \
+    VEC_KERNEL void name(double* acc, double* y, double scalar, long n) \
+    {                                                                 \
+        long i = 0;                                                   \
+        vec_lanes a, b;                                               \
+        if (y == NULL) {                                              \
+            b = (vec_lanes) { scalar, scalar, scalar, scalar };       \
+            for (; i + 4 <= n; i += 4) {                              \
+                memcpy(&a, acc + i, sizeof(a));                       \
+                a = a op b;                                           \
+                memcpy(acc + i, &a, sizeof(a));                       \
+            }                                                         \
+            for (; i < n; i++)                                        \
+                acc[i] = acc[i] op scalar;                            \
+            return;                                                   \
+        }                                                             \
+        for (; i + 4 <= n; i += 4) {                                  \
+            memcpy(&a, acc + i, sizeof(a));                           \
+            memcpy(&b, y + i, sizeof(b));                             \
+            a = a op b;                                               \
+            memcpy(acc + i, &a, sizeof(a));                           \
+        }                                                             \
+        for (; i < n; i++)                                            \
+            acc[i] = acc[i] op y[i];                                  \
+    }
+VEC_ELEMENTWISE_KERNEL(vec_add, +)
+VEC_ELEMENTWISE_KERNEL(vec_substract, -)
+VEC_ELEMENTWISE_KERNEL(vec_multiply, *)
+VEC_ELEMENTWISE_KERNEL(vec_divide, /)
+
+// Reduction kernels. Each keeps several independent accumulators, so that
+// consecutive additions or multiplications don't wait on each other.
+void kahan_add(double* sum, double* compensation, double x)
+{
+    double y = x - *compensation;
+    double t = *sum + y;
+    *compensation = (t - *sum) - y;
+    *sum = t;
+}
+
+VEC_KERNEL double vec_naive_sum(double* x, long n)
+{
+    vec_lanes sum[2] = { { 0 }, { 0 } };
+    vec_lanes y;
+    long i = 0;
+    for (; i + 8 <= n; i += 8) {
+        for (int k = 0; k < 2; k++) {
+            memcpy(&y, x + i + 4 * k, sizeof(y));
+            sum[k] += y;
+        }
+    }
+    double total = 0;
+    for (int lane = 0; lane < 4; lane++) {
+        total += sum[0][lane] + sum[1][lane];
+    }
+    for (; i < n; i++)
+        total += x[i];
+    return total;
+}
+
+VEC_KERNEL double vec_sum(double* x, long n)
+{
+    // Kahan-compensated, in 8 lanes, which are then added up one at a time
+    vec_lanes sum[2] = { { 0 }, { 0 } };
+    vec_lanes compensation[2] = { { 0 }, { 0 } };
+    vec_lanes y, t;
+    long i = 0;
+    for (; i + 8 <= n; i += 8) {
+        for (int k = 0; k < 2; k++) {
+            memcpy(&y, x + i + 4 * k, sizeof(y));
+            y -= compensation[k];
+            t = sum[k] + y;
+            compensation[k] = (t - sum[k]) - y;
+            sum[k] = t;
+        }
+    }
+    double total = 0;
+    double total_compensation = 0;
+    for (int k = 0; k < 2; k++) {
+        for (int lane = 0; lane < 4; lane++) {
+            kahan_add(&total, &total_compensation, sum[k][lane]);
+            kahan_add(&total, &total_compensation, -compensation[k][lane]);
+        }
+    }
+    for (; i < n; i++)
+        kahan_add(&total, &total_compensation, x[i]);
+    // Infinities make the compensation nan
+    if (total != total)
+        return vec_naive_sum(x, n);
+    return total;
+}
+
+VEC_KERNEL double vec_product(double* x, long n)
+{
+    vec_lanes product[2] = { { 1, 1, 1, 1 }, { 1, 1, 1, 1 } };
+    vec_lanes y;
+    long i = 0;
+    for (; i + 8 <= n; i += 8) {
+        for (int k = 0; k < 2; k++) {
+            memcpy(&y, x + i + 4 * k, sizeof(y));
+            product[k] *= y;
+        }
+    }
+    double total = 1;
+    for (int lane = 0; lane < 4; lane++) {
+        total *= product[0][lane] * product[1][lane];
+    }
+    for (; i < n; i++)
+        total *= x[i];
+    return total;
+}
+
+VEC_KERNEL double vec_dot(double* x, double* y, long n)
+{
+    vec_lanes sum[2] = { { 0 }, { 0 } };
+    vec_lanes a, b;
+    long i = 0;
+    for (; i + 8 <= n; i += 8) {
+        for (int k = 0; k < 2; k++) {
+            memcpy(&a, x + i + 4 * k, sizeof(a));
+            memcpy(&b, y + i + 4 * k, sizeof(b));
+            sum[k] += a * b;
+        }
+    }
+    double total = 0;
+    for (int lane = 0; lane < 4; lane++) {
+        total += sum[0][lane] + sum[1][lane];
+    }
+    for (; i < n; i++)
+        total += x[i] * y[i];
+    return total;
+}
+
+VEC_KERNEL double vec_extremum(double* x, long n, int maximum)
+{
+    // n > 0. Written as comparisons and selects, which compile to minpd and maxpd.
+    double best[4] = { x[0], x[0], x[0], x[0] };
+    long i = 0;
+    if (maximum) {
+        for (; i + 4 <= n; i += 4) {
+            for (int k = 0; k < 4; k++)
+                best[k] = x[i + k] > best[k] ? x[i + k] : best[k];
+        }
+    } else {
+        for (; i + 4 <= n; i += 4) {
+            for (int k = 0; k < 4; k++)
+                best[k] = x[i + k] < best[k] ? x[i + k] : best[k];
+        }
+    }
+    for (; i < n; i++)
+        best[0] = (maximum ? x[i] > best[0] : x[i] < best[0]) ? x[i] : best[0];
+    for (int k = 1; k < 4; k++)
+        best[0] = (maximum ? best[k] > best[0] : best[k] < best[0]) ? best[k] : best[0];
+    return best[0];
+}
+
+// Transcendental kernels
+// exp, log, sin and cos of 4 lanes at a time, with the argument reductions and
+// polynomials of fdlibm, whose errors are below 1 ulp. Arguments which the
+// reductions don't handle (nans, infinities, subnormals, exp overflow and
+// underflow, angles beyond 1e5) are recomputed with libm afterwards.
+// Adding and substracting 1.5 * 2^52 rounds to an integer, and leaves that
+// integer in the low bits of the sum.
+typedef long long vec_integer_lanes __attribute__((vector_size(4 * sizeof(long long))));
+#define VEC_BROADCAST(x) ((vec_lanes) { x, x, x, x })
+#define VEC_SELECT(mask, a, b) ((vec_lanes)(((mask) & (vec_integer_lanes)(a)) | (~(mask) & (vec_integer_lanes)(b))))
+#define VEC_ROUNDING_MAGIC 6755399441055744.0
+
+VEC_LANES void exp_lanes(vec_lanes* x)
+{
+    // exp(x) = 2^k exp(r), with |r| <= ln(2) / 2
+    vec_lanes magic = VEC_BROADCAST(VEC_ROUNDING_MAGIC);
+    vec_lanes rounded = *x * 1.44269504088896338700e+00 + magic;
+    vec_integer_lanes k = (vec_integer_lanes)rounded - (vec_integer_lanes)magic;
+    vec_lanes fk = rounded - magic;
+    vec_lanes hi = *x - fk * 6.93147180369123816490e-01;
+    vec_lanes lo = fk * 1.90821492927058770002e-10;
+    vec_lanes r = hi - lo;
+    vec_lanes t = r * r;
+    vec_lanes c = r - t * (1.66666666666666019037e-01 + t * (-2.77777777770155933842e-03 + t * (6.61375632143793436117e-05 + t * (-1.65339022054652515390e-06 + t * 4.13813679705723846039e-08))));
+    vec_lanes y = 1.0 - ((lo - (r * c) / (2.0 - c)) - hi);
+    vec_integer_lanes two_to_the_k = (k + 1023) << 52;
+    *x = y * (vec_lanes)two_to_the_k;
+}
+
+VEC_LANES void log_lanes(vec_lanes* x)
+{
+    // x = 2^k m, with sqrt(2)/2 <= m < sqrt(2), and log(m) = log(1 + f) from
+    // s = f / (2 + f), as 2s + 2/3 s^3 + 2/5 s^5 + ...
+    vec_integer_lanes bits = (vec_integer_lanes)*x;
+    vec_integer_lanes mantissa = bits & 0x000fffffffffffffLL;
+    vec_integer_lanes above_sqrt2 = mantissa >= 0x6a09e667f3bcdLL;
+    vec_integer_lanes k = (bits >> 52) - 1023 - above_sqrt2;
+    vec_lanes m = (vec_lanes)(mantissa | ((0x3ffLL + above_sqrt2) << 52));
+    vec_lanes f = m - 1.0;
+    vec_lanes s = f / (2.0 + f);
+    vec_lanes z = s * s;
+    vec_lanes w = z * z;
+    vec_lanes t1 = w * (3.999999999940941908e-01 + w * (2.222219843214978396e-01 + w * 1.531383769920937332e-01));
+    vec_lanes t2 = z * (6.666666666666735130e-01 + w * (2.857142874366239149e-01 + w * (1.818357216161805012e-01 + w * 1.479819860511658591e-01)));
+    vec_lanes hfsq = 0.5 * f * f;
+    vec_lanes dk = __builtin_convertvector(k, vec_lanes);
+    *x = dk * 6.93147180369123816490e-01 - ((hfsq - (s * (hfsq + t2 + t1) + dk * 1.90821492927058770002e-10)) - f);
+}
+
+VEC_LANES void sin_cos_lanes(vec_lanes* x, int cosine)
+{
+    // x = n pi/2 + y, with |y| <= pi/4, and y kept as y0 + y1 to about 100 bits.
+    // pi/2 is split in three 33 bit pieces, so that n * piece is exact for n < 2^20.
+    vec_lanes magic = VEC_BROADCAST(VEC_ROUNDING_MAGIC);
+    vec_lanes rounded = *x * 6.36619772367581382433e-01 + magic;
+    vec_integer_lanes n = (vec_integer_lanes)rounded - (vec_integer_lanes)magic;
+    vec_lanes fn = rounded - magic;
+    vec_lanes r = *x - fn * 1.57079632673412561417e+00;
+    vec_lanes t = r;
+    vec_lanes w = fn * 6.07710050630396597660e-11;
+    r = t - w;
+    w = fn * 2.02226624879595063154e-21 - ((t - r) - w);
+    t = r;
+    w = fn * 2.02226624871116645580e-21;
+    r = t - w;
+    w = fn * 8.47842766036889956997e-32 - ((t - r) - w);
+    vec_lanes y0 = r - w;
+    vec_lanes y1 = (r - y0) - w;
+
+    // fdlibm's __kernel_sin and __kernel_cos
+    vec_lanes z = y0 * y0;
+    w = z * z;
+    vec_lanes v = z * y0;
+    vec_lanes rs = 8.33333333332248946124e-03 + z * (-1.98412698298579493134e-04 + z * 2.75573137070700676789e-06) + z * w * (-2.50507602534068634195e-08 + z * 1.58969099521155010221e-10);
+    vec_lanes sine = y0 - ((z * (0.5 * y1 - v * rs) - y1) - v * -1.66666666666666324348e-01);
+    vec_lanes rc = z * (4.16666666666666019037e-02 + z * (-1.38888888888741095749e-03 + z * 2.48015872894767294178e-05)) + w * w * (-2.75573143513906633035e-07 + z * (2.08757232129817482790e-09 + z * -1.13596475577881948265e-11));
+    vec_lanes hz = 0.5 * z;
+    w = 1.0 - hz;
+    vec_lanes cosine_of_y = w + (((1.0 - w) - hz) + (z * rc - y0 * y1));
+
+    // sin(x) is sin(y), cos(y), -sin(y), -cos(y) as n mod 4 is 0, 1, 2, 3; cos(x) is one quadrant ahead
+    vec_integer_lanes quadrant = (n + cosine) & 3;
+    vec_lanes answer = VEC_SELECT((quadrant & 1) != 0, cosine_of_y, sine);
+    *x = VEC_SELECT(quadrant >= 2, -answer, answer);
+}
+
+VEC_LANES void sin_lanes(vec_lanes* x) { sin_cos_lanes(x, 0); }
+VEC_LANES void cos_lanes(vec_lanes* x) { sin_cos_lanes(x, 1); }
+
+VEC_LANES void sqrt_lanes(vec_lanes* x)
+{
+    // sqrtpd, given -fno-math-errno. Correctly rounded either way.
+    for (int k = 0; k < 4; k++)
+        (*x)[k] = __builtin_sqrt((*x)[k]);
+}
+
+VEC_LANES void abs_lanes(vec_lanes* x)
+{
+    *x = (vec_lanes)((vec_integer_lanes)*x & 0x7fffffffffffffffLL);
+}
+
+// Which arguments the lanes functions handle, for numbers and for vec_lanes
+#define EXP_HANDLES(x) (((x) >= -708) & ((x) <= 708))
+#define LOG_HANDLES(x) (((x) >= DBL_MIN) & ((x) <= DBL_MAX))
+#define SIN_COS_HANDLES(x) (((x) >= -1e5) & ((x) <= 1e5))
+#define ALWAYS_HANDLES(x) (((x) == (x)) | ((x) != (x)))
+
+// acc[i] = f(acc[i]), with the lanes function, and libm for the arguments it
+// doesn't handle. The last, partial group of lanes is padded with ones.
+#define VEC_UNARY_KERNEL(name, lanes, handles, scalar)                 \
+    VEC_KERNEL void name(double* acc, long n)                          \
+    {                                                                  \
+        vec_lanes a, x;                                                \
+        for (long i = 0; i < n; i += 4) {                              \
+            long width = n - i < 4 ? n - i : 4;                        \
+            if (width == 4) {                                          \
+                memcpy(&x, acc + i, sizeof(x));                        \
+            } else {                                                   \
+                x = VEC_BROADCAST(1.0);                                \
+                memcpy(&x, acc + i, width * sizeof(double));           \
+            }                                                          \
+            a = x;                                                     \
+            lanes(&a);                                                 \
+            vec_integer_lanes handled = handles(x);                    \
+            if (!(handled[0] & handled[1] & handled[2] & handled[3])) { \
+                for (long k = 0; k < width; k++) {                     \
+                    if (!handles(x[k]))                                \
+                        a[k] = scalar(x[k]);                           \
+                }                                                      \
+            }                                                          \
+            if (width == 4) {                                          \
+                memcpy(acc + i, &a, sizeof(a));                        \
+            } else {                                                   \
+                memcpy(acc + i, &a, width * sizeof(double));           \
+            }                                                          \
+        }                                                              \
+    }
+VEC_UNARY_KERNEL(vec_exp, exp_lanes, EXP_HANDLES, exp)
+VEC_UNARY_KERNEL(vec_log, log_lanes, LOG_HANDLES, log)
+VEC_UNARY_KERNEL(vec_sin, sin_lanes, SIN_COS_HANDLES, sin)
+VEC_UNARY_KERNEL(vec_cos, cos_lanes, SIN_COS_HANDLES, cos)
+VEC_UNARY_KERNEL(vec_sqrt, sqrt_lanes, ALWAYS_HANDLES, sqrt)
+VEC_UNARY_KERNEL(vec_abs, abs_lanes, ALWAYS_HANDLES, fabs)
+
+void vec_pow(double* acc, double* y, double scalar, long n)
+{
+    // libm's pow, one element at a time: exp(y log(x)) from the kernels
+    // above would lose the last few bits for large results.
+    for (long i = 0; i < n; i++)
+        acc[i] = pow(acc[i], y == NULL ? scalar : y[i]);
+}
+
+// Random numbers
+// xoshiro256**, seeded through splitmix64, with one state per interpreter.
+// Doubles are made from the top 52 bits of a draw, as the mantissa of a
+// number in [1, 2), minus 1. Normals use a 128 layer ziggurat.
+// Bulk fills run 4 xoshiro256** streams at once, one per lane, whose states
+// are drawn from the interpreter's generator, so that they are reproducible
+// from the seed too. pmap's threads each have their own state.
+typedef unsigned long long vec_unsigned_lanes __attribute__((vector_size(4 * sizeof(unsigned long long))));
+__thread uint64_t random_state[4];
+#define ZIGGURAT_LAYERS 128
+#define ZIGGURAT_R 3.442619855899
+#define ZIGGURAT_V 9.91256303526217e-3
+double ziggurat_x[ZIGGURAT_LAYERS + 1];
+double ziggurat_f[ZIGGURAT_LAYERS + 1];
+
+uint64_t splitmix64(uint64_t* x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+void seed_random(uint64_t seed)
+{
+    for (int i = 0; i < 4; i++)
+        random_state[i] = splitmix64(&seed);
+}
+
+void init_random(void)
+{
+    seed_random(0);
+    // Layer i spans heights f(x[i]) to f(x[i + 1]), and up to x[i], with area V
+    ziggurat_x[0] = ZIGGURAT_V / exp(-0.5 * ZIGGURAT_R * ZIGGURAT_R);
+    ziggurat_x[1] = ZIGGURAT_R;
+    for (int i = 1; i < ZIGGURAT_LAYERS - 1; i++)
+        ziggurat_x[i + 1] = sqrt(-2 * log(ZIGGURAT_V / ziggurat_x[i] + exp(-0.5 * ziggurat_x[i] * ziggurat_x[i])));
+    ziggurat_x[ZIGGURAT_LAYERS] = 0;
+    for (int i = 0; i <= ZIGGURAT_LAYERS; i++)
+        ziggurat_f[i] = exp(-0.5 * ziggurat_x[i] * ziggurat_x[i]);
+}
+
+uint64_t random_next(void)
+{
+    uint64_t* s = random_state;
+    uint64_t x = s[1] * 5;
+    uint64_t result = ((x << 7) | (x >> 57)) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 45) | (s[3] >> 19);
+    return result;
+}
+
+double bits_to_uniform(uint64_t bits)
+{
+    // In [0, 1)
+    uint64_t mantissa = (bits >> 12) | 0x3ff0000000000000ULL;
+    double x;
+    memcpy(&x, &mantissa, sizeof(x));
+    return x - 1.0;
+}
+
+double random_uniform(void)
+{
+    return bits_to_uniform(random_next());
+}
+
+double random_normal_from_bits(uint64_t bits)
+{
+    // The low 7 bits pick the layer, the 8th the sign, and the top 52 the position
+    for (;;) {
+        int layer = bits & (ZIGGURAT_LAYERS - 1);
+        double sign = (bits & ZIGGURAT_LAYERS) ? -1 : 1;
+        double z = bits_to_uniform(bits) * ziggurat_x[layer];
+        if (z < ziggurat_x[layer + 1])
+            return sign * z;
+        if (layer == 0) {
+            // The tail beyond R, by Marsaglia's method
+            double a, b;
+            do {
+                a = -log(1.0 - random_uniform()) / ZIGGURAT_R;
+                b = -log(1.0 - random_uniform());
+            } while (b + b < a * a);
+            return sign * (ZIGGURAT_R + a);
+        }
+        double y = ziggurat_f[layer] + random_uniform() * (ziggurat_f[layer + 1] - ziggurat_f[layer]);
+        if (y < exp(-0.5 * z * z))
+            return sign * z;
+        bits = random_next();
+    }
+}
+
+double random_normal(void)
+{
+    return random_normal_from_bits(random_next());
+}
+
+uint64_t random_below(uint64_t n)
+{
+    // Uniform in [0, n), without bias, by Lemire's multiply and reject. n = 0 means 2^64.
+    if (n == 0)
+        return random_next();
+    unsigned __int128 m = (unsigned __int128)random_next() * n;
+    uint64_t low = (uint64_t)m;
+    if (low < n) {
+        uint64_t threshold = (0 - n) % n;
+        while (low < threshold) {
+            m = (unsigned __int128)random_next() * n;
+            low = (uint64_t)m;
+        }
+    }
+    return m >> 64;
+}
+
+VEC_KERNEL void vec_random_bits(uint64_t* out, long n)
+{
+    // out[i] = draws from 4 interleaved xoshiro256** streams
+    vec_unsigned_lanes s[4];
+    for (int i = 0; i < 4; i++) {
+        for (int lane = 0; lane < 4; lane++)
+            s[i][lane] = random_next();
+    }
+    vec_unsigned_lanes x, result, t;
+    for (long i = 0; i < n; i += 4) {
+        x = (s[1] << 2) + s[1];
+        result = (x << 7) | (x >> 57);
+        result = (result << 3) + result;
+        t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = (s[3] << 45) | (s[3] >> 19);
+        memcpy(out + i, &result, (n - i < 4 ? n - i : 4) * sizeof(uint64_t));
+    }
+}
+
+VEC_KERNEL void vec_random_uniform(double* acc, double low, double high, long n)
+{
+    // acc is reused for the raw bits
+    vec_random_bits((uint64_t*)acc, n);
+    vec_unsigned_lanes bits;
+    vec_lanes x;
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        memcpy(&bits, acc + i, sizeof(bits));
+        x = (vec_lanes)((bits >> 12) | 0x3ff0000000000000ULL) - 1.0;
+        x = low + (high - low) * x;
+        memcpy(acc + i, &x, sizeof(x));
+    }
+    for (; i < n; i++) {
+        uint64_t b;
+        memcpy(&b, acc + i, sizeof(b));
+        acc[i] = low + (high - low) * bits_to_uniform(b);
+    }
+}
+
+void vec_random_normal(double* acc, double mean, double sd, long n)
+{
+    // The bits are generated in bulk; the ziggurat then accepts ~99% of
+    // them on its first comparison, and draws more for the rest.
+    vec_random_bits((uint64_t*)acc, n);
+    for (long i = 0; i < n; i++) {
+        uint64_t b;
+        memcpy(&b, acc + i, sizeof(b));
+        acc[i] = mean + sd * random_normal_from_bits(b);
+    }
+}
+
+// Strings
+// A LISPVAL_STR is str_length bytes: stored inline, if there are at most
+// LISPSTR_INLINE_SIZE of them, or else a view of the bytes from str_offset
+// on of a lispstr_node. Nodes are refcounted and never modified, so that
+// clones and substrings share them. A node is either a leaf, which holds
+// bytes, or the concatenation of two nodes, so that concat needn't copy
+// either side: the nodes form a rope. Short pieces appended or prepended to
+// a rope are merged into its last or first leaf, and ropes deeper than LISPSTR_MAX_DEPTH are
+// rebalanced, so that appending repeatedly is not quadratic.
+// Lengths and indices are in bytes.
+#define LISPSTR_INLINE_SIZE 23
+#define LISPSTR_LEAF_MERGE 256 // pieces up to this long are copied rather than shared
+#define LISPSTR_MAX_DEPTH 48
+
+typedef struct lispstr_node {
+    int refcount;
+    int depth; // 0 for leaves
+    long long length;
+    char* bytes; // for leaves
+    struct lispstr_node* left; // for concatenations
+    struct lispstr_node* right;
+} lispstr_node;
+
+lispstr_node* new_lispstr_leaf(long long length)
+{
+    // Its bytes are filled in by the caller
+    lispstr_node* node = malloc(sizeof(lispstr_node));
+    node->refcount = 1;
+    node->depth = 0;
+    node->length = length;
+    node->bytes = malloc(length > 0 ? length : 1);
+    node->left = NULL;
+    node->right = NULL;
+    return node;
+}
+
+lispstr_node* new_lispstr_concat(lispstr_node* left, lispstr_node* right)
+{
+    // Takes references to left and right
+    lispstr_node* node = malloc(sizeof(lispstr_node));
+    node->refcount = 1;
+    node->depth = 1 + (left->depth > right->depth ? left->depth : right->depth);
+    node->length = left->length + right->length;
+    node->bytes = NULL;
+    node->left = left;
+    node->right = right;
+    return node;
+}
+
+lispstr_node* retain_lispstr_node(lispstr_node* node)
+{
+    __atomic_add_fetch(&node->refcount, 1, __ATOMIC_RELAXED);
+    return node;
+}
+
+void release_lispstr_node(lispstr_node* node)
+{
+    // Atomically, as for vector buffers
+    if (__atomic_sub_fetch(&node->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    if (node->bytes != NULL) {
+        free(node->bytes);
+    } else {
+        release_lispstr_node(node->left);
+        release_lispstr_node(node->right);
+    }
+    free(node);
+}
+
+typedef void (*lispstr_chunk_func)(char* bytes, long long n, void* context);
+
+void lispstr_node_chunks(lispstr_node* node, long long offset, long long length, lispstr_chunk_func f, void* context)
+{
+    // Calls f on the leaves' pieces of bytes offset to offset + length, in order
+    while (length > 0) {
+        if (node->bytes != NULL) {
+            f(node->bytes + offset, length, context);
+            return;
+        }
+        long long left_length = node->left->length;
+        if (offset < left_length) {
+            long long n = left_length - offset < length ? left_length - offset : length;
+            lispstr_node_chunks(node->left, offset, n, f, context);
+            offset = 0;
+            length -= n;
+        } else {
+            offset -= left_length;
+        }
+        node = node->right;
+    }
+}
+
+void lispstr_chunks(lispval* s, lispstr_chunk_func f, void* context)
+{
+    if (s->str_node == NULL) {
+        f(s->str_inline, s->str_length, context);
+    } else {
+        lispstr_node_chunks(s->str_node, s->str_offset, s->str_length, f, context);
+    }
+}
+
+void copy_lispstr_chunk(char* bytes, long long n, void* context)
+{
+    char** destination = context;
+    memcpy(*destination, bytes, n);
+    *destination += n;
+}
+
+void copy_lispstr_bytes(lispval* s, char* destination)
+{
+    lispstr_chunks(s, copy_lispstr_chunk, &destination);
+}
+
+char* lispstr_to_cstring(lispval* s)
+{
+    // A NUL-terminated copy, to be freed by the caller
+    char* cstring = malloc(s->str_length + 1);
+    copy_lispstr_bytes(s, cstring);
+    cstring[s->str_length] = '\0';
+    return cstring;
+}
+
+lispstr_node* lispstr_node_of(lispval* s)
+{
+    // A node with exactly the bytes of s: its own, if it isn't a part of it
+    if (s->str_node != NULL && s->str_offset == 0 && s->str_length == s->str_node->length)
+        return retain_lispstr_node(s->str_node);
+    lispstr_node* leaf = new_lispstr_leaf(s->str_length);
+    copy_lispstr_bytes(s, leaf->bytes);
+    return leaf;
+}
+
+void collect_lispstr_leaves(lispstr_node* node, lispstr_node** leaves, int* count)
+{
+    if (node->bytes != NULL) {
+        leaves[(*count)++] = node;
+        return;
+    }
+    collect_lispstr_leaves(node->left, leaves, count);
+    collect_lispstr_leaves(node->right, leaves, count);
+}
+
+lispstr_node* build_balanced_lispstr(lispstr_node** leaves, int count)
+{
+    if (count == 1)
+        return retain_lispstr_node(leaves[0]);
+    lispstr_node* left = build_balanced_lispstr(leaves, count / 2);
+    lispstr_node* right = build_balanced_lispstr(leaves + count / 2, count - count / 2);
+    return new_lispstr_concat(left, right);
+}
+
+int count_lispstr_leaves(lispstr_node* node)
+{
+    return node->bytes != NULL ? 1 : count_lispstr_leaves(node->left) + count_lispstr_leaves(node->right);
+}
+
+lispstr_node* rebalance_lispstr(lispstr_node* node)
+{
+    // Takes the reference to node, and returns a balanced rope with the same leaves
+    int count = count_lispstr_leaves(node);
+    lispstr_node** leaves = malloc(sizeof(lispstr_node*) * count);
+    count = 0;
+    collect_lispstr_leaves(node, leaves, &count);
+    lispstr_node* balanced = build_balanced_lispstr(leaves, count);
+    free(leaves);
+    release_lispstr_node(node);
+    return balanced;
+}
+
+int compare_lispstrs(lispval* a, lispval* b)
+{
+    // -1, 0 or 1, comparing bytewise, as memcmp
+    char* x = a->str_node == NULL ? a->str_inline : lispstr_to_cstring(a);
+    char* y = b->str_node == NULL ? b->str_inline : lispstr_to_cstring(b);
+    long long n = a->str_length < b->str_length ? a->str_length : b->str_length;
+    int comparison = memcmp(x, y, n);
+    if (comparison == 0)
+        comparison = (a->str_length > b->str_length) - (a->str_length < b->str_length);
+    if (x != a->str_inline)
+        free(x);
+    if (y != b->str_inline)
+        free(y);
+    return comparison > 0 ? 1 : comparison < 0 ? -1 : 0;
+}
+
+// Hash maps
+// A LISPVAL_MAP holds a lispmap: entries in insertion order, and an open
+// addressing table of slots, probed linearly, which index into them. Keys
+// can be any value, compared with lispvals_equal and hashed with hash_lispval.
+// Removing an entry leaves a hole, which the next resize compacts away.
+// Tables are refcounted, so that clones share them; assoc and dissoc copy a
+// table before changing it, unless they hold its only reference.
+#define LISPMAP_MIN_SLOTS 8
+
+typedef struct lispmap {
+    int refcount;
+    int count; // entries, without holes
+    int used; // entries, with holes
+    int capacity; // of the entry arrays: 3/4 of the slots
+    lispval** keys; // NULL for holes
+    lispval** vals;
+    unsigned long long* hashes;
+    int* slots; // entry index, or -1 if empty
+    int slot_mask; // there are slot_mask + 1 slots, a power of two
+    unsigned long long entries_hash; // 0 until computed, see hash_lispval
+} lispmap;
+
+lispmap* new_lispmap(int count)
+{
+    // Room for count entries without resizing
+    int slots = LISPMAP_MIN_SLOTS;
+    while (slots / 4 * 3 < count) {
+        slots *= 2;
+    }
+    lispmap* map = malloc(sizeof(lispmap));
+    map->refcount = 1;
+    map->count = 0;
+    map->used = 0;
+    map->capacity = slots / 4 * 3;
+    map->keys = malloc(sizeof(lispval*) * map->capacity);
+    map->vals = malloc(sizeof(lispval*) * map->capacity);
+    map->hashes = malloc(sizeof(unsigned long long) * map->capacity);
+    map->slots = malloc(sizeof(int) * slots);
+    for (int i = 0; i < slots; i++) {
+        map->slots[i] = -1;
+    }
+    map->slot_mask = slots - 1;
+    map->entries_hash = 0;
+    return map;
+}
+
+void release_lispmap(lispmap* map)
+{
+    // Atomically, as for vector buffers
+    if (__atomic_sub_fetch(&map->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    for (int i = 0; i < map->used; i++) {
+        if (map->keys[i] != NULL) {
+            delete_lispval(map->keys[i]);
+            delete_lispval(map->vals[i]);
+        }
+    }
+    free(map->keys);
+    free(map->vals);
+    free(map->hashes);
+    free(map->slots);
+    free(map);
+}
+
+int lispmap_is_key(lispval* key)
+{
+    // Keys are found with lispvals_equal, so nan, which isn't equal to
+    // itself, can't be one, and nor can transients, which change.
+    if (key->type == LISPVAL_NUM)
+        return !isnan(key->num);
+    return key->type != LISPVAL_TRANSIENT;
+}
+
+int lispmap_find_slot(lispmap* map, lispval* key, unsigned long long hash)
+{
+    // The slot which holds key, or the empty slot where it would go
+    int slot = hash & map->slot_mask;
+    for (;;) {
+        int entry = map->slots[slot];
+        if (entry == -1 || (map->hashes[entry] == hash && lispvals_equal(map->keys[entry], key)))
+            return slot;
+        slot = (slot + 1) & map->slot_mask;
+    }
+}
+
+lispval* lispmap_get(lispmap* map, lispval* key)
+{
+    // Borrowed, or NULL if key isn't in map
+    int entry = map->slots[lispmap_find_slot(map, key, hash_lispval(key))];
+    return entry == -1 ? NULL : map->vals[entry];
+}
+
+void lispmap_append(lispmap* map, lispval* key, lispval* val, unsigned long long hash)
+{
+    // Takes ownership of key, which isn't in map, and val. Needs room.
+    int entry = map->used++;
+    map->keys[entry] = key;
+    map->vals[entry] = val;
+    map->hashes[entry] = hash;
+    int slot = hash & map->slot_mask;
+    while (map->slots[slot] != -1) {
+        slot = (slot + 1) & map->slot_mask;
+    }
+    map->slots[slot] = entry;
+    map->count++;
+}
+
+void lispmap_resize(lispmap* map)
+{
+    // Compacts the entries, into a table with room for as many again
+    lispmap* resized = new_lispmap(2 * map->count + 1);
+    for (int i = 0; i < map->used; i++) {
+        if (map->keys[i] != NULL)
+            lispmap_append(resized, map->keys[i], map->vals[i], map->hashes[i]);
+    }
+    free(map->keys);
+    free(map->vals);
+    free(map->hashes);
+    free(map->slots);
+    resized->refcount = map->refcount;
+    resized->entries_hash = map->entries_hash;
+    *map = *resized;
+    free(resized);
+}
+
+void lispmap_insert(lispmap* map, lispval* key, lispval* val)
+{
+    // Takes ownership of key and val
+    unsigned long long hash = hash_lispval(key);
+    int entry = map->slots[lispmap_find_slot(map, key, hash)];
+    map->entries_hash = 0;
+    if (entry != -1) {
+        delete_lispval(map->vals[entry]);
+        map->vals[entry] = val;
+        delete_lispval(key);
+        return;
+    }
+    if (map->used == map->capacity)
+        lispmap_resize(map);
+    lispmap_append(map, key, val, hash);
+}
+
+void lispmap_remove(lispmap* map, lispval* key)
+{
+    int slot = lispmap_find_slot(map, key, hash_lispval(key));
+    int entry = map->slots[slot];
+    if (entry == -1)
+        return;
+    map->entries_hash = 0;
+    delete_lispval(map->keys[entry]);
+    delete_lispval(map->vals[entry]);
+    map->keys[entry] = NULL;
+    map->vals[entry] = NULL;
+    map->count--;
+    // Shift back the entries after it whose probe passed through its slot,
+    // so that lookups never need to skip over empty slots
+    int empty = slot;
+    for (int next = (slot + 1) & map->slot_mask; map->slots[next] != -1; next = (next + 1) & map->slot_mask) {
+        int home = map->hashes[map->slots[next]] & map->slot_mask;
+        if (((next - home) & map->slot_mask) >= ((next - empty) & map->slot_mask)) {
+            map->slots[empty] = map->slots[next];
+            empty = next;
+        }
+    }
+    map->slots[empty] = -1;
+}
+
+lispmap* copy_lispmap(lispmap* map)
+{
+    // An unshared copy, without holes
+    lispmap* copy = new_lispmap(map->count);
+    for (int i = 0; i < map->used; i++) {
+        if (map->keys[i] != NULL)
+            lispmap_append(copy, clone_lispval(map->keys[i]), clone_lispval(map->vals[i]), map->hashes[i]);
+    }
+    copy->entries_hash = map->entries_hash;
+    return copy;
+}
+
+// Streams
+// A LISPVAL_STREAM is a lazy sequence: a source, which is a list, a vector,
+// a range or the lines of a file, followed by map, filter, take and drop
+// stages.
+// Each stage is a lispstream which points to the stream it applies to, so
+// that adding one is O(1), and streams share their common prefixes. Nothing
+// is evaluated until a terminal operation, collect or reduce, runs the
+// stages on each element before reading the next one: a single loop, with
+// no intermediate lists.
+enum {
+    LISPSTREAM_SOURCE,
+    LISPSTREAM_MAP,
+    LISPSTREAM_FILTER,
+    LISPSTREAM_TAKE,
+    LISPSTREAM_DROP,
+};
+
+typedef struct lispstream {
+    int refcount;
+    int kind;
+    struct lispstream* parent; // NULL for sources
+    lispval* source; // a list, vector or range, or a string: the path of a file
+    lispval* f; // for map and filter
+    long long n; // for take and drop
+} lispstream;
+
+lispstream* new_lispstream(int kind, lispstream* parent)
+{
+    // Takes a reference to parent
+    lispstream* s = malloc(sizeof(lispstream));
+    s->refcount = 1;
+    s->kind = kind;
+    s->parent = parent;
+    s->source = NULL;
+    s->f = NULL;
+    s->n = 0;
+    return s;
+}
+
+void release_lispstream(lispstream* s)
+{
+    // Atomically, as for vector buffers. Iterative, since chains can be long.
+    while (s != NULL && __atomic_sub_fetch(&s->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        lispstream* parent = s->parent;
+        if (s->source != NULL)
+            delete_lispval(s->source);
+        if (s->f != NULL)
+            delete_lispval(s->f);
+        free(s);
+        s = parent;
+    }
+}
+
+int count_lispstream_stages(lispstream* s)
+{
+    int count = 0;
+    for (; s->kind != LISPSTREAM_SOURCE; s = s->parent) {
+        count++;
+    }
+    return count;
+}
+
+// Transients
+// A LISPVAL_TRANSIENT is a builder for a list or a map, which push!, assoc!
+// and dissoc! change in place, rather than copying, so that accumulating n
+// elements takes O(n) rather than O(n^2). Clones share the builder, since
+// get_from_lispenv clones what it finds. Lists keep spare capacity, which
+// doubles whenever it runs out.
+// persistent! hands the list or map over in O(1), and leaves the builder
+// frozen, i.e., empty, so that nothing can change or read what is now a
+// persistent value through it. Only the thread which made a transient can
+// use it, so that pmap's threads don't race on it.
+typedef struct lisptransient {
+    int refcount;
+    pthread_t owner;
+    lispval* value; // the list or map being built, or NULL once frozen
+    int capacity; // of value->cell, for lists
+} lisptransient;
+
+lisptransient* new_lisptransient(lispval* value)
+{
+    // Takes ownership of value
+    lisptransient* t = malloc(sizeof(lisptransient));
+    t->refcount = 1;
+    t->owner = pthread_self();
+    t->value = value;
+    t->capacity = value->count;
+    return t;
+}
+
+void release_lisptransient(lisptransient* t)
+{
+    // Atomically, as for vector buffers
+    if (__atomic_sub_fetch(&t->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (t->value != NULL)
+            delete_lispval(t->value);
+        free(t);
+    }
+}
+
+// Constructors
+lispval* lispval_num(double x)
+{
+    lispval* v = malloc(sizeof(lispval));
+    v->type = LISPVAL_NUM;
+    v->count = 0;
+    v->num = x;
+    TRACE_EVENT(TRACE_EVENT_ALLOC, v);
+    return v;
+}
+
+lispval* lispval_int(long long x)
+{
+    lispval* v = malloc(sizeof(lispval));
+    v->type = LISPVAL_INT;
+    v->count = 0;
+    v->integer = x;
+    TRACE_EVENT(TRACE_EVENT_ALLOC, v);
+    return v;
+}
+
+lispval* lispval_bigint(int sign, uint32_t* limbs, int size)
+{
+    // Takes ownership of limbs, which should come from bigint_alloc_limbs.
+    // Gives a LISPVAL_INT if the value fits in one.
+    size = bigint_trim(limbs, size);
+    if (size <= 3) {
+        unsigned long long x = 0;
+        int fits = 1;
+        for (int i = size - 1; i >= 0 && fits; i--) {
+            fits = x <= (ULLONG_MAX - limbs[i]) / BIGINT_BASE;
+            x = x * BIGINT_BASE + limbs[i];
+        }
+        unsigned long long largest = sign > 0 ? LLONG_MAX : (unsigned long long)LLONG_MAX + 1;
+        if (fits && x <= largest) {
+            bigint_free_limbs(limbs);
+            if (sign > 0)
+                return lispval_int(x);
+            return lispval_int(x == largest ? LLONG_MIN : -(long long)x);
+        }
+    }
+    lispval* v = malloc(sizeof(lispval));
+    v->type = LISPVAL_BIGINT;
+    v->count = 0;
+    v->bigint_sign = sign;
+    v->bigint_size = size;
+    v->bigint_limbs = limbs;
+    TRACE_EVENT(TRACE_EVENT_ALLOC, v);
+    return v;
+}
+
+lispval* lispval_bigint_from_decimal(char* digits)
+{
+    // digits: an optional minus sign, then decimal digits
+    int sign = 1;
+    if (digits[0] == '-') {
+        sign = -1;
+        digits++;
+    }
+    int n = strlen(digits);
+    int size = (n + BIGINT_BASE_DIGITS - 1) / BIGINT_BASE_DIGITS;
+    uint32_t* limbs = bigint_alloc_limbs(size);
+    for (int i = 0; i < size; i++) {
+        // The i-th limb holds the digits in [end - BIGINT_BASE_DIGITS, end)
+        int end = n - i * BIGINT_BASE_DIGITS;
+        int start = end > BIGINT_BASE_DIGITS ? end - BIGINT_BASE_DIGITS : 0;
+        uint32_t limb = 0;
+        for (int j = start; j < end; j++) {
+            limb = limb * 10 + (digits[j] - '0');
+        }
+        limbs[i] = limb;
+    }
+    return lispval_bigint(sign, limbs, size);
+}
+
+lispval* lispval_vec(lispvec_buffer* buffer, double* data, long n)
+{
+    // Takes a reference to buffer, which holds the n doubles from data on.
+    lispval* v = malloc(sizeof(lispval));
+    v->type = LISPVAL_VEC;
+    v->count = n;
+    v->vec_buffer = buffer;
+    v->vec = data;
+    TRACE_EVENT(TRACE_EVENT_ALLOC, v);
+    return v;
+}
+
+lispval* lispval_map(lispmap* map)
+{
+    // Takes a reference to map
+    lispval* v = malloc(sizeof(lispval));
+    v->type = LISPVAL_MAP;
+    v->count = 0;
+    v->map = map;
+    TRACE_EVENT(TRACE_EVENT_ALLOC, v);
+    return v;
+}
+
+lispval* lispval_stream(lispstream* s)
+{
+    // Takes a reference to s
+    lispval* v = malloc(sizeof(lispval));
+    v->type = LISPVAL_STREAM;
+    v->count = 0;
+    v->stream = s;
+    TRACE_EVENT(TRACE_EVENT_ALLOC, v);
+    return v;
+}
+
+lispval* lispval_transient(lisptransient* t)
+{
+    // Takes a reference to t
+    lispval* v = malloc(sizeof(lispval));
+    v->type = LISPVAL_TRANSIENT;
+    v->count = 0;
+    v->transient = t;
+    TRACE_EVENT(TRACE_EVENT_ALLOC, v);
+    return v;
+}
+
+lispval* lispval_range(long long start, long long step, long long length)
+{
+    lispval* v = malloc(sizeof(lispval));
+    v->type = LISPVAL_RANGE;
+    v->count = 0;
+    v->range_start = start;
+    v->range_step = step;
+    v->range_length = length;
+    TRACE_EVENT(TRACE_EVENT_ALLOC, v);
+    return v;
+}
+
+long long range_element(lispval* v, long long i)
+{
+    // Doesn't overflow, since elements lie between start and stop
+    return (long long)((unsigned long long)v->range_start + (unsigned long long)i * (unsigned long long)v->range_step);
+}
+
+lispval* lispval_err(char* message)
+{
+    lispval* v = malloc(sizeof(lispval));
+    v->type = LISPVAL_ERR;
+    v->count = 0;
+    v->err = malloc(strlen(message) + 1);
+    strcpy(v->err, message);
+    TRACE_EVENT(TRACE_EVENT_ALLOC, v);
+    return v;
+}
+
+lispval* lispval_sym(char* symbol)
+{
+    lispval* v = malloc(sizeof(lispval));
+    v->type = LISPVAL_SYM;
+    v->count = 0;
+    v->sym = malloc(strlen(symbol) + 1);
+    strcpy(v->sym, symbol);
+    TRACE_EVENT(TRACE_EVENT_ALLOC, v);
+    return v;
+}
+
+lispval* lispval_str(char* bytes, long long length)
+{
+    // Copies the bytes
+    lispval* v = malloc(sizeof(lispval));
+    v->type = LISPVAL_STR;
+    v->count = 0;
+    v->str_offset = 0;
+    v->str_length = length;
+    if (length <= LISPSTR_INLINE_SIZE) {
+        v->str_node = NULL;
+        memcpy(v->str_inline, bytes, length);
+    } else {
+        v->str_node = new_lispstr_leaf(length);
+        memcpy(v->str_node->bytes, bytes, length);
+    }
+    TRACE_EVENT(TRACE_EVENT_ALLOC, v);
+    return v;
+}
+
+lispval* lispval_str_view(lispstr_node* node, long long offset, long long length)
+{
+    // Takes a reference to node, which holds the length bytes from offset on.
+    // Short strings are copied inline instead.
+    if (length <= LISPSTR_INLINE_SIZE) {
+        char bytes[LISPSTR_INLINE_SIZE];
+        char* destination = bytes;
+        lispstr_node_chunks(node, offset, length, copy_lispstr_chunk, &destination);
+        release_lispstr_node(node);
+        return lispval_str(bytes, length);
+    }
+    lispval* v = malloc(sizeof(lispval));
+    v->type = LISPVAL_STR;
+    v->count = 0;
+    v->str_node = node;
+    v->str_offset = offset;
+    v->str_length = length;
+    TRACE_EVENT(TRACE_EVENT_ALLOC, v);
+    return v;
+}
+
+lispval* lispval_builtin_func(lispbuiltin func, char* builtin_func_name)
+{
+    lispval* v = malloc(sizeof(lispval));
+    v->type = LISPVAL_BUILTIN_FUNC;
+    v->count = 0;
+    v->builtin_func_name = malloc(strlen(builtin_func_name) + 1);
+    strcpy(v->builtin_func_name, builtin_func_name);
+    v->builtin_func = func;
+    TRACE_EVENT(TRACE_EVENT_ALLOC, v);
+    return v;
+}
+
+lispval* lispval_lambda_func(lispval* variables, lispval* manipulation, lispenv* env, lispfunc_info* func_info)
+{
+    /* correct idiom for calling this:
+    lispval* variables = clone_lispval(v->cell[0]);
+    lispval* manipulation = clone_lispval(v->cell[1]);
+		lispenv* env = NULL; // clone_lispval(blah)
+    lispval* lambda = lispval_lambda_func(variables, manipulation, NULL, NULL);
+		 */
+    // Takes a reference to func_info, which clones of a function share; a new one if NULL.
+    lispval* v = malloc(sizeof(lispval));
+    v->type = LISPVAL_USER_FUNC;
+    v->count = 0;
+    v->env = (env == NULL ? new_lispenv() : env);
+    v->variables = variables;
+    v->manipulation = manipulation;
+    v->func_info = (func_info == NULL ? new_lispfunc_info() : func_info);
+    // Previously: unclear how to garbage-collect this. Maybe add to a list and collect at the end?
+    // Now: Hah! Lambda functions are just added to the environment, so they will just
+    // be destroyed when it is destroyed.
+		// But no! in def {id} (@ {x} {x}), there is a copy of a lambda function in 
+		// the arguments to def. Aarg!
+    TRACE_EVENT(TRACE_EVENT_ALLOC, v);
+    return v;
+}
+
+lispval* lispval_sexpr(void)
+{
+    lispval* v = malloc(sizeof(lispval));
+    v->type = LISPVAL_SEXPR;
+    v->count = 0;
+    v->cell = NULL;
+    v->cell_hash = 0;
+    TRACE_EVENT(TRACE_EVENT_ALLOC, v);
+    return v;
+}
+
+lispval* lispval_qexpr(void)
+{
+    lispval* v = malloc(sizeof(lispval));
+    v->type = LISPVAL_QEXPR;
+    v->count = 0;
+    v->cell = NULL;
+    v->cell_hash = 0;
+    TRACE_EVENT(TRACE_EVENT_ALLOC, v);
+    return v;
+}
+
+// Destructor
+void delete_lispval(lispval* v)
+{
+    if (v == NULL || v->type > LARGEST_LISPVAL)
+        return;
+    TRACE_EVENT(TRACE_EVENT_FREE, v);
+    switch (v->type) {
+    case LISPVAL_NUM:
+    case LISPVAL_INT:
+    case LISPVAL_RANGE:
+        if (v != NULL)
+            free(v);
+        break;
+    case LISPVAL_BIGINT:
+        bigint_free_limbs(v->bigint_limbs);
+        v->bigint_limbs = NULL;
+        free(v);
+        break;
+    case LISPVAL_VEC:
+        release_lispvec_buffer(v->vec_buffer);
+        v->vec_buffer = NULL;
+        free(v);
+        break;
+    case LISPVAL_MAP:
+        release_lispmap(v->map);
+        v->map = NULL;
+        free(v);
+        break;
+    case LISPVAL_STR:
+        if (v->str_node != NULL)
+            release_lispstr_node(v->str_node);
+        v->str_node = NULL;
+        free(v);
+        break;
+    case LISPVAL_STREAM:
+        release_lispstream(v->stream);
+        v->stream = NULL;
+        free(v);
+        break;
+    case LISPVAL_TRANSIENT:
+        release_lisptransient(v->transient);
+        v->transient = NULL;
+        free(v);
+        break;
+    case LISPVAL_ERR:
+        if (v->err != NULL)
+            free(v->err);
+        v->err = NULL;
+        if (v != NULL)
+            free(v);
+        break;
+    case LISPVAL_SYM:
+        if (v->sym != NULL)
+            free(v->sym);
+        v->sym = NULL;
+        if (v != NULL)
+            free(v);
+        break;
+    case LISPVAL_BUILTIN_FUNC:
+        if (v->builtin_func_name != NULL) {
+            free(v->builtin_func_name);
+            v->builtin_func_name = NULL;
+        }
+        if (v != NULL)
+            free(v);
+        // Don't do anything with v->func for now
+        // Though we could delete the pointer to the function later
+        // free(v->func);
+        break;
+    case LISPVAL_USER_FUNC:
+        // This shouldn't fire until the end, unless we are deleting the operands of a builtin function.
+        // E.g,. in def {id} (@ {x} {x}), there is a lambda function in the arguments, which should get collected.
+        if (v->env != NULL) {
+            destroy_lispenv(v->env);
+            // ^ free(v->env) is not necessary; taken care of by destroy_lispenv
+            v->env = NULL;
+        }
+        if (v->func_info != NULL) {
+            release_lispfunc_info(v->func_info);
+            v->func_info = NULL;
+        }
+        // Every function owns its variables and manipulation: clones clone them.
+        if (v->variables != NULL) {
+            delete_lispval(v->variables);
+            v->variables = NULL;
+        }
+        if (v->manipulation != NULL) {
+            delete_lispval(v->manipulation);
+            v->manipulation = NULL;
+        }
+        if (v != NULL)
+            free(v);
+        // Don't do anything with v->func for now
+        // Though we could delete the pointer to the function later
+        // 
+				// free(v->func);
+        /*
+        */
+        break;
+    case LISPVAL_SEXPR:
+    case LISPVAL_QEXPR:
+        for (int i = 0; i < v->count; i++) {
+            if (v->cell[i] != NULL)
+                delete_lispval(v->cell[i]);
+            v->cell[i] = NULL;
+        }
+        v->count = 0;
+
+        if (v->cell != NULL)
+            free(v->cell);
+        v->cell = NULL;
+
+        if (v != NULL)
+            free(v);
+        break;
+    default:
+        // Unknown expression type. This is probably indicative that you are trying to delete a previously deleted object
+        break;
+    }
+    // v = NULL; this is only our local pointer, sadly.
+}
+
+// Environment
+struct lispenv {
+    int count;
+    char** syms; // list of strings
+    lispval** vals; // list of pointers to vals
+    lispenv* parent;
+};
+
+lispenv* new_lispenv()
+{
+    lispenv* e = malloc(sizeof(lispenv));
+    e->count = 0;
+    e->syms = NULL;
+    e->vals = NULL;
+    e->parent = NULL;
+    return e;
+}
+
+void destroy_lispenv(lispenv* env)
+{
+    for (int i = 0; i < env->count; i++) {
+        free(env->syms[i]);
+        delete_lispval(env->vals[i]);
+        env->syms[i] = NULL;
+        env->vals[i] = NULL;
+    }
+    free(env->syms);
+    env->syms = NULL;
+    free(env->vals);
+    env->vals = NULL;
+    free(env);
+    env = NULL;
+    // parent is it's own environment
+    // so it isn't destroyed
+}
+
+lispval* get_from_lispenv(char* sym, lispenv* env)
+{
+    for (int i = 0; i < env->count; i++) {
+        if (strcmp(env->syms[i], sym) == 0) {
+            TRACE_EVENT(TRACE_EVENT_ENV_LOOKUP, env->vals[i]);
+            return clone_lispval(env->vals[i]);
+            // return env->vals[i];
+            // to do: make sure that the clone is deleted.
+        }
+    }
+
+    if (env->parent != NULL) {
+        return get_from_lispenv(sym, env->parent);
+    } else {
+        if (VERBOSE)
+            printfln("Unbound symbol %s", sym);
+        return lispval_err("Error: unbound symbol");
+    }
+    // and this explains shadowing!
+}
+
+lispval* lookup_in_lispenv(char* sym, lispenv* env)
+{
+    // As get_from_lispenv, but borrowed, and NULL if sym is unbound
+    for (; env != NULL; env = env->parent) {
+        for (int i = 0; i < env->count; i++) {
+            if (strcmp(env->syms[i], sym) == 0)
+                return env->vals[i];
+        }
+    }
+    return NULL;
+}
+
+void insert_in_current_lispenv_without_clone(char* sym, lispval* v, lispenv* env)
+{
+    // Takes ownership of v, e.g., of a value that evaluate_lispval just produced.
+    TRACE_EVENT(TRACE_EVENT_ENV_INSERT, v);
+    for (int i = 0; i < env->count; i++) {
+        if (strcmp(env->syms[i], sym) == 0) {
+            delete_lispval(env->vals[i]);
+            env->vals[i] = v;
+            return;
+        }
+    }
+    // Expand memory *for the arrays*
+    env->count++;
+    env->syms = realloc(env->syms, sizeof(char*) * env->count);
+    env->vals = realloc(env->vals, sizeof(lispval*) * env->count);
+
+    // Copy contents over
+    env->vals[env->count - 1] = v;
+    env->syms[env->count - 1] = malloc(strlen(sym) + 1);
+    strcpy(env->syms[env->count - 1], sym);
+}
+
+void insert_in_current_lispenv(char* sym, lispval* v, lispenv* env)
+{
+    insert_in_current_lispenv_without_clone(sym, clone_lispval(v), env);
+}
+
+void insert_in_parentmost_lispenv(char* sym, lispval* v, lispenv* env)
+{
+    // note that you could have two chains of envs, though hopefully not.
+    while (env->parent != NULL) {
+        env = env->parent;
+    }
+    insert_in_current_lispenv(sym, v, env);
+}
+
+lispenv* clone_lispenv(lispenv* origin_env)
 {
     lispenv* new_env = malloc(sizeof(lispenv));
     new_env->count = origin_env->count;
     new_env->parent = origin_env->parent;
 
-    new_env->syms = malloc(sizeof(char*) * origin_env->count);
-    new_env->vals = malloc(sizeof(lispval*) * origin_env->count);
+    new_env->syms = malloc(sizeof(char*) * origin_env->count);
+    new_env->vals = malloc(sizeof(lispval*) * origin_env->count);
+
+    for (int i = 0; i < origin_env->count; i++) {
+        new_env->syms[i] = malloc(strlen(origin_env->syms[i]) + 1);
+        strcpy(new_env->syms[i], origin_env->syms[i]);
+        new_env->vals[i] = clone_lispval(origin_env->vals[i]);
+    }
+    return new_env;
+}
+
+// Read ast into a lispval object
+lispval* lispval_append_child(lispval* parent, lispval* child)
+{
+    parent->count = parent->count + 1;
+    parent->cell = realloc(parent->cell, sizeof(lispval) * parent->count);
+    parent->cell[parent->count - 1] = child;
+    parent->cell_hash = 0;
+    return parent;
+}
+lispval* lispval_take_child(lispval* parent, int i)
+{
+    // Detach the i-th child, so that deleting the parent doesn't delete it.
+    lispval* child = parent->cell[i];
+    parent->cell[i] = NULL;
+    parent->cell_hash = 0;
+    return child;
+}
+
+lispval* lispval_take_child_and_delete(lispval* parent, int i)
+{
+    // The i-th child, with the rest of parent deleted
+    lispval* child = lispval_take_child(parent, i);
+    delete_lispval(parent);
+    return child;
+}
+lispval* read_lispval_num(mpc_ast_t* t)
+{
+    // Literals without a decimal point are integers, big if need be
+    errno = 0;
+    if (strchr(t->contents, '.') == NULL) {
+        long long n = strtoll(t->contents, NULL, 10);
+        if (errno != ERANGE)
+            return lispval_int(n);
+        return lispval_bigint_from_decimal(t->contents);
+    }
+    double x = strtod(t->contents, NULL);
+    return errno != ERANGE ? lispval_num(x)
+                           : lispval_err("Error: Invalid number.");
+}
+
+lispval* read_lispval_str(mpc_ast_t* t)
+{
+    // Without the quotes, and with the escapes replaced
+    char* contents = malloc(strlen(t->contents) + 1);
+    strcpy(contents, t->contents + 1);
+    contents[strlen(contents) - 1] = '\0';
+    contents = mpcf_unescape(contents);
+    lispval* s = lispval_str(contents, strlen(contents));
+    free(contents);
+    return s;
+}
+
+lispval* read_lispval(mpc_ast_t* t)
+{
+    // Non-ignorable children
+    // Relevant for the edge-case of considering the case where you
+    // only have one top level item in brackets
+    int c = 0;
+    int c_index = -1;
+    for (int i = 0; i < t->children_num; i++) {
+        mpc_ast_t* child = t->children[i];
+        if ((strcmp(child->tag, "regex") != 0) || (strcmp(child->contents, "") != 0) || child->children_num != 0) {
+            c++;
+            c_index = i;
+        }
+    }
+    if (VERBOSE)
+        printfln("Non ignorable children: %i", c);
+
+    if (strstr(t->tag, "number")) {
+        return read_lispval_num(t);
+    } else if (strstr(t->tag, "symbol")) {
+        return lispval_sym(t->contents);
+    } else if (strstr(t->tag, "string")) {
+        return read_lispval_str(t);
+    } else if ((strcmp(t->tag, ">") == 0) && (c == 1)) {
+        return read_lispval(t->children[c_index]);
+    } else if ((strcmp(t->tag, ">") == 0) || strstr(t->tag, "sexpr") || strstr(t->tag, "qexpr")) {
+        lispval* x;
+        if ((strcmp(t->tag, ">") == 0) || strstr(t->tag, "sexpr")) {
+            x = lispval_sexpr();
+        } else if (strstr(t->tag, "qexpr")) {
+            x = lispval_qexpr();
+        } else {
+            return lispval_err("Error: Unreachable code state reached.");
+        }
+
+        for (int i = 0; i < (t->children_num); i++) {
+            if (strcmp(t->children[i]->contents, "(") == 0) {
+                continue;
+            } else if (strcmp(t->children[i]->contents, ")") == 0) {
+                continue;
+            } else if (strcmp(t->children[i]->contents, "{") == 0) {
+                continue;
+            } else if (strcmp(t->children[i]->contents, "}") == 0) {
+                continue;
+            } else if (strcmp(t->children[i]->tag, "regex") == 0) {
+                continue;
+            } else {
+                x = lispval_append_child(x, read_lispval(t->children[i]));
+            }
+        }
+        return x;
+    } else {
+        lispval* err = lispval_err("Unknown AST type.");
+        return err;
+    }
+}
+
+// Print
+void print_env(lispenv* env)
+{
+    printfln("Environment: ");
+    for (int i = 0; i < env->count; i++) {
+        printfln("Value for symbol %s: ", env->syms[i]);
+        print_lispval_tree(env->vals[i], 2);
+    }
+}
+char* bigint_to_decimal(lispval* v)
+{
+    // Each limb is BIGINT_BASE_DIGITS decimal digits, except that the top one
+    // isn't zero-padded
+    char* digits = malloc(BIGINT_BASE_DIGITS * v->bigint_size + 2);
+    int n = sprintf(digits, "%s%u", v->bigint_sign < 0 ? "-" : "", v->bigint_limbs[v->bigint_size - 1]);
+    for (int i = v->bigint_size - 2; i >= 0; i--) {
+        n += sprintf(digits + n, "%09u", v->bigint_limbs[i]);
+    }
+    return digits;
+}
+
+void print_lispval_tree(lispval* v, int indent_level)
+{
+    char* indent = malloc(sizeof(char) * (indent_level + 1));
+    for (int i = 0; i < indent_level; i++) {
+        indent[i] = ' ';
+    }
+    indent[indent_level] = '\0';
+
+    switch (v->type) {
+    case LISPVAL_NUM:
+        printfln("%sNumber: %f", indent, v->num);
+        break;
+    case LISPVAL_INT:
+        printfln("%sInteger: %lld", indent, v->integer);
+        break;
+    case LISPVAL_BIGINT: {
+        char* digits = bigint_to_decimal(v);
+        printfln("%sBig integer: %s", indent, digits);
+        free(digits);
+        break;
+    }
+    case LISPVAL_RANGE:
+        printfln("%sRange, with %lld elements from %lld by %lld", indent, v->range_length, v->range_start, v->range_step);
+        break;
+    case LISPVAL_VEC:
+        printfln("%sVector, with %d elements:", indent, v->count);
+        for (int i = 0; i < v->count; i++) {
+            printfln("%s  %f", indent, v->vec[i]);
+        }
+        break;
+    case LISPVAL_MAP:
+        printfln("%sMap, with %d entries:", indent, v->map->count);
+        for (int i = 0; i < v->map->used; i++) {
+            if (v->map->keys[i] != NULL) {
+                print_lispval_tree(v->map->keys[i], indent_level + 2);
+                print_lispval_tree(v->map->vals[i], indent_level + 4);
+            }
+        }
+        break;
+    case LISPVAL_ERR:
+        printfln("%s%s", indent, v->err);
+        break;
+    case LISPVAL_SYM:
+        printfln("%sSymbol: %s", indent, v->sym);
+        break;
+    case LISPVAL_STR: {
+        char* cstring = lispstr_to_cstring(v);
+        printfln("%sString, with %lld bytes: %s", indent, v->str_length, cstring);
+        free(cstring);
+        break;
+    }
+    case LISPVAL_STREAM:
+        printfln("%sStream, with %d stages", indent, count_lispstream_stages(v->stream));
+        break;
+    case LISPVAL_TRANSIENT:
+        if (v->transient->value == NULL)
+            printfln("%sTransient, frozen", indent);
+        else if (v->transient->value->type == LISPVAL_MAP)
+            printfln("%sTransient map, with %d entries", indent, v->transient->value->map->count);
+        else
+            printfln("%sTransient list, with %d elements", indent, v->transient->value->count);
+        break;
+    case LISPVAL_BUILTIN_FUNC:
+        printfln("%sFunction, name: %s, pointer: %p", indent, v->builtin_func_name, v->builtin_func);
+        break;
+    case LISPVAL_USER_FUNC:
+        printfln("%sUser-defined function: %p", indent, v->env); // Identify it with its environment?
+        print_lispval_tree(v->variables, indent_level + 2);
+        print_lispval_tree(v->manipulation, indent_level + 2);
+        break;
+    case LISPVAL_SEXPR:
+        printfln("%sSExpr, with %d children:", indent, v->count);
+        for (int i = 0; i < v->count; i++) {
+            print_lispval_tree(v->cell[i], indent_level + 2);
+        }
+        break;
+    case LISPVAL_QEXPR:
+        printfln("%sQExpr, with %d children:", indent, v->count);
+        for (int i = 0; i < v->count; i++) {
+            print_lispval_tree(v->cell[i], indent_level + 2);
+        }
+        break;
+    default:
+        if (VERBOSE)
+            printfln("Error: unknown lispval type\n");
+        // printfln("%s", v->sym);
+    }
+    if (VERBOSE > 1)
+        printfln("Freeing indent");
+    if (indent != NULL)
+        free(indent);
+    indent = NULL;
+    if (VERBOSE > 1)
+        printfln("Freed indent");
+}
+
+void print_escaped_lispstr_chunk(char* bytes, long long n, void* context)
+{
+    // As a C string literal would be written
+    for (long long i = 0; i < n; i++) {
+        switch (bytes[i]) {
+        case '"':
+            printf("\\\"");
+            break;
+        case '\\':
+            printf("\\\\");
+            break;
+        case '\n':
+            printf("\\n");
+            break;
+        case '\t':
+            printf("\\t");
+            break;
+        case '\r':
+            printf("\\r");
+            break;
+        default:
+            putchar(bytes[i]);
+        }
+    }
+}
+
+void print_lispval_parenthesis(lispval* v)
+{
+    switch (v->type) {
+    case LISPVAL_NUM:
+        printf("%f ", v->num);
+        break;
+    case LISPVAL_INT:
+        printf("%lld ", v->integer);
+        break;
+    case LISPVAL_BIGINT: {
+        char* digits = bigint_to_decimal(v);
+        printf("%s ", digits);
+        free(digits);
+        break;
+    }
+    case LISPVAL_RANGE:
+        printf("<range, %lld elements from %lld by %lld> ", v->range_length, v->range_start, v->range_step);
+        break;
+    case LISPVAL_VEC:
+        printf("[ ");
+        for (int i = 0; i < v->count; i++) {
+            printf("%f ", v->vec[i]);
+        }
+        printf("] ");
+        break;
+    case LISPVAL_MAP:
+        printf("#{ ");
+        for (int i = 0; i < v->map->used; i++) {
+            if (v->map->keys[i] != NULL) {
+                print_lispval_parenthesis(v->map->keys[i]);
+                print_lispval_parenthesis(v->map->vals[i]);
+            }
+        }
+        printf("} ");
+        break;
+    case LISPVAL_ERR:
+        printf("%s ", v->err);
+        break;
+    case LISPVAL_SYM:
+        printf("%s ", v->sym);
+        break;
+    case LISPVAL_STR:
+        putchar('"');
+        lispstr_chunks(v, print_escaped_lispstr_chunk, NULL);
+        printf("\" ");
+        break;
+    case LISPVAL_STREAM:
+        printf("<stream, %d stages> ", count_lispstream_stages(v->stream));
+        break;
+    case LISPVAL_TRANSIENT:
+        if (v->transient->value == NULL)
+            printf("<transient, frozen> ");
+        else if (v->transient->value->type == LISPVAL_MAP)
+            printf("<transient map, %d entries> ", v->transient->value->map->count);
+        else
+            printf("<transient list, %d elements> ", v->transient->value->count);
+        break;
+    case LISPVAL_BUILTIN_FUNC:
+        printf("<function, name: %s, pointer: %p> ", v->builtin_func_name, v->builtin_func);
+        break;
+    case LISPVAL_USER_FUNC:
+        printf("<user-defined function, pointer: %p> ", v->env);
+        break;
+    case LISPVAL_SEXPR:
+        printf("( ");
+        for (int i = 0; i < v->count; i++) {
+            print_lispval_parenthesis(v->cell[i]);
+        }
+        printf(") ");
+        break;
+    case LISPVAL_QEXPR:
+        printf("{ ");
+        for (int i = 0; i < v->count; i++) {
+            print_lispval_parenthesis(v->cell[i]);
+        }
+        printf("} ");
+        break;
+    default:
+        if (VERBOSE)
+            printfln("Error: unknown lispval type\n");
+        // printfln("%s", v->sym);
+    }
+}
+
+void print_ast(mpc_ast_t* ast, int indent_level)
+{
+    char* indent = malloc(sizeof(char) * (indent_level + 1)); // "";
+    for (int i = 0; i < indent_level; i++) {
+        indent[i] = ' ';
+    }
+    indent[indent_level] = '\0';
+    printfln("%sTag: %s", indent, ast->tag);
+    printfln("%sContents: %s", indent,
+        strcmp(ast->contents, "") ? ast->contents : "None");
+    printfln("%sNumber of children: %i", indent, ast->children_num);
+    /* Print the children */
+    for (int i = 0; i < ast->children_num; i++) {
+        mpc_ast_t* child_i = ast->children[i];
+        printfln("%sChild #%d", indent, i);
+        print_ast(child_i, indent_level + 2);
+    }
+    free(indent);
+    indent = NULL;
+}
+
+// Hashing
+// Structural: values which are = hash the same, see lispvals_equal.
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+unsigned long long hash_bytes(unsigned long long hash, void* bytes, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        hash ^= ((unsigned char*)bytes)[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+void hash_lispstr_chunk(char* bytes, long long n, void* context)
+{
+    // FNV-1a is a stream, so a rope hashes as its flattened bytes would
+    unsigned long long* hash = context;
+    *hash = hash_bytes(*hash, bytes, n);
+}
+
+unsigned long long hash_lispval(lispval* v)
+{
+    if (lispval_is_number(v)) {
+        // By value, since = compares numbers exactly by value: integers, and
+        // doubles which are integral, as integers, so that 1 hashes as 1.0
+        // does, and other doubles as doubles.
+        int integral = v->type != LISPVAL_NUM || (isfinite(v->num) && v->num == trunc(v->num));
+        int type = integral ? LISPVAL_INT : LISPVAL_NUM;
+        unsigned long long hash = hash_bytes(FNV_OFFSET_BASIS, &type, sizeof(int));
+        if (!integral)
+            return hash_bytes(hash, &v->num, sizeof(double));
+        if (v->type == LISPVAL_INT || (v->type == LISPVAL_NUM && fabs(v->num) < 0x1p63)) {
+            long long x = v->type == LISPVAL_INT ? v->integer : (long long)v->num; // -0.0 is 0
+            return hash_bytes(hash, &x, sizeof(long long));
+        }
+        // Beyond a long long: as big integers, by sign and limbs
+        int sign = v->type == LISPVAL_BIGINT ? v->bigint_sign : v->num < 0 ? -1 : 1;
+        uint32_t double_limbs[BIGINT_DOUBLE_LIMBS];
+        uint32_t* limbs = v->bigint_limbs;
+        int size = v->bigint_size;
+        if (v->type == LISPVAL_NUM) {
+            limbs = double_limbs;
+            size = bigint_magnitude_of_double(v->num, double_limbs);
+        }
+        hash = hash_bytes(hash, &sign, sizeof(int));
+        return hash_bytes(hash, limbs, sizeof(uint32_t) * size);
+    }
+    unsigned long long hash = hash_bytes(FNV_OFFSET_BASIS, &v->type, sizeof(int));
+    switch (v->type) {
+    case LISPVAL_RANGE: {
+        // The step of a range with fewer than two elements, and the start of
+        // an empty one, don't matter
+        long long fields[3] = { v->range_length, v->range_length > 0 ? v->range_start : 0, v->range_length > 1 ? v->range_step : 0 };
+        return hash_bytes(hash, fields, sizeof(fields));
+    }
+    case LISPVAL_VEC:
+        for (int i = 0; i < v->count; i++) {
+            double x = v->vec[i] == 0 ? 0 : v->vec[i];
+            hash = hash_bytes(hash, &x, sizeof(double));
+        }
+        return hash;
+    case LISPVAL_MAP: {
+        // Independent of the order of the entries. Cached, until the map changes.
+        unsigned long long entries = __atomic_load_n(&v->map->entries_hash, __ATOMIC_RELAXED);
+        if (entries == 0) {
+            for (int i = 0; i < v->map->used; i++) {
+                if (v->map->keys[i] != NULL) {
+                    unsigned long long val = hash_lispval(v->map->vals[i]);
+                    entries += hash_bytes(v->map->hashes[i], &val, sizeof(val));
+                }
+            }
+            __atomic_store_n(&v->map->entries_hash, entries, __ATOMIC_RELAXED);
+        }
+        return hash_bytes(hash, &entries, sizeof(entries));
+    }
+    case LISPVAL_ERR:
+        return hash_bytes(hash, v->err, strlen(v->err));
+    case LISPVAL_SYM:
+        return hash_bytes(hash, v->sym, strlen(v->sym));
+    case LISPVAL_STR:
+        lispstr_chunks(v, hash_lispstr_chunk, &hash);
+        return hash;
+    case LISPVAL_BUILTIN_FUNC:
+        return hash_bytes(hash, v->builtin_func_name, strlen(v->builtin_func_name));
+    case LISPVAL_USER_FUNC: {
+        unsigned long long children[2] = { hash_lispval(v->variables), hash_lispval(v->manipulation) };
+        return hash_bytes(hash, children, sizeof(children));
+    }
+    case LISPVAL_SEXPR:
+    case LISPVAL_QEXPR: {
+        // The hash of the cells is cached, until they change, so that
+        // hashing a list again, or one which contains it, is O(1) for it.
+        // Clones keep it, and eval turning a q-expression into an
+        // s-expression doesn't change it.
+        unsigned long long cells = __atomic_load_n(&v->cell_hash, __ATOMIC_RELAXED);
+        if (cells == 0) {
+            cells = FNV_OFFSET_BASIS;
+            for (int i = 0; i < v->count; i++) {
+                unsigned long long child = hash_lispval(v->cell[i]);
+                cells = hash_bytes(cells, &child, sizeof(child));
+            }
+            __atomic_store_n(&v->cell_hash, cells, __ATOMIC_RELAXED);
+        }
+        return hash_bytes(hash, &cells, sizeof(cells));
+    }
+    default:
+        return hash;
+    }
+}
+
+// Cloners
+lispval* clone_lispval(lispval* old)
+{
+    lispval* new;
+    switch (old->type) {
+    case LISPVAL_NUM:
+        new = lispval_num(old->num);
+        break;
+    case LISPVAL_INT:
+        new = lispval_int(old->integer);
+        break;
+    case LISPVAL_BIGINT: {
+        uint32_t* limbs = bigint_alloc_limbs(old->bigint_size);
+        memcpy(limbs, old->bigint_limbs, sizeof(uint32_t) * old->bigint_size);
+        new = lispval_bigint(old->bigint_sign, limbs, old->bigint_size);
+        break;
+    }
+    case LISPVAL_RANGE:
+        new = lispval_range(old->range_start, old->range_step, old->range_length);
+        break;
+    case LISPVAL_VEC:
+        __atomic_add_fetch(&old->vec_buffer->refcount, 1, __ATOMIC_RELAXED);
+        new = lispval_vec(old->vec_buffer, old->vec, old->count);
+        break;
+    case LISPVAL_MAP:
+        __atomic_add_fetch(&old->map->refcount, 1, __ATOMIC_RELAXED);
+        new = lispval_map(old->map);
+        break;
+    case LISPVAL_STREAM:
+        __atomic_add_fetch(&old->stream->refcount, 1, __ATOMIC_RELAXED);
+        new = lispval_stream(old->stream);
+        break;
+    case LISPVAL_TRANSIENT:
+        __atomic_add_fetch(&old->transient->refcount, 1, __ATOMIC_RELAXED);
+        new = lispval_transient(old->transient);
+        break;
+    case LISPVAL_ERR:
+        new = lispval_err(old->err);
+        break;
+    case LISPVAL_SYM:
+        new = lispval_sym(old->sym);
+        break;
+    case LISPVAL_STR:
+        if (old->str_node == NULL) {
+            new = lispval_str(old->str_inline, old->str_length);
+        } else {
+            new = lispval_str_view(retain_lispstr_node(old->str_node), old->str_offset, old->str_length);
+        }
+        break;
+    case LISPVAL_BUILTIN_FUNC:
+        new = lispval_builtin_func(old->builtin_func, old->builtin_func_name);
+        break;
+    case LISPVAL_USER_FUNC:
+        // Cloning a function happens on every call, since get_from_lispenv clones what it finds.
+        lispval* variables = clone_lispval(old->variables);
+        lispval* manipulation = clone_lispval(old->manipulation);
+        lispenv* env = clone_lispenv(old->env);
+        // clones share their function info
+        __atomic_add_fetch(&old->func_info->refcount, 1, __ATOMIC_RELAXED);
+        new = lispval_lambda_func(variables, manipulation, env, old->func_info);
+        // new = lispval_lambda_func(old->variables, old->manipulation, old->env);
+        // Also, fun to notice how these choices around implementation would determine tricky behaviour details around variable shadowing.
+        break;
+    case LISPVAL_SEXPR:
+        new = lispval_sexpr();
+        break;
+    case LISPVAL_QEXPR:
+        new = lispval_qexpr();
+        break;
+    default:
+        return lispval_err("Error: Cloning element of unknown type.");
+    }
+
+    if ((old->type == LISPVAL_QEXPR || old->type == LISPVAL_SEXPR) && (old->count > 0)) {
+        for (int i = 0; i < old->count; i++) {
+            lispval* temp_child = old->cell[i];
+            lispval* child = clone_lispval(temp_child);
+            lispval_append_child(new, child);
+        }
+        new->cell_hash = __atomic_load_n(&old->cell_hash, __ATOMIC_RELAXED);
+    }
+    return new;
+}
+
+// Operations
+// Ops for q-expressions
+lispval* builtin_head(lispval* v, lispenv* e)
+{
+    // printfln("Entering builtin_head with v->count = %d and v->cell[0]->type = %d\n", v->count, v->cell[0]->type);
+    // head { 1 2 3 }
+    // But actually, that gets processd into head ({ 1 2 3 }), hence the v->cell[0]->cell[0];
+    LISPVAL_ASSERT(v->count == 1, "Error: function head passed too many arguments");
+    if (v->cell[0]->type == LISPVAL_RANGE) {
+        LISPVAL_ASSERT(v->cell[0]->range_length != 0, "Error: Argument passed to head is an empty range");
+        return lispval_int(v->cell[0]->range_start);
+    }
+    LISPVAL_ASSERT(v->cell[0]->type == LISPVAL_QEXPR, "Error: Argument passed to head is not a q-expr, i.e., a bracketed list.");
+    LISPVAL_ASSERT(v->cell[0]->count != 0, "Error: Argument passed to head is {}");
+    lispval* result = clone_lispval(v->cell[0]->cell[0]);
+    return result;
+    // Returns something that should be freed later: yes.
+    // Returns something that doesn't share pointers with the input: yes.
+}
+
+lispval* builtin_tail(lispval* v, lispenv* env)
+{
+    // tail { 1 2 3 }
+    LISPVAL_ASSERT(v->count == 1, "Error: function tail passed too many arguments");
+
+    lispval* old = v->cell[0];
+    if (old->type == LISPVAL_RANGE) {
+        LISPVAL_ASSERT(old->range_length != 0, "Error: Argument passed to tail is an empty range");
+        if (old->range_length == 1)
+            return lispval_range(old->range_start, old->range_step, 0);
+        return lispval_range(old->range_start + old->range_step, old->range_step, old->range_length - 1);
+    }
+    LISPVAL_ASSERT(old->type == LISPVAL_QEXPR, "Error: Argument passed to tail is not a q-expr, i.e., a bracketed list.");
+    LISPVAL_ASSERT(old->count != 0, "Error: Argument passed to tail is {}");
+
+    lispval* new = lispval_qexpr();
+    if (old->count == 1) {
+        return new;
+    } else if (old->count > 1 && old->type == LISPVAL_QEXPR) {
+        for (int i = 1; i < (old->count); i++) {
+            // lispval_append_child(new, clone_lispval(old->cell[i]));
+            lispval_append_child(new, clone_lispval(old->cell[i]));
+        }
+        return new;
+    } else {
+        delete_lispval(new);
+        return lispval_err("Error: Unreachable point reached in tail function");
+    }
+
+    // Returns something that should be freed later: yes.
+    // Returns something that doesn't share pointers with the input: yes.
+}
+
+lispval* builtin_list(lispval* v, lispenv* e)
+{
+    // list ( 1 2 3 )
+    LISPVAL_ASSERT(v->count == 1, "Error: function list passed too many arguments");
+    lispval* old = v->cell[0];
+    LISPVAL_ASSERT(old->type == LISPVAL_SEXPR, "Error: Argument passed to list is not an s-expr, i.e., a list with parenthesis.");
+    lispval* new = clone_lispval(old);
+    new->type = LISPVAL_QEXPR;
+    return new;
+    // Returns something that should be freed later: yes.
+    // Returns something that is independent of the input: yes.
+}
+
+lispval* builtin_len(lispval* v, lispenv* e)
+{
+    // len { 1 2 3 }
+    LISPVAL_ASSERT(v->count == 1, "Error: function len passed too many arguments");
+
+    lispval* source = v->cell[0];
+    if (source->type == LISPVAL_TRANSIENT) {
+        lispval* error = usable_lisptransient(source, -1);
+        if (error != NULL)
+            return error;
+        source = source->transient->value;
+    }
+    if (source->type == LISPVAL_RANGE)
+        return lispval_int(source->range_length);
+    if (source->type == LISPVAL_MAP)
+        return lispval_int(source->map->count);
+    if (source->type == LISPVAL_STR)
+        return lispval_int(source->str_length);
+    LISPVAL_ASSERT(source->type == LISPVAL_QEXPR || source->type == LISPVAL_VEC, "Error: Argument passed to len is not a q-expr, i.e., a bracketed list, a vector, a range, a map, a string or a transient.");
+    lispval* new = lispval_int(source->count);
+    return new;
+    // Returns something that should be freed later: yes.
+    // Returns something that doesn't share pointers with the input: yes.
+}
+
+lispval* builtin_eval(lispval* v, lispenv* env)
+{
+    // eval { + 1 2 3 }
+    // not sure how this will end up working, but we'll see
+    LISPVAL_ASSERT(v->count == 1, "Error: function eval passed too many arguments");
+    lispval* old = v->cell[0];
+    LISPVAL_ASSERT(old->type == LISPVAL_QEXPR || old->type == LISPVAL_QEXPR, "Error: Argument passed to eval is not a q-expr, i.e., a bracketed list.");
+    lispval* temp = clone_lispval(old);
+    temp->type = LISPVAL_SEXPR;
+    lispval* answer = evaluate_lispval(temp, env);
+    answer = evaluate_lispval(answer, env);
+    // ^ needed to make this example work:
+    //  (eval {head {+ -}}) 1 2 3
+    //  though I'm not sure why
+    // temp is consumed by evaluate_lispval, so it isn't deleted here.
+    return answer;
+    // Returns something that should be freed later: probably.
+    // Returns something that is independent of the input: depends on the output of evaluate_lispval.
+}
+
+lispval* builtin_join(lispval* l, lispenv* e)
+{
+    // return lispval_err("Error: Join not ready yet.");
+    // join { {1 2} {3 4} }
+    print_lispval_parenthesis(l);
+    LISPVAL_ASSERT(l->count == 1, "Error: function join passed too many arguments");
+    lispval* old = l->cell[0];
+    LISPVAL_ASSERT(old->type == LISPVAL_QEXPR, "Error: function join not passed q-expression");
+    lispval* result = lispval_qexpr();
+    for (int i = 0; i < old->count; i++) {
+        lispval* temp = old->cell[i];
+        LISPVAL_ASSERT(temp->type == LISPVAL_QEXPR, "Error: function join not passed a q expression with other q-expressions");
+
+        for (int j = 0; j < temp->count; j++) {
+            lispval_append_child(result, clone_lispval(temp->cell[j]));
+        }
+    }
+    return result;
+    // Returns something that should be freed later: yes.
+    // Returns something that is independent of the input: yes.
+}
+
+// Define a variable
+lispval* builtin_def(lispval* v, lispenv* env)
+{
+    // Takes two arguments: argument: def {a} 1; def {init} (@ {x y} {x})
+    lispval* symbol_wrapper = v->cell[0];
+    lispval* value = v->cell[1];
+
+    insert_in_current_lispenv(symbol_wrapper->cell[0]->sym, value, env);
+    lispval* source = v->cell[0];
+    return lispval_sexpr(); // ()
+    LISPVAL_ASSERT(v->count == 1, "Error: function def passed too many arguments");
+    LISPVAL_ASSERT(source->type == LISPVAL_QEXPR, "Error: Argument passed to def is not a q-expr, i.e., a bracketed list.");
+    LISPVAL_ASSERT(source->count == 2, "Error: Argument passed to def should be a q expr with two q expressions as children: def { { a b } { 1 2 } } ");
+    LISPVAL_ASSERT(source->cell[0]->type == LISPVAL_QEXPR, "Error: Argument passed to def should be a q expr with two q expressions as children: def { { a b } { 1 2 } } ");
+    LISPVAL_ASSERT(source->cell[1]->type == LISPVAL_QEXPR || source->cell[1]->type == LISPVAL_SEXPR, "Error: Argument passed to def should be a q expr with two q expressions as children: def { { a b } { 1 2 } } ");
+    LISPVAL_ASSERT(source->cell[0]->count == source->cell[1]->count, "Error: In function \"def\" both subarguments should have the same length");
+
+    lispval* symbols = source->cell[0];
+    lispval* values = source->cell[1];
+    for (int i = 0; i < symbols->count; i++) {
+        LISPVAL_ASSERT(symbols->cell[i]->type == LISPVAL_SYM, "Error: in function def, the first list of items should be of type symbol:  def { { a b } { 1 2 } }");
+        if (VERBOSE)
+            print_lispval_tree(symbols, 0);
+        if (VERBOSE)
+            print_lispval_tree(values, 0);
+        if (VERBOSE)
+            printf("\n");
+        insert_in_current_lispenv(symbols->cell[i]->sym, clone_lispval(values->cell[i]), env);
+    }
+    return lispval_sexpr(); // ()
+}
+
+// A builtin for defining a function
+lispval* builtin_define_lambda(lispval* v, lispenv* env)
+{
+    // @ { {x y} { + x y } }
+    // def { {plus} {{@ {x y} {+ x y}} }}
+    // (eval plus) 1 2
+    // (@ { {x y} { + x y } }) 1 2
+    LISPVAL_ASSERT(v->count == 2, "Lambda definition requires two arguments; try (@ {x y} { + x y }) ");
+    LISPVAL_ASSERT(v->cell[0]->type == LISPVAL_QEXPR, "Lambda definition (@) requires that the first sub-arg be a q-expression; try @ {x y} { + x y }");
+    LISPVAL_ASSERT(v->cell[1]->type == LISPVAL_QEXPR, "Lambda definition (@) requires that the second sub-arg be a q-expression; try @ {x y} { + x y }");
+
+    lispval* variables = clone_lispval(v->cell[0]);
+    lispval* manipulation = clone_lispval(v->cell[1]);
+
+    for (int i = 0; i > variables->count; i++) {
+        LISPVAL_ASSERT(variables->cell[i]->type == LISPVAL_SYM, "First argument in function definition must only be symbols. Try @ { {x y} { + x y } }");
+    }
+		lispenv* new_env = clone_lispenv(env);
+		// So env at the time of creation!
+    lispval* lambda = lispval_lambda_func(variables, manipulation, new_env, NULL);
+    return lambda;
+}
+
+// Conditionals
+
+lispval* builtin_ifelse(lispval* v, lispenv* e)
+{
+    // ifelse 1 {a} b
+    LISPVAL_ASSERT(v->count == 3, "Error: function ifelse passed too many arguments. Try ifelse choice result alternative, e.g., if (1 (a) {b})");
+
+    lispval* choice = v->cell[0];
+    lispval* result = v->cell[1];
+    lispval* alternative = v->cell[2];
+		
+		if( (choice->type == LISPVAL_NUM && choice->num == 0) || (choice->type == LISPVAL_INT && choice->integer == 0)){
+			lispval* answer = clone_lispval(alternative);
+			if(answer->type == LISPVAL_QEXPR){
+				answer->type = LISPVAL_SEXPR;
+				answer = evaluate_lispval(answer, e);
+			}
+			return answer;
+		}else {
+			lispval* answer = clone_lispval(result);
+			if(answer->type == LISPVAL_QEXPR){
+				// answer = builtin_eval(answer, e);
+				answer->type = LISPVAL_SEXPR;
+				answer = evaluate_lispval(answer, e);
+			}
+			return answer;
+		}
+}
+
+// Numbers
+// Integers are exact: those that don't fit in a LISPVAL_INT are big integers.
+// Inexact divisions, and operations which mix integers with doubles, give doubles.
+int lispval_is_integer(lispval* v)
+{
+    return v->type == LISPVAL_INT || v->type == LISPVAL_BIGINT;
+}
+
+int lispval_is_number(lispval* v)
+{
+    return v->type == LISPVAL_NUM || lispval_is_integer(v);
+}
+
+double lispval_to_double(lispval* v)
+{
+    if (v->type == LISPVAL_BIGINT) {
+        double x = 0;
+        for (int i = v->bigint_size - 1; i >= 0; i--) {
+            x = x * BIGINT_BASE + v->bigint_limbs[i];
+        }
+        return v->bigint_sign * x;
+    }
+    return v->type == LISPVAL_INT ? (double)v->integer : v->num;
+}
+
+int bigint_magnitude(lispval* v, uint32_t small_limbs[3], uint32_t** limbs, int* sign)
+{
+    // Points *limbs at the magnitude of an integer v, in small_limbs if v is a
+    // LISPVAL_INT, and returns its size.
+    if (v->type == LISPVAL_BIGINT) {
+        *limbs = v->bigint_limbs;
+        *sign = v->bigint_sign;
+        return v->bigint_size;
+    }
+    unsigned long long x = v->integer < 0 ? 0 - (unsigned long long)v->integer : (unsigned long long)v->integer;
+    int size = 0;
+    while (x > 0) {
+        small_limbs[size++] = x % BIGINT_BASE;
+        x /= BIGINT_BASE;
+    }
+    *limbs = small_limbs;
+    *sign = v->integer < 0 ? -1 : 1;
+    return size;
+}
+
+// These return 1 if the result doesn't fit in a long long, and otherwise store it
+int add_overflows(long long a, long long b, long long* result)
+{
+    if ((b > 0 && a > LLONG_MAX - b) || (b < 0 && a < LLONG_MIN - b))
+        return 1;
+    *result = a + b;
+    return 0;
+}
+
+int substract_overflows(long long a, long long b, long long* result)
+{
+    if ((b < 0 && a > LLONG_MAX + b) || (b > 0 && a < LLONG_MIN + b))
+        return 1;
+    *result = a - b;
+    return 0;
+}
+
+int multiply_overflows(long long a, long long b, long long* result)
+{
+    if (a > 0 ? (b > 0 ? a > LLONG_MAX / b : b < LLONG_MIN / a)
+              : (b > 0 ? a < LLONG_MIN / b : a != 0 && b < LLONG_MAX / a))
+        return 1;
+    *result = a * b;
+    return 0;
+}
+
+// Comparators: =, > (also potentially <, >=, <=, <=)
+// For numbers. 
+
+int compare_integer_with_double(lispval* a, double y)
+{
+    // -1, 0 or 1, as the integer a is smaller than, equal to or greater than
+    // y, which isn't nan. Exactly, rather than by rounding a to a double,
+    // so that = stays transitive: 2^53 + 1 isn't 2^53.0, since 2^53 isn't.
+    if (isinf(y))
+        return y > 0 ? -1 : 1;
+    double whole = trunc(y);
+    int order;
+    if (fabs(whole) < 0x1p63) {
+        long long b = (long long)whole;
+        // Big integers don't fit in a long long, so their sign decides
+        order = a->type == LISPVAL_INT ? (a->integer > b) - (a->integer < b) : a->bigint_sign;
+    } else {
+        uint32_t small_a[3], limbs_b[BIGINT_DOUBLE_LIMBS];
+        uint32_t* limbs_a;
+        int sign_a;
+        int size_a = bigint_magnitude(a, small_a, &limbs_a, &sign_a);
+        int size_b = bigint_magnitude_of_double(whole, limbs_b);
+        int sign_b = whole < 0 ? -1 : 1;
+        if (sign_a != sign_b)
+            return sign_a > sign_b ? 1 : -1;
+        order = sign_a * bigint_compare_magnitudes(limbs_a, size_a, limbs_b, size_b);
+    }
+    if (order != 0)
+        return order;
+    // a is the integral part of y, so its fractional part decides
+    return y > whole ? -1 : y < whole ? 1 : 0;
+}
+
+int compare_numbers(lispval* a, lispval* b)
+{
+    // -1, 0 or 1, as a is smaller than, equal to or greater than b.
+    // NaN compares as neither greater nor equal.
+    if (a->type == LISPVAL_INT && b->type == LISPVAL_INT)
+        return (a->integer > b->integer) - (a->integer < b->integer);
+    if (lispval_is_integer(a) && lispval_is_integer(b)) {
+        uint32_t small_a[3], small_b[3];
+        uint32_t *limbs_a, *limbs_b;
+        int sign_a, sign_b;
+        int size_a = bigint_magnitude(a, small_a, &limbs_a, &sign_a);
+        int size_b = bigint_magnitude(b, small_b, &limbs_b, &sign_b);
+        if (sign_a != sign_b)
+            return sign_a > sign_b ? 1 : -1;
+        return sign_a * bigint_compare_magnitudes(limbs_a, size_a, limbs_b, size_b);
+    }
+    if (lispval_is_integer(a) && !isnan(b->num))
+        return compare_integer_with_double(a, b->num);
+    if (lispval_is_integer(b) && !isnan(a->num))
+        return -compare_integer_with_double(b, a->num);
+    double x = lispval_to_double(a);
+    double y = lispval_to_double(b);
+    return x > y ? 1 : x == y ? 0 : -1;
+}
+
+int lispvals_equal(lispval* a, lispval* b)
+{
+    // Structural equality. Numbers are compared by value, so 1 = 1.0, and
+    // nan isn't equal to anything. Other values are equal if they are of
+    // the same type and their contents are equal; streams and transients,
+    // only if they are the same one. Lists and maps whose hashes have
+    // already been computed, e.g. because they are map keys, are told
+    // apart by them first.
+    if (lispval_is_number(a) && lispval_is_number(b))
+        return compare_numbers(a, b) == 0;
+    if (a->type != b->type)
+        return 0;
+    switch (a->type) {
+    case LISPVAL_ERR:
+        return strcmp(a->err, b->err) == 0;
+    case LISPVAL_SYM:
+        return strcmp(a->sym, b->sym) == 0;
+    case LISPVAL_STR:
+        return a->str_length == b->str_length && compare_lispstrs(a, b) == 0;
+    case LISPVAL_VEC:
+        if (a->count != b->count)
+            return 0;
+        for (int i = 0; i < a->count; i++) {
+            if (a->vec[i] != b->vec[i])
+                return 0;
+        }
+        return 1;
+    case LISPVAL_RANGE:
+        // As for their hashes
+        return a->range_length == b->range_length && (a->range_length == 0 || a->range_start == b->range_start) && (a->range_length < 2 || a->range_step == b->range_step);
+    case LISPVAL_MAP: {
+        lispmap* x = a->map;
+        lispmap* y = b->map;
+        if (x == y)
+            return 1;
+        unsigned long long hash_x = __atomic_load_n(&x->entries_hash, __ATOMIC_RELAXED);
+        unsigned long long hash_y = __atomic_load_n(&y->entries_hash, __ATOMIC_RELAXED);
+        if (x->count != y->count || (hash_x != 0 && hash_y != 0 && hash_x != hash_y))
+            return 0;
+        for (int i = 0; i < x->used; i++) {
+            if (x->keys[i] == NULL)
+                continue;
+            lispval* val = lispmap_get(y, x->keys[i]);
+            if (val == NULL || !lispvals_equal(x->vals[i], val))
+                return 0;
+        }
+        return 1;
+    }
+    case LISPVAL_STREAM:
+        return a->stream == b->stream;
+    case LISPVAL_TRANSIENT:
+        return a->transient == b->transient;
+    case LISPVAL_BUILTIN_FUNC:
+        return a->builtin_func == b->builtin_func;
+    case LISPVAL_USER_FUNC:
+        return lispvals_equal(a->variables, b->variables) && lispvals_equal(a->manipulation, b->manipulation);
+    case LISPVAL_SEXPR:
+    case LISPVAL_QEXPR: {
+        if (a->count != b->count)
+            return 0;
+        unsigned long long hash_a = __atomic_load_n(&a->cell_hash, __ATOMIC_RELAXED);
+        unsigned long long hash_b = __atomic_load_n(&b->cell_hash, __ATOMIC_RELAXED);
+        if (hash_a != 0 && hash_b != 0 && hash_a != hash_b)
+            return 0;
+        for (int i = 0; i < a->count; i++) {
+            if (!lispvals_equal(a->cell[i], b->cell[i]))
+                return 0;
+        }
+        return 1;
+    }
+    default:
+        return 0;
+    }
+}
+
+lispval* builtin_equal(lispval* v, lispenv* e)
+{
+    // = 1 1.0, = {a {b}} {a {b}}, = "a" "a"
+    LISPVAL_ASSERT(v->count == 2, "Error: function = takes two arguments. Try (= 1 2)");
+    return lispval_int(lispvals_equal(v->cell[0], v->cell[1]));
+}
+
+
+lispval* builtin_greater_than(lispval* v, lispenv* e)
+{
+    // ifelse 1 {a} b
+    LISPVAL_ASSERT(v->count == 2, "Error: function = takes two numeric arguments. Try (= 1 2)");
+
+    lispval* a = v->cell[0];
+    lispval* b = v->cell[1];
+    if (a->type == LISPVAL_STR && b->type == LISPVAL_STR)
+        return lispval_int(compare_lispstrs(a, b) == 1);
+	  
+		LISPVAL_ASSERT(lispval_is_number(a), "Error: Functio = only takes numeric arguments.");
+		LISPVAL_ASSERT(lispval_is_number(b), "Error: Functio = only takes numeric arguments.");
+
+		if(compare_numbers(a, b) == 1){
+			return lispval_int(1);
+		}else {
+			return lispval_int(0);
+		}
+}
+
+
+// Simple math ops
+int integer_math_op(char* op, lispval* x, lispval* y)
+{
+    // x = x op y, for LISPVAL_INTs x and y. Returns 0, leaving x as is, if the
+    // result isn't a LISPVAL_INT; bigint_math_op then handles it.
+    long long a = x->integer;
+    long long b = y->integer;
+    long long result;
+    int exact;
+    if (strcmp(op, "+") == 0) {
+        exact = !add_overflows(a, b, &result);
+    } else if (strcmp(op, "-") == 0) {
+        exact = !substract_overflows(a, b, &result);
+    } else if (strcmp(op, "*") == 0) {
+        exact = !multiply_overflows(a, b, &result);
+    } else {
+        // b != 0 is checked by the caller; LLONG_MIN / -1 overflows
+        exact = !(a == LLONG_MIN && b == -1) && a % b == 0;
+        result = exact ? a / b : 0;
+    }
+    if (exact)
+        x->integer = result;
+    return exact;
+}
+
+lispval* bigint_math_op(char* op, lispval* x, lispval* y)
+{
+    // x op y, for integers x and y, either of which can be big. y != 0 for /.
+    uint32_t small_a[3], small_b[3];
+    uint32_t *a, *b;
+    int sign_a, sign_b;
+    int na = bigint_magnitude(x, small_a, &a, &sign_a);
+    int nb = bigint_magnitude(y, small_b, &b, &sign_b);
+    if (strcmp(op, "*") == 0) {
+        if (na == 0 || nb == 0)
+            return lispval_int(0);
+        uint32_t* product = bigint_alloc_limbs(na + nb);
+        bigint_multiply_magnitudes(a, na, b, nb, product);
+        return lispval_bigint(sign_a * sign_b, product, na + nb);
+    }
+    if (strcmp(op, "/") == 0) {
+        if (bigint_compare_magnitudes(a, na, b, nb) < 0)
+            return na == 0 ? lispval_int(0) : lispval_num(lispval_to_double(x) / lispval_to_double(y));
+        uint32_t* quotient = bigint_alloc_limbs(na - nb + 1);
+        if (!bigint_divide_magnitudes(a, na, b, nb, quotient)) {
+            bigint_free_limbs(quotient);
+            return lispval_num(lispval_to_double(x) / lispval_to_double(y));
+        }
+        return lispval_bigint(sign_a * sign_b, quotient, na - nb + 1);
+    }
+    if (strcmp(op, "-") == 0)
+        sign_b = -sign_b;
+    if (sign_a == sign_b) {
+        uint32_t* sum = bigint_alloc_limbs((na > nb ? na : nb) + 1);
+        return lispval_bigint(sign_a, sum, bigint_add_magnitudes(a, na, b, nb, sum));
+    }
+    int comparison = bigint_compare_magnitudes(a, na, b, nb);
+    if (comparison == 0)
+        return lispval_int(0);
+    if (comparison < 0) {
+        uint32_t* difference = bigint_alloc_limbs(nb);
+        return lispval_bigint(sign_b, difference, bigint_substract_magnitudes(b, nb, a, na, difference));
+    }
+    uint32_t* difference = bigint_alloc_limbs(na);
+    return lispval_bigint(sign_a, difference, bigint_substract_magnitudes(a, na, b, nb, difference));
+}
+
+lispval* vector_math_ops(char* op, lispval* v)
+{
+    // Elementwise, with numbers broadcast to every element. Division by zero
+    // gives inf or nan, as for the doubles in the vectors, rather than an error.
+    long n = -1;
+    for (int i = 0; i < v->count; i++) {
+        lispval* x = v->cell[i];
+        if (x->type == LISPVAL_VEC) {
+            LISPVAL_ASSERT(n < 0 || x->count == n, "Error: Operating on vectors of different lengths.");
+            n = x->count;
+        } else {
+            LISPVAL_ASSERT(lispval_is_number(x), "Error: Operating on non-numbers. Vectors can only be combined with other vectors and with numbers.");
+        }
+    }
+    LISPVAL_ASSERT(v->count > 1 || strcmp(op, "-") == 0, "Error: Non minus unary operation");
+
+    lispvec_buffer* buffer = new_lispvec_buffer(n);
+    double* acc = buffer->data;
+    lispval* first = v->cell[0];
+    if (first->type == LISPVAL_VEC) {
+        memcpy(acc, first->vec, n * sizeof(double));
+    } else {
+        for (long i = 0; i < n; i++) {
+            acc[i] = lispval_to_double(first);
+        }
+    }
+    if (v->count == 1)
+        vec_multiply(acc, NULL, -1, n);
+
+    void (*kernel)(double*, double*, double, long) = strcmp(op, "+") == 0 ? vec_add
+        : strcmp(op, "-") == 0                                            ? vec_substract
+        : strcmp(op, "*") == 0                                            ? vec_multiply
+                                                                          : vec_divide;
+    for (int i = 1; i < v->count; i++) {
+        lispval* y = v->cell[i];
+        if (y->type == LISPVAL_VEC) {
+            kernel(acc, y->vec, 0, n);
+        } else {
+            kernel(acc, NULL, lispval_to_double(y), n);
+        }
+    }
+    return lispval_vec(buffer, acc, n);
+}
+
+lispval* builtin_math_ops(char* op, lispval* v, lispenv* e)
+{
+    for (int i = 0; i < v->count; i++) {
+        if (v->cell[i]->type == LISPVAL_VEC)
+            return vector_math_ops(op, v);
+    }
+    // For now, ensure all args are numbers
+    for (int i = 0; i < v->count; i++) {
+        if (!lispval_is_number(v->cell[i])) {
+            return lispval_err("Error: Operating on non-numbers. This can be caused by an input like (+ 1 2 (3 * 4)). Because the (3 * 4) doesn't have the correct operation order, it isn't simplified, and then + can't sum over it.");
+        }
+    }
+    // Check how many elements
+    if (v->count == 0) {
+        return lispval_err("Error: No numbers on which to operate!");
+    } else if (v->count == 1) {
+        if (strcmp(op, "-") == 0) {
+            lispval* x = v->cell[0];
+            if (x->type == LISPVAL_INT && x->integer != LLONG_MIN)
+                return lispval_int(-x->integer);
+            if (lispval_is_integer(x)) {
+                lispval* zero = lispval_int(0);
+                lispval* answer = bigint_math_op("-", zero, x);
+                delete_lispval(zero);
+                return answer;
+            }
+            return lispval_num(-x->num);
+        } else {
+            return lispval_err("Error: Non minus unary operation");
+        }
+    } else if (v->count >= 2) {
+        lispval* x = clone_lispval(v->cell[0]);
+
+        for (int i = 1; i < v->count; i++) {
+            lispval* y = v->cell[i];
+            if (strcmp(op, "/") == 0 && lispval_to_double(y) == 0) {
+                delete_lispval(x);
+                // y is one of the operands, which are deleted by the caller
+                return lispval_err("Error: Division By Zero!");
+            }
+            if (x->type == LISPVAL_INT && y->type == LISPVAL_INT && integer_math_op(op, x, y)) {
+                continue;
+            }
+            if (lispval_is_integer(x) && lispval_is_integer(y)) {
+                lispval* result = bigint_math_op(op, x, y);
+                delete_lispval(x);
+                x = result;
+                continue;
+            }
+            if (lispval_is_integer(x)) {
+                double converted = lispval_to_double(x);
+                delete_lispval(x);
+                x = lispval_num(converted);
+            }
+            if (strcmp(op, "+") == 0) {
+                x->num += lispval_to_double(y);
+            }
+            if (strcmp(op, "-") == 0) {
+                x->num -= lispval_to_double(y);
+            }
+            if (strcmp(op, "*") == 0) {
+                x->num *= lispval_to_double(y);
+            }
+            if (strcmp(op, "/") == 0) {
+                x->num /= lispval_to_double(y);
+            }
+        }
+        return x;
+    } else {
+        return lispval_err("Error: Incorrect number of args. Perhaps a lispval->count was wrongly initialized?");
+    }
+    // Returns something that should be freed later: yes.
+    // Returns something that is independent of the input: yes.
+}
+
+// Fit the simple math ops using the above code
+lispval* builtin_add(lispval* v, lispenv* env)
+{
+    return builtin_math_ops("+", v, env);
+}
+
+lispval* builtin_substract(lispval* v, lispenv* env)
+{
+    return builtin_math_ops("-", v, env);
+}
+
+lispval* builtin_multiply(lispval* v, lispenv* env)
+{
+    return builtin_math_ops("*", v, env);
+}
+
+lispval* builtin_divide(lispval* v, lispenv* env)
+{
+    return builtin_math_ops("/", v, env);
+}
+
+// Vectors
+lispval* builtin_vec(lispval* v, lispenv* e)
+{
+    // vec { 1 2 3 }
+    LISPVAL_ASSERT(v->count == 1, "Error: function vec passed too many arguments");
+    lispval* source = v->cell[0];
+    if (source->type == LISPVAL_VEC)
+        return clone_lispval(source);
+    if (source->type == LISPVAL_RANGE) {
+        LISPVAL_ASSERT(source->range_length <= INT_MAX, "Error: range too long for a vector");
+        lispvec_buffer* buffer = new_lispvec_buffer(source->range_length);
+        for (long long i = 0; i < source->range_length; i++) {
+            buffer->data[i] = range_element(source, i);
+        }
+        return lispval_vec(buffer, buffer->data, source->range_length);
+    }
+    LISPVAL_ASSERT(source->type == LISPVAL_QEXPR, "Error: Argument passed to vec is not a q-expr, i.e., a bracketed list, or a range.");
+    for (int i = 0; i < source->count; i++) {
+        LISPVAL_ASSERT(lispval_is_number(source->cell[i]), "Error: vec only takes lists of numbers, e.g., vec {1 2 3}");
+    }
+    lispvec_buffer* buffer = new_lispvec_buffer(source->count);
+    for (int i = 0; i < source->count; i++) {
+        buffer->data[i] = lispval_to_double(source->cell[i]);
+    }
+    return lispval_vec(buffer, buffer->data, source->count);
+}
+
+// Ranges
+// range stop, range start stop and range start stop step are lazy sequences
+// of integers, from start up to but excluding stop. They are never
+// materialized: len, head and tail and the reductions work on them directly,
+// and tail is O(1). vec turns them into vectors.
+lispval* builtin_range(lispval* v, lispenv* e)
+{
+    // range 10, range 1 10, range 10 0 -2
+    LISPVAL_ASSERT(v->count >= 1 && v->count <= 3, "Error: function range takes a stop, a start and stop, or a start, stop and step, e.g., range 1 10 2");
+    for (int i = 0; i < v->count; i++) {
+        LISPVAL_ASSERT(v->cell[i]->type == LISPVAL_INT, "Error: function range only takes 64-bit integers");
+    }
+    long long start = v->count > 1 ? v->cell[0]->integer : 0;
+    long long stop = v->count > 1 ? v->cell[1]->integer : v->cell[0]->integer;
+    long long step = v->count > 2 ? v->cell[2]->integer : 1;
+    LISPVAL_ASSERT(step != 0, "Error: range with a step of 0");
+    // Unsigned, so that the distance between far apart start and stop doesn't overflow
+    unsigned long long length = 0;
+    if (step > 0 && stop > start) {
+        unsigned long long distance = (unsigned long long)stop - (unsigned long long)start;
+        length = distance / step + (distance % step != 0);
+    } else if (step < 0 && stop < start) {
+        unsigned long long distance = (unsigned long long)start - (unsigned long long)stop;
+        unsigned long long magnitude = 0 - (unsigned long long)step;
+        length = distance / magnitude + (distance % magnitude != 0);
+    }
+    LISPVAL_ASSERT(length <= LLONG_MAX, "Error: range too long");
+    return lispval_range(start, step, length);
+}
+
+// Reductions
+// sum, product, min and max take a list of numbers, a vector or a range, and
+// dot two of them. Lists of integers and ranges give exact integers, as + and * would.
+// Otherwise the numbers are reduced as doubles, by the reduction kernels;
+// sums are compensated, so they can be more accurate than folding +.
+int is_numeric_sequence(lispval* v)
+{
+    // A vector, a range, or a list of numbers
+    if (v->type == LISPVAL_VEC || v->type == LISPVAL_RANGE)
+        return 1;
+    if (v->type != LISPVAL_QEXPR)
+        return 0;
+    for (int i = 0; i < v->count; i++) {
+        if (!lispval_is_number(v->cell[i]))
+            return 0;
+    }
+    return 1;
+}
+
+int is_integer_sequence(lispval* v)
+{
+    // A range, or a list of integers
+    if (v->type == LISPVAL_RANGE)
+        return 1;
+    if (v->type != LISPVAL_QEXPR)
+        return 0;
+    for (int i = 0; i < v->count; i++) {
+        if (!lispval_is_integer(v->cell[i]))
+            return 0;
+    }
+    return 1;
+}
+
+long long numeric_sequence_length(lispval* v)
+{
+    return v->type == LISPVAL_RANGE ? v->range_length : v->count;
+}
+
+lispval* numeric_sequence_element(lispval* v, long long i)
+{
+    // A new lispval
+    if (v->type == LISPVAL_RANGE)
+        return lispval_int(range_element(v, i));
+    if (v->type == LISPVAL_VEC)
+        return lispval_num(v->vec[i]);
+    return clone_lispval(v->cell[i]);
+}
+
+double* numeric_sequence_to_doubles(lispval* v)
+{
+    // The elements of a vector are returned as they are; those of a list or
+    // a range, in a new array which should be freed.
+    if (v->type == LISPVAL_VEC)
+        return v->vec;
+    long long n = numeric_sequence_length(v);
+    double* x = malloc(sizeof(double) * (n > 0 ? n : 1));
+    for (long long i = 0; i < n; i++) {
+        x[i] = v->type == LISPVAL_RANGE ? range_element(v, i) : lispval_to_double(v->cell[i]);
+    }
+    return x;
+}
+
+lispval* exact_integer_op(char* op, lispval* x, lispval* y)
+{
+    // x op y, for integers x and y, as a new lispval
+    if (x->type == LISPVAL_INT && y->type == LISPVAL_INT) {
+        lispval* answer = lispval_int(x->integer);
+        if (integer_math_op(op, answer, y))
+            return answer;
+        delete_lispval(answer);
+    }
+    return bigint_math_op(op, x, y);
+}
+
+lispval* range_sum(lispval* v)
+{
+    // length * start + step * length * (length - 1) / 2, exactly
+    lispval* length = lispval_int(v->range_length);
+    lispval* length_minus_one = lispval_int(v->range_length > 0 ? v->range_length - 1 : 0);
+    lispval* start = lispval_int(v->range_start);
+    lispval* step = lispval_int(v->range_step);
+    lispval* two = lispval_int(2);
+    lispval* pairs = exact_integer_op("*", length, length_minus_one);
+    lispval* triangle = exact_integer_op("/", pairs, two); // exact, since one of length and length - 1 is even
+    lispval* steps = exact_integer_op("*", step, triangle);
+    lispval* starts = exact_integer_op("*", length, start);
+    lispval* answer = exact_integer_op("+", starts, steps);
+    lispval* temporaries[] = { length, length_minus_one, start, step, two, pairs, triangle, steps, starts };
+    for (int i = 0; i < 9; i++) {
+        delete_lispval(temporaries[i]);
+    }
+    return answer;
+}
+
+lispval* reduce_numbers(char* op, lispval* v)
+{
+    // + or *
+    LISPVAL_ASSERT(v->count == 1 && is_numeric_sequence(v->cell[0]), strcmp(op, "+") == 0 ? "Error: function sum takes a list of numbers or a vector, e.g., sum {1 2 3}" : "Error: function product takes a list of numbers or a vector, e.g., product {1 2 3}");
+    lispval* xs = v->cell[0];
+    if (xs->type == LISPVAL_RANGE && strcmp(op, "+") == 0)
+        return range_sum(xs);
+    if (is_integer_sequence(xs)) {
+        lispval* answer = lispval_int(strcmp(op, "+") == 0 ? 0 : 1);
+        for (long long i = 0; i < numeric_sequence_length(xs); i++) {
+            lispval* x = numeric_sequence_element(xs, i);
+            lispval* next = exact_integer_op(op, answer, x);
+            delete_lispval(x);
+            delete_lispval(answer);
+            answer = next;
+            if (answer->type == LISPVAL_INT && answer->integer == 0 && strcmp(op, "*") == 0)
+                break;
+        }
+        return answer;
+    }
+    double* x = numeric_sequence_to_doubles(xs);
+    double answer = strcmp(op, "+") == 0 ? vec_sum(x, xs->count) : vec_product(x, xs->count);
+    if (xs->type != LISPVAL_VEC)
+        free(x);
+    return lispval_num(answer);
+}
+
+lispval* builtin_sum(lispval* v, lispenv* e)
+{
+    // sum {1 2 3}
+    return reduce_numbers("+", v);
+}
+
+lispval* builtin_product(lispval* v, lispenv* e)
+{
+    // product {1 2 3}
+    return reduce_numbers("*", v);
+}
+
+lispval* extremum_of_numbers(lispval* v, int maximum)
+{
+    LISPVAL_ASSERT(v->count == 1 && is_numeric_sequence(v->cell[0]), maximum ? "Error: function max takes a list of numbers or a vector, e.g., max {1 2 3}" : "Error: function min takes a list of numbers or a vector, e.g., min {1 2 3}");
+    lispval* xs = v->cell[0];
+    LISPVAL_ASSERT(numeric_sequence_length(xs) > 0, "Error: no numbers to take the min or max of");
+    if (xs->type == LISPVAL_VEC)
+        return lispval_num(vec_extremum(xs->vec, xs->count, maximum));
+    if (xs->type == LISPVAL_RANGE) {
+        long long first = xs->range_start;
+        long long last = range_element(xs, xs->range_length - 1);
+        return lispval_int((first > last) == maximum ? first : last);
+    }
+    // Lists keep the type of the extremum
+    lispval* best = xs->cell[0];
+    for (int i = 1; i < xs->count; i++) {
+        if (compare_numbers(xs->cell[i], best) == (maximum ? 1 : -1))
+            best = xs->cell[i];
+    }
+    return clone_lispval(best);
+}
+
+lispval* builtin_min(lispval* v, lispenv* e)
+{
+    // min {3 1 2}
+    return extremum_of_numbers(v, 0);
+}
+
+lispval* builtin_max(lispval* v, lispenv* e)
+{
+    // max {3 1 2}
+    return extremum_of_numbers(v, 1);
+}
+
+lispval* builtin_dot(lispval* v, lispenv* e)
+{
+    // dot {1 2 3} {4 5 6}
+    LISPVAL_ASSERT(v->count == 2 && is_numeric_sequence(v->cell[0]) && is_numeric_sequence(v->cell[1]), "Error: function dot takes two lists of numbers or vectors, e.g., dot {1 2 3} {4 5 6}");
+    lispval* xs = v->cell[0];
+    lispval* ys = v->cell[1];
+    long long n = numeric_sequence_length(xs);
+    LISPVAL_ASSERT(n == numeric_sequence_length(ys), "Error: dot of sequences of different lengths");
+    if (is_integer_sequence(xs) && is_integer_sequence(ys)) {
+        lispval* answer = lispval_int(0);
+        for (long long i = 0; i < n; i++) {
+            lispval* x = numeric_sequence_element(xs, i);
+            lispval* y = numeric_sequence_element(ys, i);
+            lispval* product = exact_integer_op("*", x, y);
+            lispval* next = exact_integer_op("+", answer, product);
+            delete_lispval(x);
+            delete_lispval(y);
+            delete_lispval(product);
+            delete_lispval(answer);
+            answer = next;
+        }
+        return answer;
+    }
+    double* x = numeric_sequence_to_doubles(xs);
+    double* y = numeric_sequence_to_doubles(ys);
+    double answer = vec_dot(x, y, n);
+    if (xs->type != LISPVAL_VEC)
+        free(x);
+    if (ys->type != LISPVAL_VEC)
+        free(y);
+    return lispval_num(answer);
+}
+
+// Statistics
+// mean, variance, median and quantile of lists of numbers, vectors and
+// ranges. variance is the sample variance, in one pass, with Welford's
+// method. Quantiles interpolate linearly between the two closest order
+// statistics, as R's and numpy's defaults do, and find them with
+// introselect rather than by sorting: quickselect, with a median of three
+// pivot, which falls back to sorting what's left if it partitions badly
+// too many times. Several quantiles share their partitions.
+#define SELECT_INSERTION_THRESHOLD 16
+
+int compare_doubles(const void* a, const void* b)
+{
+    double x = *(double*)a;
+    double y = *(double*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+int compare_longs(const void* a, const void* b)
+{
+    long x = *(long*)a;
+    long y = *(long*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+void select_order_statistics(double* x, long low, long high, long* ranks, int rank_count, int depth)
+{
+    // Afterwards, x[r] is the element of rank r, for the sorted ranks in [low, high)
+    while (rank_count > 0 && high - low > SELECT_INSERTION_THRESHOLD) {
+        if (depth-- == 0) {
+            qsort(x + low, high - low, sizeof(double), compare_doubles);
+            return;
+        }
+        double a = x[low], b = x[low + (high - low) / 2], c = x[high - 1];
+        double pivot = a < b ? (b < c ? b : (a < c ? c : a)) : (a < c ? a : (b < c ? c : b));
+        // Three way partition: [low, lt) < pivot, [lt, gt) == pivot, [gt, high) > pivot
+        long lt = low, i = low, gt = high;
+        while (i < gt) {
+            double t = x[i];
+            if (t < pivot) {
+                x[i++] = x[lt];
+                x[lt++] = t;
+            } else if (t > pivot) {
+                x[i] = x[--gt];
+                x[gt] = t;
+            } else {
+                i++;
+            }
+        }
+        int left = 0;
+        while (left < rank_count && ranks[left] < lt)
+            left++;
+        int right = left;
+        while (right < rank_count && ranks[right] < gt)
+            right++;
+        select_order_statistics(x, low, lt, ranks, left, depth);
+        low = gt;
+        ranks += right;
+        rank_count -= right;
+    }
+    if (rank_count > 0) {
+        for (long i = low + 1; i < high; i++) {
+            double t = x[i];
+            long j = i;
+            for (; j > low && x[j - 1] > t; j--)
+                x[j] = x[j - 1];
+            x[j] = t;
+        }
+    }
+}
+
+lispval* builtin_mean(lispval* v, lispenv* e)
+{
+    // mean {1 2 3 4}
+    LISPVAL_ASSERT(v->count == 1 && is_numeric_sequence(v->cell[0]), "Error: function mean takes a list of numbers, a vector or a range, e.g., mean {1 2 3}");
+    lispval* xs = v->cell[0];
+    long long n = numeric_sequence_length(xs);
+    LISPVAL_ASSERT(n > 0, "Error: mean of no numbers");
+    double* x = numeric_sequence_to_doubles(xs);
+    double answer = vec_sum(x, n) / n;
+    if (xs->type != LISPVAL_VEC)
+        free(x);
+    return lispval_num(answer);
+}
+
+lispval* builtin_variance(lispval* v, lispenv* e)
+{
+    // variance {1 2 3 4}
+    LISPVAL_ASSERT(v->count == 1 && is_numeric_sequence(v->cell[0]), "Error: function variance takes a list of numbers, a vector or a range, e.g., variance {1 2 3}");
+    lispval* xs = v->cell[0];
+    long long n = numeric_sequence_length(xs);
+    LISPVAL_ASSERT(n > 1, "Error: variance of fewer than two numbers");
+    double* x = numeric_sequence_to_doubles(xs);
+    double mean = 0;
+    double squares = 0; // sum of squared deviations from the running mean
+    for (long long i = 0; i < n; i++) {
+        double delta = x[i] - mean;
+        mean += delta / (i + 1);
+        squares += delta * (x[i] - mean);
+    }
+    if (xs->type != LISPVAL_VEC)
+        free(x);
+    return lispval_num(squares / (n - 1));
+}
+
+lispval* quantiles_of_numeric_sequence(lispval* xs, double* qs, int q_count, double* answers)
+{
+    // Fills answers, or returns an error
+    long long n = numeric_sequence_length(xs);
+    LISPVAL_ASSERT(n > 0, "Error: quantile of no numbers");
+    for (int i = 0; i < q_count; i++) {
+        LISPVAL_ASSERT(qs[i] >= 0 && qs[i] <= 1, "Error: quantiles should be between 0 and 1");
+    }
+    // A copy, which selection reorders
+    double* x = numeric_sequence_to_doubles(xs);
+    if (xs->type == LISPVAL_VEC) {
+        x = malloc(n * sizeof(double));
+        memcpy(x, xs->vec, n * sizeof(double));
+    }
+    for (long long i = 0; i < n; i++) {
+        if (x[i] != x[i]) {
+            free(x);
+            return lispval_err("Error: quantile of a nan");
+        }
+    }
+    // Each quantile needs the order statistics floor(h) and floor(h) + 1, for h = (n - 1) q
+    long* ranks = malloc(2 * q_count * sizeof(long));
+    int rank_count = 0;
+    for (int i = 0; i < q_count; i++) {
+        long r = (long)((n - 1) * qs[i]);
+        ranks[rank_count++] = r;
+        if (r + 1 < n)
+            ranks[rank_count++] = r + 1;
+    }
+    qsort(ranks, rank_count, sizeof(long), compare_longs);
+    int depth = 0;
+    for (long long m = n; m > 1; m /= 2)
+        depth += 2;
+    select_order_statistics(x, 0, n, ranks, rank_count, depth);
+    for (int i = 0; i < q_count; i++) {
+        double h = (n - 1) * qs[i];
+        long r = (long)h;
+        answers[i] = r + 1 < n ? x[r] + (h - r) * (x[r + 1] - x[r]) : x[r];
+    }
+    free(ranks);
+    free(x);
+    return NULL;
+}
+
+lispval* builtin_quantile(lispval* v, lispenv* e)
+{
+    // quantile {3 1 2} 0.5, quantile xs {0.05 0.5 0.95}, quantile xs (vec {0.05 0.95})
+    LISPVAL_ASSERT(v->count == 2 && is_numeric_sequence(v->cell[0]), "Error: function quantile takes a list of numbers, a vector or a range, and a quantile, or a list or vector of them, e.g., quantile {1 2 3} 0.5");
+    lispval* xs = v->cell[0];
+    lispval* q = v->cell[1];
+    if (lispval_is_number(q)) {
+        double p = lispval_to_double(q);
+        double answer;
+        lispval* err = quantiles_of_numeric_sequence(xs, &p, 1, &answer);
+        return err != NULL ? err : lispval_num(answer);
+    }
+    LISPVAL_ASSERT(q->type == LISPVAL_VEC || (q->type == LISPVAL_QEXPR && is_numeric_sequence(q)), "Error: function quantile takes a quantile, or a list or vector of them");
+    double* ps = numeric_sequence_to_doubles(q);
+    double* answers = malloc((q->count > 0 ? q->count : 1) * sizeof(double));
+    lispval* err = quantiles_of_numeric_sequence(xs, ps, q->count, answers);
+    if (q->type != LISPVAL_VEC)
+        free(ps);
+    if (err != NULL) {
+        free(answers);
+        return err;
+    }
+    lispval* result;
+    if (q->type == LISPVAL_VEC) {
+        lispvec_buffer* buffer = new_lispvec_buffer(q->count);
+        memcpy(buffer->data, answers, q->count * sizeof(double));
+        result = lispval_vec(buffer, buffer->data, q->count);
+    } else {
+        result = lispval_qexpr();
+        for (int i = 0; i < q->count; i++) {
+            result = lispval_append_child(result, lispval_num(answers[i]));
+        }
+    }
+    free(answers);
+    return result;
+}
+
+lispval* builtin_median(lispval* v, lispenv* e)
+{
+    // median {3 1 2}
+    LISPVAL_ASSERT(v->count == 1 && is_numeric_sequence(v->cell[0]), "Error: function median takes a list of numbers, a vector or a range, e.g., median {3 1 2}");
+    double half = 0.5;
+    double answer;
+    lispval* err = quantiles_of_numeric_sequence(v->cell[0], &half, 1, &answer);
+    return err != NULL ? err : lispval_num(answer);
+}
+
+// Sorting
+// sort xs orders a list of numbers, a vector or a range; sort xs f orders
+// any list, with f as its "less than". sort-by key xs, and sort-by key xs f,
+// order a list by key x, which is computed once per element.
+// Numbers are sorted with an LSD radix sort on their bits, made unsigned
+// so that their order as integers is the order of the numbers. Lists with
+// comparators, and with big integers, use a pattern-defeating quicksort:
+// introsort, which also notices already partitioned ranges, keeps equal
+// elements out of further partitions, and shuffles after bad pivots.
+// The sorts are stable only on the radix path.
+#define SORT_INSERTION_THRESHOLD 24
+#define SORT_NINTHER_THRESHOLD 128
+#define SORT_PARTIAL_INSERTION_LIMIT 8
+
+typedef struct sort_item {
+    uint64_t radix_key;
+    lispval* key;
+    lispval* value;
+} sort_item;
+
+typedef struct sort_comparator {
+    lispfunc_frame* frame; // calls a user-given "less than", or NULL to compare numbers
+    lispval* err; // the first error it returned
+} sort_comparator;
+
+uint64_t double_radix_key(double x)
+{
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return (bits >> 63) ? ~bits : bits ^ (1ULL << 63);
+}
+
+double radix_key_to_double(uint64_t key)
+{
+    uint64_t bits = (key >> 63) ? key ^ (1ULL << 63) : ~key;
+    double x;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+void radix_sort_keys(void* items, long n, size_t size)
+{
+    // items are structs of the given size which start with a uint64_t key.
+    // One byte per pass; passes over bytes shared by every key are skipped.
+    if (n < 2)
+        return;
+    long counts[8][256] = { { 0 } };
+    char* from = items;
+    char* to = malloc(n * size);
+    for (long i = 0; i < n; i++) {
+        uint64_t key = *(uint64_t*)(from + i * size);
+        for (int b = 0; b < 8; b++)
+            counts[b][(key >> (8 * b)) & 255]++;
+    }
+    for (int b = 0; b < 8; b++) {
+        uint64_t first_key = *(uint64_t*)from;
+        if (counts[b][(first_key >> (8 * b)) & 255] == n)
+            continue;
+        long offsets[256];
+        long offset = 0;
+        for (int d = 0; d < 256; d++) {
+            offsets[d] = offset;
+            offset += counts[b][d];
+        }
+        // With the two sizes used spelled out, so that the copies are inlined
+        if (size == sizeof(uint64_t)) {
+            uint64_t* x = (uint64_t*)from;
+            uint64_t* y = (uint64_t*)to;
+            for (long i = 0; i < n; i++)
+                y[offsets[(x[i] >> (8 * b)) & 255]++] = x[i];
+        } else if (size == sizeof(sort_item)) {
+            sort_item* x = (sort_item*)from;
+            sort_item* y = (sort_item*)to;
+            for (long i = 0; i < n; i++)
+                y[offsets[(x[i].radix_key >> (8 * b)) & 255]++] = x[i];
+        } else {
+            for (long i = 0; i < n; i++) {
+                uint64_t key = *(uint64_t*)(from + i * size);
+                memcpy(to + offsets[(key >> (8 * b)) & 255]++ * size, from + i * size, size);
+            }
+        }
+        char* swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != (char*)items) {
+        memcpy(items, from, n * size);
+        free(from);
+    } else {
+        free(to);
+    }
+}
+
+int sort_less(sort_comparator* c, sort_item* a, sort_item* b)
+{
+    if (c->err != NULL)
+        return 0;
+    if (c->frame == NULL)
+        return compare_numbers(a->key, b->key) < 0;
+    lispval* args[2] = { a->key, b->key };
+    lispval* answer = call_lispfunc_frame(c->frame, args);
+    if (answer->type == LISPVAL_ERR) {
+        c->err = answer;
+        return 0;
+    }
+    int less = is_truthy(answer);
+    delete_lispval(answer);
+    return less;
+}
+
+void swap_sort_items(sort_item* a, sort_item* b)
+{
+    sort_item t = *a;
+    *a = *b;
+    *b = t;
+}
+
+void insertion_sort_items(sort_item* items, long n, sort_comparator* c)
+{
+    for (long i = 1; i < n; i++) {
+        sort_item t = items[i];
+        long j = i;
+        for (; j > 0 && sort_less(c, &t, &items[j - 1]); j--)
+            items[j] = items[j - 1];
+        items[j] = t;
+    }
+}
+
+int partial_insertion_sort_items(sort_item* items, long n, sort_comparator* c)
+{
+    // Insertion sort, given up after moving SORT_PARTIAL_INSERTION_LIMIT elements
+    long moved = 0;
+    for (long i = 1; i < n; i++) {
+        sort_item t = items[i];
+        long j = i;
+        for (; j > 0 && sort_less(c, &t, &items[j - 1]); j--)
+            items[j] = items[j - 1];
+        items[j] = t;
+        moved += i - j;
+        if (moved > SORT_PARTIAL_INSERTION_LIMIT)
+            return 0;
+    }
+    return 1;
+}
+
+void sift_down_items(sort_item* items, long root, long n, sort_comparator* c)
+{
+    for (;;) {
+        long child = 2 * root + 1;
+        if (child >= n)
+            return;
+        if (child + 1 < n && sort_less(c, &items[child], &items[child + 1]))
+            child++;
+        if (!sort_less(c, &items[root], &items[child]))
+            return;
+        swap_sort_items(&items[root], &items[child]);
+        root = child;
+    }
+}
+
+void heap_sort_items(sort_item* items, long n, sort_comparator* c)
+{
+    for (long i = n / 2 - 1; i >= 0; i--)
+        sift_down_items(items, i, n, c);
+    for (long i = n - 1; i > 0; i--) {
+        swap_sort_items(&items[0], &items[i]);
+        sift_down_items(items, 0, i, c);
+    }
+}
+
+void sort_three_items(sort_item* items, long a, long b, long c_index, sort_comparator* c)
+{
+    // Leaves the median of the three in b
+    if (sort_less(c, &items[b], &items[a]))
+        swap_sort_items(&items[a], &items[b]);
+    if (sort_less(c, &items[c_index], &items[b]))
+        swap_sort_items(&items[b], &items[c_index]);
+    if (sort_less(c, &items[b], &items[a]))
+        swap_sort_items(&items[a], &items[b]);
+}
+
+void pdq_sort_items(sort_item* items, long n, sort_comparator* c, int bad_allowed, int leftmost)
+{
+    // The comparator may be inconsistent, so every scan is bounds checked.
+    while (n > SORT_INSERTION_THRESHOLD) {
+        if (c->err != NULL)
+            return;
+        // Pivot to items[0]: a median of three, or of three medians of three
+        long half = n / 2;
+        if (n > SORT_NINTHER_THRESHOLD) {
+            sort_three_items(items, 0, half, n - 1, c);
+            sort_three_items(items, 1, half - 1, n - 2, c);
+            sort_three_items(items, 2, half + 1, n - 3, c);
+            sort_three_items(items, half - 1, half, half + 1, c);
+        } else {
+            sort_three_items(items, 0, half, n - 1, c);
+        }
+        swap_sort_items(&items[0], &items[half]);
+
+        // If the element before this range isn't less than the pivot, nothing
+        // here is less than it either: put the elements equal to the pivot on
+        // the left, and don't look at them again.
+        if (!leftmost && !sort_less(c, &items[-1], &items[0])) {
+            long i = 1, j = n - 1;
+            for (;;) {
+                while (i <= j && !sort_less(c, &items[0], &items[i]))
+                    i++;
+                while (i <= j && sort_less(c, &items[0], &items[j]))
+                    j--;
+                if (i >= j)
+                    break;
+                swap_sort_items(&items[i++], &items[j--]);
+            }
+            swap_sort_items(&items[0], &items[i - 1]);
+            items += i;
+            n -= i;
+            continue;
+        }
+
+        // Partition: [1, i) < pivot <= [j + 1, n)
+        long i = 1, j = n - 1;
+        int swapped = 0;
+        for (;;) {
+            while (i <= j && sort_less(c, &items[i], &items[0]))
+                i++;
+            while (i <= j && !sort_less(c, &items[j], &items[0]))
+                j--;
+            if (i >= j)
+                break;
+            swap_sort_items(&items[i++], &items[j--]);
+            swapped = 1;
+        }
+        long p = i - 1;
+        swap_sort_items(&items[0], &items[p]);
+        long left = p, right = n - p - 1;
+
+        if (left < n / 8 || right < n / 8) {
+            // A bad pivot. After too many, fall back to heapsort; otherwise
+            // swap a few elements around, to break up the pattern.
+            if (--bad_allowed == 0) {
+                heap_sort_items(items, n, c);
+                return;
+            }
+            if (left >= SORT_INSERTION_THRESHOLD) {
+                swap_sort_items(&items[0], &items[left / 4]);
+                swap_sort_items(&items[p - 1], &items[p - left / 4]);
+            }
+            if (right >= SORT_INSERTION_THRESHOLD) {
+                swap_sort_items(&items[p + 1], &items[p + 1 + right / 4]);
+                swap_sort_items(&items[n - 1], &items[n - right / 4]);
+            }
+        } else if (!swapped && partial_insertion_sort_items(items, left, c) && partial_insertion_sort_items(items + p + 1, right, c)) {
+            // Likely already sorted
+            return;
+        }
+
+        // Recurse into the smaller side, and loop over the larger one
+        if (left < right) {
+            pdq_sort_items(items, left, c, bad_allowed, leftmost);
+            items += p + 1;
+            n = right;
+            leftmost = 0;
+        } else {
+            pdq_sort_items(items + p + 1, right, c, bad_allowed, 0);
+            n = left;
+        }
+    }
+    insertion_sort_items(items, n, c);
+}
+
+lispval* sort_items(sort_item* items, long n, lispval* func, lispenv* env)
+{
+    // Radix sorts numeric keys when there's no comparator; returns an error, or NULL
+    if (func == NULL) {
+        int all_integers = 1, all_small = 1;
+        for (long i = 0; i < n; i++) {
+            lispval* key = items[i].key;
+            LISPVAL_ASSERT(lispval_is_number(key), "Error: sort without a comparator only takes numbers, e.g., sort {3 1 2}, or sort xs (@ {a b} {> b a})");
+            all_integers = all_integers && key->type == LISPVAL_INT;
+            // Doubles represent these integers exactly
+            all_small = all_small && key->type != LISPVAL_BIGINT && (key->type != LISPVAL_INT || (key->integer <= (1LL << 53) && key->integer >= -(1LL << 53)));
+        }
+        if (all_integers || all_small) {
+            for (long i = 0; i < n; i++) {
+                lispval* key = items[i].key;
+                items[i].radix_key = all_integers ? (uint64_t)key->integer ^ (1ULL << 63) : double_radix_key(lispval_to_double(key));
+            }
+            radix_sort_keys(items, n, sizeof(sort_item));
+            return NULL;
+        }
+    }
+    sort_comparator c = { .frame = func != NULL ? new_lispfunc_frame(func, 2, env) : NULL, .err = NULL };
+    int bad_allowed = 1;
+    for (long m = n; m > 1; m /= 2)
+        bad_allowed++;
+    pdq_sort_items(items, n, &c, bad_allowed, 1);
+    if (c.frame != NULL)
+        delete_lispfunc_frame(c.frame);
+    return c.err;
+}
+
+lispval* sort_list(lispval* xs, lispval* keys, lispval* func, lispenv* env)
+{
+    // A sorted clone of the list xs, by the keys if given, or by xs itself
+    sort_item* items = malloc((xs->count > 0 ? xs->count : 1) * sizeof(sort_item));
+    for (int i = 0; i < xs->count; i++) {
+        items[i].key = keys != NULL ? keys->cell[i] : xs->cell[i];
+        items[i].value = xs->cell[i];
+    }
+    lispval* err = sort_items(items, xs->count, func, env);
+    if (err != NULL) {
+        free(items);
+        return err;
+    }
+    lispval* sorted = lispval_qexpr();
+    for (int i = 0; i < xs->count; i++) {
+        sorted = lispval_append_child(sorted, clone_lispval(items[i].value));
+    }
+    free(items);
+    return sorted;
+}
+
+lispval* builtin_sort(lispval* v, lispenv* e)
+{
+    // sort {3 1 2}, sort {3 1 2} (@ {a b} {> a b})
+    LISPVAL_ASSERT(v->count == 1 || v->count == 2, "Error: function sort takes a list, and optionally a comparator, e.g., sort {3 1 2}");
+    lispval* xs = v->cell[0];
+    lispval* func = v->count == 2 ? v->cell[1] : NULL;
+    LISPVAL_ASSERT(func == NULL || func->type == LISPVAL_BUILTIN_FUNC || func->type == LISPVAL_USER_FUNC, "Error: the comparator given to sort is not a function");
+    if (func == NULL && xs->type == LISPVAL_RANGE) {
+        if (xs->range_step > 0 || xs->range_length == 0)
+            return clone_lispval(xs);
+        return lispval_range(range_element(xs, xs->range_length - 1), -xs->range_step, xs->range_length);
+    }
+    if (func == NULL && xs->type == LISPVAL_VEC) {
+        uint64_t* keys = malloc((xs->count > 0 ? xs->count : 1) * sizeof(uint64_t));
+        for (int i = 0; i < xs->count; i++) {
+            keys[i] = double_radix_key(xs->vec[i]);
+        }
+        radix_sort_keys(keys, xs->count, sizeof(uint64_t));
+        lispvec_buffer* buffer = new_lispvec_buffer(xs->count);
+        for (int i = 0; i < xs->count; i++) {
+            buffer->data[i] = radix_key_to_double(keys[i]);
+        }
+        free(keys);
+        return lispval_vec(buffer, buffer->data, xs->count);
+    }
+    LISPVAL_ASSERT(xs->type == LISPVAL_QEXPR, "Error: function sort takes a list, a vector or a range");
+    return sort_list(xs, NULL, func, e);
+}
+
+lispval* builtin_sort_by(lispval* v, lispenv* e)
+{
+    // sort-by (@ {x} {- 0 x}) {1 2 3}, sort-by head {{2 a} {1 b}} (@ {a b} {> a b})
+    LISPVAL_ASSERT(v->count == 2 || v->count == 3, "Error: function sort-by takes a key function, a list, and optionally a comparator, e.g., sort-by abs {-3 1 2}");
+    lispval* key_func = v->cell[0];
+    lispval* xs = v->cell[1];
+    lispval* func = v->count == 3 ? v->cell[2] : NULL;
+    LISPVAL_ASSERT(key_func->type == LISPVAL_BUILTIN_FUNC || key_func->type == LISPVAL_USER_FUNC, "Error: the key given to sort-by is not a function");
+    LISPVAL_ASSERT(func == NULL || func->type == LISPVAL_BUILTIN_FUNC || func->type == LISPVAL_USER_FUNC, "Error: the comparator given to sort-by is not a function");
+    LISPVAL_ASSERT(xs->type == LISPVAL_QEXPR, "Error: function sort-by takes a list");
+    lispval* keys = lispval_qexpr();
+    lispfunc_frame* frame = new_lispfunc_frame(key_func, 1, e);
+    for (int i = 0; i < xs->count; i++) {
+        lispval* key = call_lispfunc_frame(frame, &xs->cell[i]);
+        if (key->type == LISPVAL_ERR) {
+            delete_lispfunc_frame(frame);
+            delete_lispval(keys);
+            return key;
+        }
+        keys = lispval_append_child(keys, key);
+    }
+    delete_lispfunc_frame(frame);
+    lispval* sorted = sort_list(xs, keys, func, e);
+    delete_lispval(keys);
+    return sorted;
+}
+
+// Higher-order functions
+// map f xs, filter f xs, foldl f acc xs and foldr f acc xs loop over lists,
+// vectors and ranges in C, calling f through a lispfunc_frame. Over streams,
+// map and filter add stages, and foldl runs them; see the "Streams" section. Elements of
+// vectors and ranges are passed in one lispval, which is updated in place.
+// map and filter build their answers in arrays allocated upfront; map of a
+// vector is a vector, and so f should return numbers.
+int is_function(lispval* f)
+{
+    return f->type == LISPVAL_BUILTIN_FUNC || f->type == LISPVAL_USER_FUNC;
+}
+
+int is_sequence(lispval* xs)
+{
+    return xs->type == LISPVAL_QEXPR || xs->type == LISPVAL_VEC || xs->type == LISPVAL_RANGE;
+}
+
+lispval* sequence_element(lispval* xs, long long i, lispval* scratch)
+{
+    // The i-th element: a cell of a list, or scratch, updated to hold it
+    if (xs->type == LISPVAL_QEXPR)
+        return xs->cell[i];
+    if (xs->type == LISPVAL_VEC) {
+        scratch->num = xs->vec[i];
+    } else {
+        scratch->integer = range_element(xs, i);
+    }
+    return scratch;
+}
+
+lispval* new_sequence_scratch(lispval* xs)
+{
+    return xs->type == LISPVAL_VEC ? lispval_num(0) : lispval_int(0);
+}
+
+lispval* builtin_map(lispval* v, lispenv* e)
+{
+    // map (@ {x} {* x x}) {1 2 3}
+    if (v->count == 2 && is_function(v->cell[0]) && v->cell[1]->type == LISPVAL_STREAM)
+        return add_lispstream_stage(v->cell[1], LISPSTREAM_MAP, v->cell[0], 0);
+    LISPVAL_ASSERT(v->count == 2 && is_function(v->cell[0]) && is_sequence(v->cell[1]), "Error: function map takes a function and a list, vector, range or stream, e.g., map (@ {x} {* x x}) {1 2 3}");
+    lispval* xs = v->cell[1];
+    long long n = numeric_sequence_length(xs);
+    LISPVAL_ASSERT(n <= INT_MAX, "Error: range too long to map over");
+    lispval* scratch = new_sequence_scratch(xs);
+    lispfunc_frame* frame = new_lispfunc_frame(v->cell[0], 1, e);
+    lispval* answer;
+    if (xs->type == LISPVAL_VEC) {
+        lispvec_buffer* buffer = new_lispvec_buffer(n);
+        answer = lispval_vec(buffer, buffer->data, n);
+    } else {
+        answer = lispval_qexpr();
+        answer->cell = malloc(sizeof(lispval*) * (n > 0 ? n : 1));
+    }
+    for (long long i = 0; i < n; i++) {
+        lispval* x = sequence_element(xs, i, scratch);
+        lispval* y = call_lispfunc_frame(frame, &x);
+        if (y->type == LISPVAL_ERR || (xs->type == LISPVAL_VEC && !lispval_is_number(y))) {
+            if (y->type != LISPVAL_ERR) {
+                delete_lispval(y);
+                y = lispval_err("Error: map over a vector should return numbers");
+            }
+            delete_lispval(answer);
+            answer = y;
+            break;
+        }
+        if (xs->type == LISPVAL_VEC) {
+            answer->vec[i] = lispval_to_double(y);
+            delete_lispval(y);
+        } else {
+            answer->cell[answer->count++] = y;
+        }
+    }
+    delete_lispfunc_frame(frame);
+    delete_lispval(scratch);
+    return answer;
+}
+
+lispval* builtin_filter(lispval* v, lispenv* e)
+{
+    // filter (@ {x} {> x 1}) {1 2 3}
+    if (v->count == 2 && is_function(v->cell[0]) && v->cell[1]->type == LISPVAL_STREAM)
+        return add_lispstream_stage(v->cell[1], LISPSTREAM_FILTER, v->cell[0], 0);
+    LISPVAL_ASSERT(v->count == 2 && is_function(v->cell[0]) && is_sequence(v->cell[1]), "Error: function filter takes a function and a list, vector, range or stream, e.g., filter (@ {x} {> x 1}) {1 2 3}");
+    lispval* xs = v->cell[1];
+    long long n = numeric_sequence_length(xs);
+    LISPVAL_ASSERT(n <= INT_MAX, "Error: range too long to filter");
+    lispval* scratch = new_sequence_scratch(xs);
+    lispfunc_frame* frame = new_lispfunc_frame(v->cell[0], 1, e);
+    double* kept = xs->type == LISPVAL_VEC ? malloc(sizeof(double) * (n > 0 ? n : 1)) : NULL;
+    lispval* answer = lispval_qexpr();
+    if (kept == NULL)
+        answer->cell = malloc(sizeof(lispval*) * (n > 0 ? n : 1));
+    long long kept_count = 0;
+    for (long long i = 0; i < n; i++) {
+        lispval* x = sequence_element(xs, i, scratch);
+        lispval* keep = call_lispfunc_frame(frame, &x);
+        if (keep->type == LISPVAL_ERR) {
+            delete_lispval(answer);
+            answer = keep;
+            break;
+        }
+        if (is_truthy(keep)) {
+            if (kept != NULL) {
+                kept[kept_count++] = x->num;
+            } else {
+                answer->cell[answer->count++] = clone_lispval(x);
+            }
+        }
+        delete_lispval(keep);
+    }
+    if (kept != NULL && answer->type != LISPVAL_ERR) {
+        lispvec_buffer* buffer = new_lispvec_buffer(kept_count);
+        memcpy(buffer->data, kept, kept_count * sizeof(double));
+        delete_lispval(answer);
+        answer = lispval_vec(buffer, buffer->data, kept_count);
+    }
+    free(kept);
+    delete_lispfunc_frame(frame);
+    delete_lispval(scratch);
+    return answer;
+}
+
+lispval* fold_sequence(lispval* v, lispenv* e, int from_the_right)
+{
+    LISPVAL_ASSERT(v->count == 3 && is_function(v->cell[0]) && is_sequence(v->cell[2]), "Error: functions foldl and foldr take a function, an initial value and a list, vector or range, e.g., foldl + 0 {1 2 3}");
+    lispval* xs = v->cell[2];
+    long long n = numeric_sequence_length(xs);
+    lispval* scratch = new_sequence_scratch(xs);
+    lispfunc_frame* frame = new_lispfunc_frame(v->cell[0], 2, e);
+    lispval* acc = clone_lispval(v->cell[1]);
+    for (long long i = 0; i < n; i++) {
+        lispval* args[2];
+        if (from_the_right) {
+            args[0] = sequence_element(xs, n - 1 - i, scratch);
+            args[1] = acc;
+        } else {
+            args[0] = acc;
+            args[1] = sequence_element(xs, i, scratch);
+        }
+        lispval* next = call_lispfunc_frame(frame, args);
+        delete_lispval(acc);
+        acc = next;
+        if (acc->type == LISPVAL_ERR)
+            break;
+    }
+    delete_lispfunc_frame(frame);
+    delete_lispval(scratch);
+    return acc;
+}
+
+lispval* builtin_foldl(lispval* v, lispenv* e)
+{
+    // foldl (@ {acc x} {+ acc x}) 0 {1 2 3}, i.e., (+ (+ (+ 0 1) 2) 3)
+    if (v->count == 3 && is_function(v->cell[0]) && v->cell[2]->type == LISPVAL_STREAM)
+        return run_lispstream(v->cell[2], v->cell[0], v->cell[1], e);
+    return fold_sequence(v, e, 0);
+}
+
+lispval* builtin_foldr(lispval* v, lispenv* e)
+{
+    // foldr (@ {x acc} {+ x acc}) 0 {1 2 3}, i.e., (+ 1 (+ 2 (+ 3 0)))
+    return fold_sequence(v, e, 1);
+}
+
+// Parallel map
+// pmap f xs is map f xs, evaluated over chunks of xs by a pool of threads,
+// one per core, which is started on first use. Each thread has a deque of
+// chunks: it takes them from the bottom of its own and, once that is empty,
+// steals them from the top of the others'. f should be pure. While the
+// threads run, the main thread only waits, the environment is only read, and
+// the threads neither jit nor record type feedback (see PARALLEL_WORKER).
+// Each chunk reseeds the random number generator from a seed drawn before
+// the map, so that random draws are reproducible too.
+#define PMAP_CHUNKS_PER_THREAD 8
+#define PMAP_MIN_LENGTH 64 // below this, pmap is just map
+#define PMAP_STACK_SIZE (8 * 1024 * 1024)
+
+typedef struct pmap_deque {
+    pthread_mutex_t lock;
+    long long top;
+    long long bottom; // chunks top, ..., bottom - 1 are pending
+} pmap_deque;
+
+typedef struct pmap_job {
+    lispval* f;
+    lispval* xs;
+    lispenv* env;
+    long long n;
+    long long chunk_size;
+    uint64_t seed;
+    lispval** results; // for lists and ranges
+    double* vec_results; // for vectors
+    long long error_index; // of the first error found so far, or n
+    lispval* error;
+} pmap_job;
+
+struct {
+    int threads; // 0 until started
+    pmap_deque* deques;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    unsigned long generation; // incremented for each job
+    int busy; // threads still working on the current job
+    pmap_job* job;
+} pmap_pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .work_ready = PTHREAD_COND_INITIALIZER, .work_done = PTHREAD_COND_INITIALIZER };
+
+long long pmap_take_chunk(int id)
+{
+    // Returns -1 once every deque is empty
+    for (int k = 0; k < pmap_pool.threads; k++) {
+        pmap_deque* d = &pmap_pool.deques[(id + k) % pmap_pool.threads];
+        long long chunk = -1;
+        pthread_mutex_lock(&d->lock);
+        if (d->top < d->bottom)
+            chunk = k == 0 ? --d->bottom : d->top++;
+        pthread_mutex_unlock(&d->lock);
+        if (chunk >= 0)
+            return chunk;
+    }
+    return -1;
+}
+
+void pmap_record_error(pmap_job* job, long long i, lispval* err)
+{
+    // Keeps the error of the first element, as map would
+    pthread_mutex_lock(&pmap_pool.lock);
+    if (i < job->error_index) {
+        if (job->error != NULL)
+            delete_lispval(job->error);
+        job->error = err;
+        __atomic_store_n(&job->error_index, i, __ATOMIC_RELAXED);
+    } else {
+        delete_lispval(err);
+    }
+    pthread_mutex_unlock(&pmap_pool.lock);
+}
+
+void pmap_run_chunk(pmap_job* job, long long chunk, lispfunc_frame* frame, lispval* scratch)
+{
+    long long start = chunk * job->chunk_size;
+    long long end = start + job->chunk_size < job->n ? start + job->chunk_size : job->n;
+    seed_random(job->seed + chunk);
+    for (long long i = start; i < end; i++) {
+        // Elements after an error won't be needed
+        if (i > __atomic_load_n(&job->error_index, __ATOMIC_RELAXED))
+            return;
+        lispval* x = sequence_element(job->xs, i, scratch);
+        lispval* y = call_lispfunc_frame(frame, &x);
+        if (y->type == LISPVAL_ERR || (job->vec_results != NULL && !lispval_is_number(y))) {
+            if (y->type != LISPVAL_ERR) {
+                delete_lispval(y);
+                y = lispval_err("Error: map over a vector should return numbers");
+            }
+            pmap_record_error(job, i, y);
+            return;
+        }
+        if (job->vec_results != NULL) {
+            job->vec_results[i] = lispval_to_double(y);
+            delete_lispval(y);
+        } else {
+            job->results[i] = y;
+        }
+    }
+}
+
+void* pmap_thread(void* arg)
+{
+    int id = (int)(intptr_t)arg;
+    PARALLEL_WORKER = 1;
+    unsigned long generation = 0;
+    for (;;) {
+        pthread_mutex_lock(&pmap_pool.lock);
+        while (pmap_pool.generation == generation) {
+            pthread_cond_wait(&pmap_pool.work_ready, &pmap_pool.lock);
+        }
+        generation = pmap_pool.generation;
+        pmap_job* job = pmap_pool.job;
+        pthread_mutex_unlock(&pmap_pool.lock);
+
+        start_thread_evaluation_limits(PMAP_STACK_SIZE);
+        lispfunc_frame* frame = new_lispfunc_frame(job->f, 1, job->env);
+        lispval* scratch = new_sequence_scratch(job->xs);
+        for (long long chunk; (chunk = pmap_take_chunk(id)) >= 0;) {
+            pmap_run_chunk(job, chunk, frame, scratch);
+        }
+        delete_lispval(scratch);
+        delete_lispfunc_frame(frame);
+
+        pthread_mutex_lock(&pmap_pool.lock);
+        if (--pmap_pool.busy == 0)
+            pthread_cond_signal(&pmap_pool.work_done);
+        pthread_mutex_unlock(&pmap_pool.lock);
+    }
+    return NULL;
+}
+
+void start_pmap_pool(void)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cores > 1 ? (int)cores : 1;
+    pmap_pool.deques = malloc(sizeof(pmap_deque) * threads);
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setstacksize(&attributes, PMAP_STACK_SIZE);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    // Threads which fail to start are left out
+    int started = 0;
+    for (int i = 0; i < threads && threads > 1; i++) {
+        pthread_t thread;
+        pthread_mutex_init(&pmap_pool.deques[started].lock, NULL);
+        if (pthread_create(&thread, &attributes, pmap_thread, (void*)(intptr_t)started) == 0)
+            started++;
+    }
+    pthread_attr_destroy(&attributes);
+    pmap_pool.threads = started > 1 ? started : 1;
+}
+
+lispval* builtin_pmap(lispval* v, lispenv* e)
+{
+    // pmap (@ {x} {* x x}) (range 1000)
+    LISPVAL_ASSERT(v->count == 2 && is_function(v->cell[0]) && is_sequence(v->cell[1]), "Error: function pmap takes a function and a list, vector or range, e.g., pmap (@ {x} {* x x}) {1 2 3}");
+    lispval* f = v->cell[0];
+    lispval* xs = v->cell[1];
+    long long n = numeric_sequence_length(xs);
+    LISPVAL_ASSERT(n <= INT_MAX, "Error: range too long to map over");
+    if (pmap_pool.threads == 0)
+        start_pmap_pool();
+    // Builtins are cheap, and the profiler, the tracer and VERBOSE all write
+    // to global state, as would a pmap within a pmap.
+    if (pmap_pool.threads == 1 || n < PMAP_MIN_LENGTH || f->type != LISPVAL_USER_FUNC || PROFILING || TRACING || VERBOSE || PARALLEL_WORKER)
+        return builtin_map(v, e);
+
+    // Compiled here, so that the threads only need to read it
+    get_unboxed_body(f);
+    pmap_job job = {
+        .f = f,
+        .xs = xs,
+        .env = e,
+        .n = n,
+        .chunk_size = (n + pmap_pool.threads * PMAP_CHUNKS_PER_THREAD - 1) / (pmap_pool.threads * PMAP_CHUNKS_PER_THREAD),
+        .seed = random_next(),
+        .error_index = n,
+        .error = NULL,
+    };
+    lispval* answer;
+    if (xs->type == LISPVAL_VEC) {
+        lispvec_buffer* buffer = new_lispvec_buffer(n);
+        answer = lispval_vec(buffer, buffer->data, n);
+        job.vec_results = answer->vec;
+        job.results = NULL;
+    } else {
+        answer = lispval_qexpr();
+        answer->cell = calloc(n, sizeof(lispval*));
+        job.vec_results = NULL;
+        job.results = answer->cell;
+    }
+    // Each thread starts with a contiguous block of chunks
+    long long chunks = (n + job.chunk_size - 1) / job.chunk_size;
+    for (int i = 0; i < pmap_pool.threads; i++) {
+        pmap_pool.deques[i].top = chunks * i / pmap_pool.threads;
+        pmap_pool.deques[i].bottom = chunks * (i + 1) / pmap_pool.threads;
+    }
+
+    pthread_mutex_lock(&pmap_pool.lock);
+    pmap_pool.job = &job;
+    pmap_pool.busy = pmap_pool.threads;
+    pmap_pool.generation++;
+    pthread_cond_broadcast(&pmap_pool.work_ready);
+    while (pmap_pool.busy > 0) {
+        pthread_cond_wait(&pmap_pool.work_done, &pmap_pool.lock);
+    }
+    pmap_pool.job = NULL;
+    pthread_mutex_unlock(&pmap_pool.lock);
+
+    if (job.error != NULL) {
+        if (job.results != NULL) {
+            for (long long i = 0; i < n; i++) {
+                if (job.results[i] != NULL)
+                    delete_lispval(job.results[i]);
+            }
+        }
+        delete_lispval(answer);
+        return job.error;
+    }
+    if (job.results != NULL)
+        answer->count = n;
+    return answer;
+}
+
+// Streams
+// stream xs and lines "file" make streams; map, filter, take and drop, in
+// the "Indexing" section, add stages to them; collect and reduce, or foldl,
+// run them.
+lispval* builtin_stream(lispval* v, lispenv* e)
+{
+    // stream (range 1000000)
+    LISPVAL_ASSERT(v->count == 1 && is_sequence(v->cell[0]), "Error: function stream takes a list, vector or range, e.g., stream (range 10)");
+    lispstream* s = new_lispstream(LISPSTREAM_SOURCE, NULL);
+    s->source = clone_lispval(v->cell[0]);
+    return lispval_stream(s);
+}
+
+lispval* builtin_lines(lispval* v, lispenv* e)
+{
+    // lines "data.csv". The file is only opened when the stream is run.
+    LISPVAL_ASSERT(v->count == 1 && v->cell[0]->type == LISPVAL_STR, "Error: function lines takes the path of a file, e.g., lines \"data.csv\"");
+    lispstream* s = new_lispstream(LISPSTREAM_SOURCE, NULL);
+    s->source = clone_lispval(v->cell[0]);
+    return lispval_stream(s);
+}
+
+lispval* add_lispstream_stage(lispval* stream, int kind, lispval* f, long long n)
+{
+    lispstream* s = new_lispstream(kind, stream->stream);
+    __atomic_add_fetch(&stream->stream->refcount, 1, __ATOMIC_RELAXED);
+    s->f = f != NULL ? clone_lispval(f) : NULL;
+    s->n = n;
+    return lispval_stream(s);
+}
+
+lispval* run_lispstream(lispval* stream, lispval* reducer, lispval* initial, lispenv* e)
+{
+    // Collects the elements of stream into a list or, given a reducer, folds
+    // them into initial. Elements pass through all the stages in turn.
+    int count = count_lispstream_stages(stream->stream);
+    lispstream** stages = malloc(sizeof(lispstream*) * (count > 0 ? count : 1));
+    lispstream* source = stream->stream;
+    for (int i = count - 1; i >= 0; i--) {
+        stages[i] = source;
+        source = source->parent;
+    }
+    lispval* xs = source->source;
+    FILE* file = NULL;
+    if (xs->type == LISPVAL_STR) {
+        char* path = lispstr_to_cstring(xs);
+        file = fopen(path, "r");
+        free(path);
+        if (file == NULL) {
+            free(stages);
+            return lispval_err("Error: could not open file");
+        }
+    }
+
+    lispfunc_frame** frames = calloc(count > 0 ? count : 1, sizeof(lispfunc_frame*));
+    long long* passed = calloc(count > 0 ? count : 1, sizeof(long long)); // for take and drop
+    int done = 0;
+    for (int k = 0; k < count; k++) {
+        if (stages[k]->f != NULL)
+            frames[k] = new_lispfunc_frame(stages[k]->f, 1, e);
+        if (stages[k]->kind == LISPSTREAM_TAKE && stages[k]->n == 0)
+            done = 1;
+    }
+    lispfunc_frame* fold = reducer != NULL ? new_lispfunc_frame(reducer, 2, e) : NULL;
+    lispval* answer = reducer != NULL ? clone_lispval(initial) : lispval_qexpr();
+    long long capacity = 0;
+    lispval* scratch = new_sequence_scratch(xs);
+    char* line = NULL;
+    size_t line_size = 0;
+    long long length = file != NULL ? LLONG_MAX : numeric_sequence_length(xs);
+
+    for (long long i = 0; i < length && !done; i++) {
+        lispval* x;
+        int owned = file != NULL; // or else borrowed from xs, or scratch
+        if (file != NULL) {
+            ssize_t n = getline(&line, &line_size, file);
+            if (n < 0)
+                break;
+            if (n > 0 && line[n - 1] == '\n')
+                n--;
+            x = lispval_str(line, n);
+        } else {
+            x = sequence_element(xs, i, scratch);
+        }
+        int skip = 0;
+        lispval* err = NULL;
+        for (int k = 0; k < count && !skip && err == NULL; k++) {
+            if (stages[k]->kind == LISPSTREAM_MAP) {
+                lispval* y = call_lispfunc_frame(frames[k], &x);
+                if (owned)
+                    delete_lispval(x);
+                x = y;
+                owned = 1;
+                if (y->type == LISPVAL_ERR)
+                    err = y;
+            } else if (stages[k]->kind == LISPSTREAM_FILTER) {
+                lispval* keep = call_lispfunc_frame(frames[k], &x);
+                if (keep->type == LISPVAL_ERR) {
+                    err = keep;
+                } else {
+                    skip = !is_truthy(keep);
+                    delete_lispval(keep);
+                }
+            } else if (stages[k]->kind == LISPSTREAM_TAKE) {
+                // Nothing else gets past this stage once it has let n through
+                if (++passed[k] == stages[k]->n)
+                    done = 1;
+            } else if (stages[k]->kind == LISPSTREAM_DROP) {
+                skip = passed[k]++ < stages[k]->n;
+            }
+        }
+        if (err != NULL) {
+            if (x != err && owned)
+                delete_lispval(x);
+            delete_lispval(answer);
+            answer = err;
+            break;
+        }
+        if (skip) {
+            if (owned)
+                delete_lispval(x);
+            continue;
+        }
+        if (fold != NULL) {
+            lispval* args[2] = { answer, x };
+            lispval* next = call_lispfunc_frame(fold, args);
+            delete_lispval(answer);
+            answer = next;
+            if (owned)
+                delete_lispval(x);
+            if (answer->type == LISPVAL_ERR)
+                break;
+        } else {
+            if (answer->count == capacity) {
+                capacity = capacity > 0 ? 2 * capacity : 16;
+                answer->cell = realloc(answer->cell, sizeof(lispval*) * capacity);
+            }
+            answer->cell[answer->count++] = owned ? x : clone_lispval(x);
+        }
+    }
+
+    free(line);
+    if (file != NULL)
+        fclose(file);
+    delete_lispval(scratch);
+    if (fold != NULL)
+        delete_lispfunc_frame(fold);
+    for (int k = 0; k < count; k++) {
+        if (frames[k] != NULL)
+            delete_lispfunc_frame(frames[k]);
+    }
+    free(frames);
+    free(passed);
+    free(stages);
+    return answer;
+}
+
+lispval* builtin_collect(lispval* v, lispenv* e)
+{
+    // collect (map (@ {x} {* x x}) (stream (range 10)))
+    LISPVAL_ASSERT(v->count == 1 && v->cell[0]->type == LISPVAL_STREAM, "Error: function collect takes a stream, e.g., collect (take 3 (stream (range 10)))");
+    return run_lispstream(v->cell[0], NULL, NULL, e);
+}
+
+lispval* builtin_reduce(lispval* v, lispenv* e)
+{
+    // reduce + 0 (filter (@ {x} {> x 5}) (stream (range 10)))
+    LISPVAL_ASSERT(v->count == 3 && is_function(v->cell[0]) && v->cell[2]->type == LISPVAL_STREAM, "Error: function reduce takes a function, an initial value and a stream, e.g., reduce + 0 (stream (range 10))");
+    return run_lispstream(v->cell[2], v->cell[0], v->cell[1], e);
+}
+
+// Hash maps
+// hash-map {k1 v1 k2 v2 ...} builds a map from a list of keys and values,
+// which, being quoted, aren't evaluated. get looks a key up; assoc and
+// dissoc return a map with keys set or removed, and keys and vals list the
+// entries in the order they were first set.
+lispval* builtin_hash_map(lispval* v, lispenv* e)
+{
+    // hash-map {a 1 b 2}
+    LISPVAL_ASSERT(v->count == 1 && v->cell[0]->type == LISPVAL_QEXPR && v->cell[0]->count % 2 == 0, "Error: function hash-map takes a list of keys and values, e.g., hash-map {a 1 b 2}");
+    lispval* pairs = v->cell[0];
+    for (int i = 0; i < pairs->count; i += 2) {
+        LISPVAL_ASSERT(lispmap_is_key(pairs->cell[i]), "Error: map keys can be any value but nan or a transient");
+    }
+    lispmap* map = new_lispmap(pairs->count / 2);
+    for (int i = 0; i < pairs->count; i += 2) {
+        lispmap_insert(map, clone_lispval(pairs->cell[i]), clone_lispval(pairs->cell[i + 1]));
+    }
+    return lispval_map(map);
+}
+
+lispval* writable_map_operand(lispval* v)
+{
+    // The map v->cell[0], if it holds the only reference to its table, or else a copy
+    lispval* m = v->cell[0];
+    if (__atomic_load_n(&m->map->refcount, __ATOMIC_ACQUIRE) == 1)
+        return lispval_take_child(v, 0);
+    return lispval_map(copy_lispmap(m->map));
+}
+
+lispval* builtin_get(lispval* v, lispenv* e)
+{
+    // get m a, or get m a default
+    LISPVAL_ASSERT(v->count == 2 || v->count == 3, "Error: function get takes a map, a key and optionally a default, e.g., get m 1");
+    lispval* m = v->cell[0];
+    if (m->type == LISPVAL_TRANSIENT) {
+        lispval* error = usable_lisptransient(m, LISPVAL_MAP);
+        if (error != NULL)
+            return error;
+        m = m->transient->value;
+    }
+    LISPVAL_ASSERT(m->type == LISPVAL_MAP, "Error: function get takes a map, a key and optionally a default, e.g., get m 1");
+    lispval* val = lispmap_get(m->map, v->cell[1]);
+    if (val != NULL)
+        return clone_lispval(val);
+    LISPVAL_ASSERT(v->count == 3, "Error: key not in map");
+    return clone_lispval(v->cell[2]);
+}
+
+lispval* builtin_assoc(lispval* v, lispenv* e)
+{
+    // assoc m a 1 b 2
+    LISPVAL_ASSERT(v->count >= 3 && v->count % 2 == 1 && v->cell[0]->type == LISPVAL_MAP, "Error: function assoc takes a map and keys and values, e.g., assoc m 1 2");
+    for (int i = 1; i < v->count; i += 2) {
+        LISPVAL_ASSERT(lispmap_is_key(v->cell[i]), "Error: map keys can be any value but nan or a transient");
+    }
+    lispval* answer = writable_map_operand(v);
+    for (int i = 1; i < v->count; i += 2) {
+        lispmap_insert(answer->map, clone_lispval(v->cell[i]), clone_lispval(v->cell[i + 1]));
+    }
+    return answer;
+}
+
+lispval* builtin_dissoc(lispval* v, lispenv* e)
+{
+    // dissoc m 1 2
+    LISPVAL_ASSERT(v->count >= 2 && v->cell[0]->type == LISPVAL_MAP, "Error: function dissoc takes a map and keys, e.g., dissoc m 1");
+    lispval* answer = writable_map_operand(v);
+    for (int i = 1; i < v->count; i++) {
+        lispmap_remove(answer->map, v->cell[i]);
+    }
+    return answer;
+}
+
+lispval* map_entries(lispval* v, int want_keys)
+{
+    LISPVAL_ASSERT(v->count == 1 && v->cell[0]->type == LISPVAL_MAP, "Error: functions keys and vals take a map");
+    lispmap* map = v->cell[0]->map;
+    lispval* answer = lispval_qexpr();
+    answer->cell = malloc(sizeof(lispval*) * (map->count > 0 ? map->count : 1));
+    for (int i = 0; i < map->used; i++) {
+        if (map->keys[i] != NULL)
+            answer->cell[answer->count++] = clone_lispval(want_keys ? map->keys[i] : map->vals[i]);
+    }
+    return answer;
+}
+
+lispval* builtin_keys(lispval* v, lispenv* e)
+{
+    // keys m
+    return map_entries(v, 1);
+}
+
+lispval* builtin_vals(lispval* v, lispenv* e)
+{
+    // vals m
+    return map_entries(v, 0);
+}
+
+// Strings
+// "..." literals, with C escapes. concat joins strings into a rope,
+// substring s start end is a view of bytes start to end - 1, len counts
+// bytes, and = and > compare strings bytewise.
+lispval* lispstr_concat(lispval* a, lispval* b)
+{
+    long long length = a->str_length + b->str_length;
+    if (length <= LISPSTR_LEAF_MERGE) {
+        char bytes[LISPSTR_LEAF_MERGE];
+        copy_lispstr_bytes(a, bytes);
+        copy_lispstr_bytes(b, bytes + a->str_length);
+        return lispval_str(bytes, length);
+    }
+    lispstr_node* node;
+    if (b->str_length <= LISPSTR_LEAF_MERGE && a->str_node != NULL && a->str_node->bytes == NULL && a->str_offset == 0 && a->str_length == a->str_node->length && a->str_node->right->bytes != NULL && a->str_node->right->length + b->str_length <= LISPSTR_LEAF_MERGE) {
+        // A copy of a's last leaf, with b appended
+        lispstr_node* left = a->str_node;
+        lispstr_node* last = new_lispstr_leaf(left->right->length + b->str_length);
+        memcpy(last->bytes, left->right->bytes, left->right->length);
+        copy_lispstr_bytes(b, last->bytes + left->right->length);
+        node = new_lispstr_concat(retain_lispstr_node(left->left), last);
+    } else if (a->str_length <= LISPSTR_LEAF_MERGE && b->str_node != NULL && b->str_node->bytes == NULL && b->str_offset == 0 && b->str_length == b->str_node->length && b->str_node->left->bytes != NULL && b->str_node->left->length + a->str_length <= LISPSTR_LEAF_MERGE) {
+        // A copy of b's first leaf, with a prepended
+        lispstr_node* right = b->str_node;
+        lispstr_node* first = new_lispstr_leaf(a->str_length + right->left->length);
+        copy_lispstr_bytes(a, first->bytes);
+        memcpy(first->bytes + a->str_length, right->left->bytes, right->left->length);
+        node = new_lispstr_concat(first, retain_lispstr_node(right->right));
+    } else {
+        node = new_lispstr_concat(lispstr_node_of(a), lispstr_node_of(b));
+    }
+    if (node->depth > LISPSTR_MAX_DEPTH)
+        node = rebalance_lispstr(node);
+    return lispval_str_view(node, 0, length);
+}
+
+lispval* builtin_concat(lispval* v, lispenv* e)
+{
+    // concat "ab" "cd" "ef"
+    LISPVAL_ASSERT(v->count >= 1, "Error: function concat takes strings, e.g., concat \"ab\" \"cd\"");
+    for (int i = 0; i < v->count; i++) {
+        LISPVAL_ASSERT(v->cell[i]->type == LISPVAL_STR, "Error: function concat takes strings, e.g., concat \"ab\" \"cd\"");
+    }
+    lispval* answer = clone_lispval(v->cell[0]);
+    for (int i = 1; i < v->count; i++) {
+        lispval* joined = lispstr_concat(answer, v->cell[i]);
+        delete_lispval(answer);
+        answer = joined;
+    }
+    return answer;
+}
+
+lispval* builtin_substring(lispval* v, lispenv* e)
+{
+    // substring "hello" 1 3, i.e., "el"; without an end, up to the end
+    LISPVAL_ASSERT((v->count == 2 || v->count == 3) && v->cell[0]->type == LISPVAL_STR, "Error: function substring takes a string, a start and optionally an end, e.g., substring \"hello\" 1 3");
+    lispval* s = v->cell[0];
+    for (int i = 1; i < v->count; i++) {
+        LISPVAL_ASSERT(v->cell[i]->type == LISPVAL_INT, "Error: substring indices should be integers");
+    }
+    long long start = v->cell[1]->integer;
+    long long end = v->count == 3 ? v->cell[2]->integer : s->str_length;
+    LISPVAL_ASSERT(0 <= start && start <= end && end <= s->str_length, "Error: substring indices out of bounds");
+    if (s->str_node == NULL)
+        return lispval_str(s->str_inline + start, end - start);
+    return lispval_str_view(retain_lispstr_node(s->str_node), s->str_offset + start, end - start);
+}
+
+// Indexing
+// nth, last, slice, take and drop index directly into lists, vectors,
+// ranges and strings, whose elements are bytes. Slices of vectors and
+// strings are views which share their buffer or rope, and slices of ranges
+// are ranges, so none of those copy elements; slices of lists clone just
+// the elements in the slice. Indices which are floats are truncated, so
+// that e.g. (/ (+ lo hi) 2) can be used as one.
+int is_index(lispval* x)
+{
+    return x->type == LISPVAL_INT || x->type == LISPVAL_BIGINT || (x->type == LISPVAL_NUM && !isnan(x->num));
+}
+
+long long index_value(lispval* x)
+{
+    // Out of range values, which are out of bounds anyway, saturate
+    if (x->type == LISPVAL_INT)
+        return x->integer;
+    if (x->type == LISPVAL_BIGINT)
+        return x->bigint_sign < 0 ? LLONG_MIN : LLONG_MAX;
+    if (x->num >= 0x1p63)
+        return LLONG_MAX;
+    if (x->num <= -0x1p63)
+        return LLONG_MIN;
+    return (long long)x->num;
+}
+
+int is_indexable(lispval* xs)
+{
+    return is_sequence(xs) || xs->type == LISPVAL_STR;
+}
+
+long long indexable_length(lispval* xs)
+{
+    return xs->type == LISPVAL_STR ? xs->str_length : numeric_sequence_length(xs);
+}
+
+lispval* slice_indexable(lispval* xs, long long start, long long end)
+{
+    // Elements start to end - 1, for 0 <= start <= end <= length
+    long long n = end - start;
+    switch (xs->type) {
+    case LISPVAL_VEC:
+        __atomic_add_fetch(&xs->vec_buffer->refcount, 1, __ATOMIC_RELAXED);
+        return lispval_vec(xs->vec_buffer, xs->vec + start, n);
+    case LISPVAL_RANGE:
+        return lispval_range(n > 0 ? range_element(xs, start) : xs->range_start, xs->range_step, n);
+    case LISPVAL_STR:
+        if (xs->str_node == NULL)
+            return lispval_str(xs->str_inline + start, n);
+        return lispval_str_view(retain_lispstr_node(xs->str_node), xs->str_offset + start, n);
+    default: {
+        lispval* answer = lispval_qexpr();
+        answer->cell = malloc(sizeof(lispval*) * (n > 0 ? n : 1));
+        for (long long i = start; i < end; i++) {
+            answer->cell[answer->count++] = clone_lispval(xs->cell[i]);
+        }
+        return answer;
+    }
+    }
+}
+
+lispval* nth_of_indexable(lispval* xs, long long i)
+{
+    switch (xs->type) {
+    case LISPVAL_VEC:
+        return lispval_num(xs->vec[i]);
+    case LISPVAL_RANGE:
+        return lispval_int(range_element(xs, i));
+    case LISPVAL_STR:
+        return slice_indexable(xs, i, i + 1);
+    default:
+        return clone_lispval(xs->cell[i]);
+    }
+}
+
+lispval* builtin_nth(lispval* v, lispenv* e)
+{
+    // nth {a b c} 1, i.e., b
+    LISPVAL_ASSERT(v->count == 2 && is_indexable(v->cell[0]) && is_index(v->cell[1]), "Error: function nth takes a list, vector, range or string and an index, e.g., nth {a b c} 1");
+    long long i = index_value(v->cell[1]);
+    LISPVAL_ASSERT(0 <= i && i < indexable_length(v->cell[0]), "Error: index out of bounds");
+    return nth_of_indexable(v->cell[0], i);
+}
+
+lispval* builtin_last(lispval* v, lispenv* e)
+{
+    // last {a b c}
+    LISPVAL_ASSERT(v->count == 1 && is_indexable(v->cell[0]), "Error: function last takes a list, vector, range or string, e.g., last {a b c}");
+    long long n = indexable_length(v->cell[0]);
+    LISPVAL_ASSERT(n > 0, "Error: function last passed {}");
+    return nth_of_indexable(v->cell[0], n - 1);
+}
+
+lispval* builtin_slice(lispval* v, lispenv* e)
+{
+    // slice {a b c d} 1 3, i.e., {b c}; without an end, up to the end
+    LISPVAL_ASSERT((v->count == 2 || v->count == 3) && is_indexable(v->cell[0]), "Error: function slice takes a list, vector, range or string, a start and optionally an end, e.g., slice {a b c d} 1 3");
+    for (int i = 1; i < v->count; i++) {
+        LISPVAL_ASSERT(is_index(v->cell[i]), "Error: slice indices should be numbers");
+    }
+    long long length = indexable_length(v->cell[0]);
+    long long start = index_value(v->cell[1]);
+    long long end = v->count == 3 ? index_value(v->cell[2]) : length;
+    LISPVAL_ASSERT(0 <= start && start <= end && end <= length, "Error: slice indices out of bounds");
+    return slice_indexable(v->cell[0], start, end);
+}
+
+lispval* builtin_take(lispval* v, lispenv* e)
+{
+    // take 2 {a b c}, i.e., {a b}: at most the first n elements
+    LISPVAL_ASSERT(v->count == 2 && is_index(v->cell[0]) && (is_indexable(v->cell[1]) || v->cell[1]->type == LISPVAL_STREAM), "Error: function take takes a number and a list, vector, range, string or stream, e.g., take 2 {a b c}");
+    long long n = index_value(v->cell[0]);
+    LISPVAL_ASSERT(n >= 0, "Error: can't take a negative number of elements");
+    if (v->cell[1]->type == LISPVAL_STREAM)
+        return add_lispstream_stage(v->cell[1], LISPSTREAM_TAKE, NULL, n);
+    long long length = indexable_length(v->cell[1]);
+    return slice_indexable(v->cell[1], 0, n < length ? n : length);
+}
+
+lispval* builtin_drop(lispval* v, lispenv* e)
+{
+    // drop 2 {a b c}, i.e., {c}: all but the first n elements
+    LISPVAL_ASSERT(v->count == 2 && is_index(v->cell[0]) && (is_indexable(v->cell[1]) || v->cell[1]->type == LISPVAL_STREAM), "Error: function drop takes a number and a list, vector, range, string or stream, e.g., drop 2 {a b c}");
+    long long n = index_value(v->cell[0]);
+    LISPVAL_ASSERT(n >= 0, "Error: can't drop a negative number of elements");
+    if (v->cell[1]->type == LISPVAL_STREAM)
+        return add_lispstream_stage(v->cell[1], LISPSTREAM_DROP, NULL, n);
+    long long length = indexable_length(v->cell[1]);
+    return slice_indexable(v->cell[1], n < length ? n : length, length);
+}
+
+// Transients
+// transient xs, or transient m, takes over a list or a map; push! appends
+// to a transient list, and assoc! and dissoc! set and remove keys of a
+// transient map, in place. Each returns the transient, so that they can be
+// chained or folded over. persistent! freezes it back into a list or map.
+// E.g., persistent! (foldl (@ {t x} {push! t (* x x)}) (transient {}) {1 2 3})
+lispval* usable_lisptransient(lispval* t, int type)
+{
+    // An error, if t can't be changed or read here, or else NULL
+    LISPVAL_ASSERT(t->type == LISPVAL_TRANSIENT, "Error: expected a transient, e.g., transient {}");
+    LISPVAL_ASSERT(pthread_equal(t->transient->owner, pthread_self()), "Error: transient used outside the thread which made it");
+    LISPVAL_ASSERT(t->transient->value != NULL, "Error: transient used after persistent!");
+    LISPVAL_ASSERT(type == -1 || t->transient->value->type == type, type == LISPVAL_MAP ? "Error: transient is not a map" : "Error: transient is not a list");
+    return NULL;
+}
+
+lispval* builtin_transient(lispval* v, lispenv* e)
+{
+    // transient {}, or transient (hash-map {})
+    LISPVAL_ASSERT(v->count == 1 && (v->cell[0]->type == LISPVAL_QEXPR || v->cell[0]->type == LISPVAL_MAP), "Error: function transient takes a list or a map, e.g., transient {}");
+    // The operand is ours, so a list's cells can be taken over without copying them
+    lispval* value = v->cell[0]->type == LISPVAL_MAP ? writable_map_operand(v) : lispval_take_child(v, 0);
+    return lispval_transient(new_lisptransient(value));
+}
+
+lispval* builtin_push(lispval* v, lispenv* e)
+{
+    // push! t 1 2 3
+    LISPVAL_ASSERT(v->count >= 2, "Error: function push! takes a transient list and elements, e.g., push! t 1");
+    lispval* error = usable_lisptransient(v->cell[0], LISPVAL_QEXPR);
+    if (error != NULL)
+        return error;
+    lisptransient* t = v->cell[0]->transient;
+    lispval* list = t->value;
+    if (list->count + v->count - 1 > t->capacity) {
+        while (list->count + v->count - 1 > t->capacity) {
+            t->capacity = t->capacity < 4 ? 4 : 2 * t->capacity;
+        }
+        list->cell = realloc(list->cell, sizeof(lispval*) * t->capacity);
+    }
+    for (int i = 1; i < v->count; i++) {
+        list->cell[list->count++] = lispval_take_child(v, i);
+    }
+    list->cell_hash = 0;
+    return lispval_take_child(v, 0);
+}
+
+lispval* builtin_assoc_transient(lispval* v, lispenv* e)
+{
+    // assoc! t a 1 b 2
+    LISPVAL_ASSERT(v->count >= 3 && v->count % 2 == 1, "Error: function assoc! takes a transient map and keys and values, e.g., assoc! t 1 2");
+    lispval* error = usable_lisptransient(v->cell[0], LISPVAL_MAP);
+    if (error != NULL)
+        return error;
+    for (int i = 1; i < v->count; i += 2) {
+        LISPVAL_ASSERT(lispmap_is_key(v->cell[i]), "Error: map keys can be any value but nan or a transient");
+    }
+    // transient made sure that the builder holds the only reference to the table
+    lispmap* map = v->cell[0]->transient->value->map;
+    for (int i = 1; i < v->count; i += 2) {
+        lispmap_insert(map, lispval_take_child(v, i), lispval_take_child(v, i + 1));
+    }
+    return lispval_take_child(v, 0);
+}
+
+lispval* builtin_dissoc_transient(lispval* v, lispenv* e)
+{
+    // dissoc! t 1 2
+    LISPVAL_ASSERT(v->count >= 2, "Error: function dissoc! takes a transient map and keys, e.g., dissoc! t 1");
+    lispval* error = usable_lisptransient(v->cell[0], LISPVAL_MAP);
+    if (error != NULL)
+        return error;
+    lispmap* map = v->cell[0]->transient->value->map;
+    for (int i = 1; i < v->count; i++) {
+        lispmap_remove(map, v->cell[i]);
+    }
+    return lispval_take_child(v, 0);
+}
+
+lispval* builtin_persistent(lispval* v, lispenv* e)
+{
+    // persistent! t
+    LISPVAL_ASSERT(v->count == 1, "Error: function persistent! takes a transient, e.g., persistent! (transient {})");
+    lispval* error = usable_lisptransient(v->cell[0], -1);
+    if (error != NULL)
+        return error;
+    lisptransient* t = v->cell[0]->transient;
+    lispval* value = t->value;
+    t->value = NULL;
+    return value;
+}
+
+// Math functions
+// sqrt, exp, log, sin, cos, abs and pow, of numbers or elementwise over
+// vectors. Numbers go to libm; vectors, to the kernels above. As for the
+// vector arithmetic, domain errors give nan rather than an error.
+lispval* builtin_math_function(char* name, lispval* v)
+{
+    LISPVAL_ASSERT(v->count == 1, "Error: math functions take one argument, e.g., sqrt 2");
+    lispval* x = v->cell[0];
+    if (strcmp(name, "abs") == 0 && lispval_is_integer(x)) {
+        // Exact, and LLONG_MIN becomes a big integer
+        int negative = x->type == LISPVAL_INT ? x->integer < 0 : x->bigint_sign < 0;
+        if (!negative)
+            return clone_lispval(x);
+        lispval* minus_one = lispval_int(-1);
+        lispval* answer = exact_integer_op("*", x, minus_one);
+        delete_lispval(minus_one);
+        return answer;
+    }
+    double (*scalar)(double) = strcmp(name, "sqrt") == 0 ? sqrt
+        : strcmp(name, "exp") == 0                       ? exp
+        : strcmp(name, "log") == 0                       ? log
+        : strcmp(name, "sin") == 0                       ? sin
+        : strcmp(name, "cos") == 0                       ? cos
+                                                         : fabs;
+    if (x->type == LISPVAL_VEC) {
+        void (*kernel)(double*, long) = strcmp(name, "sqrt") == 0 ? vec_sqrt
+            : strcmp(name, "exp") == 0                            ? vec_exp
+            : strcmp(name, "log") == 0                            ? vec_log
+            : strcmp(name, "sin") == 0                            ? vec_sin
+            : strcmp(name, "cos") == 0                            ? vec_cos
+                                                                  : vec_abs;
+        lispvec_buffer* buffer = new_lispvec_buffer(x->count);
+        memcpy(buffer->data, x->vec, x->count * sizeof(double));
+        kernel(buffer->data, x->count);
+        return lispval_vec(buffer, buffer->data, x->count);
+    }
+    LISPVAL_ASSERT(lispval_is_number(x), "Error: math functions take a number or a vector");
+    return lispval_num(scalar(lispval_to_double(x)));
+}
+
+lispval* builtin_sqrt(lispval* v, lispenv* e)
+{
+    return builtin_math_function("sqrt", v);
+}
+
+lispval* builtin_exp(lispval* v, lispenv* e)
+{
+    return builtin_math_function("exp", v);
+}
+
+lispval* builtin_log(lispval* v, lispenv* e)
+{
+    return builtin_math_function("log", v);
+}
+
+lispval* builtin_sin(lispval* v, lispenv* e)
+{
+    return builtin_math_function("sin", v);
+}
+
+lispval* builtin_cos(lispval* v, lispenv* e)
+{
+    return builtin_math_function("cos", v);
+}
+
+lispval* builtin_abs(lispval* v, lispenv* e)
+{
+    return builtin_math_function("abs", v);
+}
+
+lispval* builtin_pow(lispval* v, lispenv* e)
+{
+    // pow 2 10, pow (vec {1 2 3}) 2, pow 2 (vec {1 2 3})
+    LISPVAL_ASSERT(v->count == 2, "Error: function pow takes a base and an exponent, e.g., pow 2 10");
+    lispval* x = v->cell[0];
+    lispval* y = v->cell[1];
+    LISPVAL_ASSERT((lispval_is_number(x) || x->type == LISPVAL_VEC) && (lispval_is_number(y) || y->type == LISPVAL_VEC), "Error: function pow takes numbers or vectors");
+    if (x->type != LISPVAL_VEC && y->type != LISPVAL_VEC)
+        return lispval_num(pow(lispval_to_double(x), lispval_to_double(y)));
+    LISPVAL_ASSERT(x->type != LISPVAL_VEC || y->type != LISPVAL_VEC || x->count == y->count, "Error: Operating on vectors of different lengths.");
+    long n = x->type == LISPVAL_VEC ? x->count : y->count;
+    lispvec_buffer* buffer = new_lispvec_buffer(n);
+    if (x->type == LISPVAL_VEC) {
+        memcpy(buffer->data, x->vec, n * sizeof(double));
+    } else {
+        for (long i = 0; i < n; i++) {
+            buffer->data[i] = lispval_to_double(x);
+        }
+    }
+    if (y->type == LISPVAL_VEC) {
+        vec_pow(buffer->data, y->vec, 0, n);
+    } else {
+        vec_pow(buffer->data, NULL, lispval_to_double(y), n);
+    }
+    return lispval_vec(buffer, buffer->data, n);
+}
+
+// Random numbers
+// seed n restarts the generator. uniform low high, normal mean sd and
+// randint low high draw a number; with a third argument n, they fill a
+// vector with n draws instead.
+lispval* builtin_seed(lispval* v, lispenv* e)
+{
+    // seed 42
+    LISPVAL_ASSERT(v->count == 1 && v->cell[0]->type == LISPVAL_INT, "Error: function seed takes a 64-bit integer, e.g., seed 42");
+    seed_random(v->cell[0]->integer);
+    return lispval_sexpr(); // ()
+}
+
+lispval* builtin_random_draws(char* name, lispval* v)
+{
+    LISPVAL_ASSERT(v->count == 2 || v->count == 3, "Error: random functions take two parameters, and optionally a number of draws, e.g., uniform 0 1 1000");
+    LISPVAL_ASSERT(lispval_is_number(v->cell[0]) && lispval_is_number(v->cell[1]), "Error: the parameters of random functions are numbers");
+    long n = -1;
+    if (v->count == 3) {
+        LISPVAL_ASSERT(v->cell[2]->type == LISPVAL_INT && v->cell[2]->integer >= 0 && v->cell[2]->integer <= INT_MAX, "Error: the number of draws should be a non-negative integer");
+        n = v->cell[2]->integer;
+    }
+    if (strcmp(name, "randint") == 0) {
+        // Inclusive of both ends
+        LISPVAL_ASSERT(v->cell[0]->type == LISPVAL_INT && v->cell[1]->type == LISPVAL_INT, "Error: function randint takes 64-bit integers, e.g., randint 1 6");
+        long long low = v->cell[0]->integer;
+        long long high = v->cell[1]->integer;
+        LISPVAL_ASSERT(low <= high, "Error: randint of an empty interval");
+        uint64_t width = (uint64_t)high - (uint64_t)low + 1;
+        if (n < 0)
+            return lispval_int((long long)((uint64_t)low + random_below(width)));
+        lispvec_buffer* buffer = new_lispvec_buffer(n);
+        for (long i = 0; i < n; i++) {
+            buffer->data[i] = (long long)((uint64_t)low + random_below(width));
+        }
+        return lispval_vec(buffer, buffer->data, n);
+    }
+    double a = lispval_to_double(v->cell[0]);
+    double b = lispval_to_double(v->cell[1]);
+    int normal = strcmp(name, "normal") == 0;
+    if (normal) {
+        LISPVAL_ASSERT(b >= 0, "Error: normal with a negative standard deviation");
+    } else {
+        LISPVAL_ASSERT(a <= b, "Error: uniform of an empty interval");
+    }
+    if (n < 0)
+        return lispval_num(normal ? a + b * random_normal() : a + (b - a) * random_uniform());
+    lispvec_buffer* buffer = new_lispvec_buffer(n);
+    if (normal) {
+        vec_random_normal(buffer->data, a, b, n);
+    } else {
+        vec_random_uniform(buffer->data, a, b, n);
+    }
+    return lispval_vec(buffer, buffer->data, n);
+}
+
+lispval* builtin_uniform(lispval* v, lispenv* e)
+{
+    // uniform 0 1, uniform 0 1 1000
+    return builtin_random_draws("uniform", v);
+}
+
+lispval* builtin_normal(lispval* v, lispenv* e)
+{
+    // normal 0 1, normal 0 1 1000
+    return builtin_random_draws("normal", v);
+}
+
+lispval* builtin_randint(lispval* v, lispenv* e)
+{
+    // randint 1 6, randint 1 6 1000
+    return builtin_random_draws("randint", v);
+}
+
+// Add builtins to an env
+void lispenv_add_builtin(char* builtin_func_name, lispbuiltin func, lispenv* env)
+{
+    if (VERBOSE)
+        printfln("Adding func: name: %s, pointer: %p", builtin_func_name, func);
+    lispval* f = lispval_builtin_func(func, builtin_func_name);
+    if (VERBOSE)
+        print_lispval_tree(f, 0);
+    insert_in_current_lispenv(builtin_func_name, f, env);
+    delete_lispval(f);
+}
+void lispenv_add_builtins(lispenv* env)
+{
+    // Math functions
+    lispenv_add_builtin("+", builtin_add, env);
+    lispenv_add_builtin("-", builtin_substract, env);
+    lispenv_add_builtin("*", builtin_multiply, env);
+    lispenv_add_builtin("/", builtin_divide, env);
+
+    //
+    /* List Functions */
+    lispenv_add_builtin("list", builtin_list, env);
+    lispenv_add_builtin("head", builtin_head, env);
+    lispenv_add_builtin("tail", builtin_tail, env);
+    lispenv_add_builtin("eval", builtin_eval, env);
+    lispenv_add_builtin("join", builtin_join, env);
+    lispenv_add_builtin("len", builtin_len, env);
+    lispenv_add_builtin("vec", builtin_vec, env);
+    lispenv_add_builtin("range", builtin_range, env);
+    lispenv_add_builtin("sum", builtin_sum, env);
+    lispenv_add_builtin("product", builtin_product, env);
+    lispenv_add_builtin("min", builtin_min, env);
+    lispenv_add_builtin("max", builtin_max, env);
+    lispenv_add_builtin("dot", builtin_dot, env);
+    lispenv_add_builtin("mean", builtin_mean, env);
+    lispenv_add_builtin("variance", builtin_variance, env);
+    lispenv_add_builtin("median", builtin_median, env);
+    lispenv_add_builtin("quantile", builtin_quantile, env);
+    lispenv_add_builtin("sort", builtin_sort, env);
+    lispenv_add_builtin("sort-by", builtin_sort_by, env);
+    lispenv_add_builtin("map", builtin_map, env);
+    lispenv_add_builtin("filter", builtin_filter, env);
+    lispenv_add_builtin("foldl", builtin_foldl, env);
+    lispenv_add_builtin("foldr", builtin_foldr, env);
+    lispenv_add_builtin("pmap", builtin_pmap, env);
+    lispenv_add_builtin("stream", builtin_stream, env);
+    lispenv_add_builtin("lines", builtin_lines, env);
+    lispenv_add_builtin("take", builtin_take, env);
+    lispenv_add_builtin("drop", builtin_drop, env);
+    lispenv_add_builtin("nth", builtin_nth, env);
+    lispenv_add_builtin("last", builtin_last, env);
+    lispenv_add_builtin("slice", builtin_slice, env);
+    lispenv_add_builtin("collect", builtin_collect, env);
+    lispenv_add_builtin("reduce", builtin_reduce, env);
+    lispenv_add_builtin("hash-map", builtin_hash_map, env);
+    lispenv_add_builtin("get", builtin_get, env);
+    lispenv_add_builtin("assoc", builtin_assoc, env);
+    lispenv_add_builtin("dissoc", builtin_dissoc, env);
+    lispenv_add_builtin("keys", builtin_keys, env);
+    lispenv_add_builtin("vals", builtin_vals, env);
+    lispenv_add_builtin("transient", builtin_transient, env);
+    lispenv_add_builtin("push!", builtin_push, env);
+    lispenv_add_builtin("assoc!", builtin_assoc_transient, env);
+    lispenv_add_builtin("dissoc!", builtin_dissoc_transient, env);
+    lispenv_add_builtin("persistent!", builtin_persistent, env);
+    lispenv_add_builtin("concat", builtin_concat, env);
+    lispenv_add_builtin("substring", builtin_substring, env);
+    lispenv_add_builtin("sqrt", builtin_sqrt, env);
+    lispenv_add_builtin("exp", builtin_exp, env);
+    lispenv_add_builtin("log", builtin_log, env);
+    lispenv_add_builtin("sin", builtin_sin, env);
+    lispenv_add_builtin("cos", builtin_cos, env);
+    lispenv_add_builtin("pow", builtin_pow, env);
+    lispenv_add_builtin("abs", builtin_abs, env);
+    lispenv_add_builtin("seed", builtin_seed, env);
+    lispenv_add_builtin("uniform", builtin_uniform, env);
+    lispenv_add_builtin("normal", builtin_normal, env);
+    lispenv_add_builtin("randint", builtin_randint, env);
+    lispenv_add_builtin("def", builtin_def, env);
+    lispenv_add_builtin("@", builtin_define_lambda, env);
+    lispenv_add_builtin("ifelse", builtin_ifelse, env);
+    lispenv_add_builtin("if", builtin_ifelse, env);
+    lispenv_add_builtin("=", builtin_equal, env);
+    lispenv_add_builtin(">", builtin_greater_than, env);
+}
+
+// Limits on evaluation
+// A step is a call to evaluate_lispval. Rather than checking the limits on
+// every step, EVAL_POLL_COUNTDOWN is decremented, and the limits are only
+// checked when it reaches 0. Once a limit is hit, evaluation_should_stop
+// keeps returning 1, so that every pending evaluate_lispval returns an error
+// and the stack unwinds.
+// Set with BUDGET=steps and TIMEOUT=milliseconds in the repl; 0 means no limit.
+// Ctrl+C interrupts the current evaluation, and only exits at the prompt.
+// The countdown, steps and stack limit are per thread, so pmap's threads
+// each count their own steps against the budget.
+#define EVAL_POLL_INTERVAL 1024
+#define EVAL_STACK_MARGIN (256 * 1024)
+long long EVAL_STEP_BUDGET = 0;
+long long EVAL_TIMEOUT_MS = 0;
+volatile sig_atomic_t EVAL_INTERRUPTED = 0;
+__thread int EVAL_POLL_COUNTDOWN = EVAL_POLL_INTERVAL;
+__thread char* EVAL_STACK_LIMIT = NULL; // recursing below this address is an error
+__thread char* EVAL_STOPPED = NULL; // reason for stopping, if any
+__thread long long eval_steps = 0;
+__thread int eval_poll_period = EVAL_POLL_INTERVAL; // what EVAL_POLL_COUNTDOWN was last set to
+struct timespec eval_deadline;
+
+void reset_evaluation_poll_countdown(void)
+{
+    eval_poll_period = EVAL_POLL_INTERVAL;
+    if (EVAL_STEP_BUDGET > 0 && EVAL_STEP_BUDGET - eval_steps < EVAL_POLL_INTERVAL) {
+        eval_poll_period = EVAL_STEP_BUDGET - eval_steps;
+    }
+    EVAL_POLL_COUNTDOWN = eval_poll_period;
+}
+
+void start_thread_evaluation_limits(size_t usable_stack)
+{
+    // The evaluation limits of the calling thread, whose stack grows
+    // downwards from around here. The deadline is shared.
+    eval_steps = 0;
+    EVAL_STOPPED = NULL;
+    reset_evaluation_poll_countdown();
+    char stack_position;
+    EVAL_STACK_LIMIT = (char*)((uintptr_t)&stack_position - (usable_stack - EVAL_STACK_MARGIN));
+}
+
+void handle_sigint_during_evaluation(int signal)
+{
+    EVAL_INTERRUPTED = 1;
+}
+
+void start_evaluation_limits(void)
+{
+    EVAL_INTERRUPTED = 0;
+    if (EVAL_TIMEOUT_MS > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &eval_deadline);
+        eval_deadline.tv_sec += EVAL_TIMEOUT_MS / 1000;
+        eval_deadline.tv_nsec += (EVAL_TIMEOUT_MS % 1000) * 1000000;
+        if (eval_deadline.tv_nsec >= 1000000000) {
+            eval_deadline.tv_sec++;
+            eval_deadline.tv_nsec -= 1000000000;
+        }
+    }
+    struct rlimit stack_size;
+    size_t usable_stack = 8 * 1024 * 1024;
+    if (getrlimit(RLIMIT_STACK, &stack_size) == 0 && stack_size.rlim_cur != RLIM_INFINITY) {
+        usable_stack = stack_size.rlim_cur;
+    }
+    start_thread_evaluation_limits(usable_stack);
+
+    struct sigaction action = { 0 };
+    action.sa_handler = handle_sigint_during_evaluation;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+}
+
+void stop_evaluation_limits(void)
+{
+    signal(SIGINT, SIG_DFL);
+}
 
-    for (int i = 0; i < origin_env->count; i++) {
-        new_env->syms[i] = malloc(strlen(origin_env->syms[i]) + 1);
-        strcpy(new_env->syms[i], origin_env->syms[i]);
-        new_env->vals[i] = clone_lispval(origin_env->vals[i]);
+int evaluation_should_stop(void)
+{
+    // Called when EVAL_POLL_COUNTDOWN reaches 0
+    if (EVAL_STOPPED != NULL)
+        return 1;
+    eval_steps += eval_poll_period - EVAL_POLL_COUNTDOWN;
+    if (EVAL_INTERRUPTED) {
+        EVAL_STOPPED = "Error: evaluation interrupted";
+    } else if (EVAL_STEP_BUDGET > 0 && eval_steps >= EVAL_STEP_BUDGET) {
+        EVAL_STOPPED = "Error: evaluation step budget exceeded";
+    } else if (EVAL_TIMEOUT_MS > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > eval_deadline.tv_sec || (now.tv_sec == eval_deadline.tv_sec && now.tv_nsec >= eval_deadline.tv_nsec)) {
+            EVAL_STOPPED = "Error: evaluation deadline exceeded";
+        }
     }
-    return new_env;
+    if (EVAL_STOPPED != NULL) {
+        EVAL_POLL_COUNTDOWN = 0;
+        return 1;
+    }
+    reset_evaluation_poll_countdown();
+    return 0;
 }
 
-// Read ast into a lispval object
-lispval* lispval_append_child(lispval* parent, lispval* child)
+int evaluation_stack_exhausted(void)
 {
-    parent->count = parent->count + 1;
-    parent->cell = realloc(parent->cell, sizeof(lispval) * parent->count);
-    parent->cell[parent->count - 1] = child;
-    return parent;
+    char stack_position;
+    if (EVAL_STACK_LIMIT != NULL && &stack_position < EVAL_STACK_LIMIT) {
+        if (EVAL_STOPPED == NULL)
+            EVAL_STOPPED = "Error: maximum recursion depth exceeded";
+        EVAL_POLL_COUNTDOWN = 0;
+        return 1;
+    }
+    return 0;
 }
-lispval* read_lispval_num(mpc_ast_t* t)
+
+// Function info
+lispfunc_info* new_lispfunc_info(void)
 {
-    errno = 0;
-    double x = strtod(t->contents, NULL);
-    return errno != ERANGE ? lispval_num(x)
-                           : lispval_err("Error: Invalid number.");
+    lispfunc_info* info = malloc(sizeof(lispfunc_info));
+    info->refcount = 1;
+    info->name = NULL;
+    info->body_hash = 0;
+    info->calls = 0;
+    info->seen_types = 0;
+    info->unboxed_tried = 0;
+    info->unboxed = NULL;
+    info->unboxed_self_calls = 0;
+    info->unboxed_types = 0;
+    info->jit_tried = 0;
+    info->jit_func = NULL;
+    info->jit_size = 0;
+    info->jit_integer_func = NULL;
+    info->jit_integer_size = 0;
+    info->prof_calls = 0;
+    info->prof_self_samples = 0;
+    info->prof_total_samples = 0;
+    info->prof_last_sample = 0;
+    info->prof_active = 0;
+    info->prof_entered_ns = 0;
+    info->prof_time_ns = 0;
+    return info;
 }
 
-lispval* read_lispval(mpc_ast_t* t)
+void free_jit_func(lispfunc_info* info);
+void delete_unboxed_expr(struct unboxed_expr* e);
+void release_lispfunc_info(lispfunc_info* info)
 {
-    // Non-ignorable children
-    // Relevant for the edge-case of considering the case where you
-    // only have one top level item in brackets
-    int c = 0;
-    int c_index = -1;
-    for (int i = 0; i < t->children_num; i++) {
-        mpc_ast_t* child = t->children[i];
-        if ((strcmp(child->tag, "regex") != 0) || (strcmp(child->contents, "") != 0) || child->children_num != 0) {
-            c++;
-            c_index = i;
-        }
+    // Atomically, since pmap's threads clone functions from the environment
+    if (__atomic_sub_fetch(&info->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    if (info->name != NULL)
+        free(info->name);
+    free_jit_func(info);
+    delete_unboxed_expr(info->unboxed);
+    free(info);
+}
+
+unsigned long long hash_lispval(lispval* v);
+char* format_lispfunc_name(lispval* f, char* anonymous_name)
+{
+    // The symbol f was def'd to, or else lambda-<hash of its body>,
+    // written to anonymous_name, which should have space for 32 chars.
+    lispfunc_info* info = f->func_info;
+    if (info->name != NULL)
+        return info->name;
+    if (info->body_hash == 0)
+        info->body_hash = hash_lispval(f);
+    snprintf(anonymous_name, 32, "lambda-%016llx", info->body_hash);
+    return anonymous_name;
+}
+
+// Unboxed evaluation
+// The bodies of user-defined functions which only do arithmetic on numbers
+// are translated to a tree of unboxed_expr, which can be evaluated on raw
+// doubles or integers, without allocating a lispval for each intermediate result.
+// Supported: numbers, the function's variables, + - * / > = while they are
+// bound to the builtins, if/ifelse and calls to the function itself, i.e.,
+// to the symbol it was def'd to.
+// Calls are only evaluated this way once type feedback shows that the
+// function has only ever been called with doubles, or only with integers,
+// and only if the tree gives the same answer, of the same type, as the
+// interpreter would. With integers, that means that it has no double
+// literals; with doubles, see unboxed_double_type.
+enum {
+    UNBOXED_NUM,
+    UNBOXED_VARIABLE,
+    UNBOXED_NEGATE,
+    UNBOXED_ADD,
+    UNBOXED_SUBSTRACT,
+    UNBOXED_MULTIPLY,
+    UNBOXED_DIVIDE,
+    UNBOXED_GREATER_THAN,
+    UNBOXED_EQUAL,
+    UNBOXED_IFELSE,
+    UNBOXED_SELF_CALL,
+};
+
+typedef struct unboxed_expr {
+    int op;
+    int type; // UNBOXED_NUM: LISPVAL_NUM or LISPVAL_INT
+    double num; // UNBOXED_NUM, also for integers
+    long long integer; // UNBOXED_NUM, if an integer
+    int index; // UNBOXED_VARIABLE
+    int count;
+    struct unboxed_expr** args;
+} unboxed_expr;
+
+unboxed_expr* new_unboxed_expr(int op, int count)
+{
+    unboxed_expr* e = malloc(sizeof(unboxed_expr));
+    e->op = op;
+    e->type = LISPVAL_NUM;
+    e->num = 0;
+    e->integer = 0;
+    e->index = 0;
+    e->count = count;
+    e->args = count > 0 ? calloc(count, sizeof(unboxed_expr*)) : NULL;
+    return e;
+}
+
+void delete_unboxed_expr(unboxed_expr* e)
+{
+    if (e == NULL)
+        return;
+    for (int i = 0; i < e->count; i++) {
+        delete_unboxed_expr(e->args[i]);
     }
-    if (VERBOSE)
-        printfln("Non ignorable children: %i", c);
+    free(e->args);
+    free(e);
+}
 
-    if (strstr(t->tag, "number")) {
-        return read_lispval_num(t);
-    } else if (strstr(t->tag, "symbol")) {
-        return lispval_sym(t->contents);
-    } else if ((strcmp(t->tag, ">") == 0) && (c == 1)) {
-        return read_lispval(t->children[c_index]);
-    } else if ((strcmp(t->tag, ">") == 0) || strstr(t->tag, "sexpr") || strstr(t->tag, "qexpr")) {
-        lispval* x;
-        if ((strcmp(t->tag, ">") == 0) || strstr(t->tag, "sexpr")) {
-            x = lispval_sexpr();
-        } else if (strstr(t->tag, "qexpr")) {
-            x = lispval_qexpr();
-        } else {
-            return lispval_err("Error: Unreachable code state reached.");
-        }
+int unboxed_variable_index(lispval* variables, char* sym)
+{
+    for (int i = 0; i < variables->count; i++) {
+        if (strcmp(variables->cell[i]->sym, sym) == 0)
+            return i;
+    }
+    return -1;
+}
 
-        for (int i = 0; i < (t->children_num); i++) {
-            if (strcmp(t->children[i]->contents, "(") == 0) {
-                continue;
-            } else if (strcmp(t->children[i]->contents, ")") == 0) {
-                continue;
-            } else if (strcmp(t->children[i]->contents, "{") == 0) {
-                continue;
-            } else if (strcmp(t->children[i]->contents, "}") == 0) {
-                continue;
-            } else if (strcmp(t->children[i]->tag, "regex") == 0) {
-                continue;
-            } else {
-                x = lispval_append_child(x, read_lispval(t->children[i]));
+unboxed_expr* compile_unboxed_expr(lispval* e, char* name, lispval* variables);
+
+unboxed_expr* compile_unboxed_branch(lispval* e, char* name, lispval* variables)
+{
+    // As in evaluate_branch, q-expressions are code to be run.
+    if (e->type != LISPVAL_QEXPR)
+        return compile_unboxed_expr(e, name, variables);
+    e->type = LISPVAL_SEXPR;
+    unboxed_expr* answer = compile_unboxed_expr(e, name, variables);
+    e->type = LISPVAL_QEXPR;
+    return answer;
+}
+
+unboxed_expr* compile_unboxed_expr(lispval* e, char* name, lispval* variables)
+{
+    // Returns NULL if e isn't purely numeric
+    if (e->type == LISPVAL_NUM || e->type == LISPVAL_INT) {
+        unboxed_expr* answer = new_unboxed_expr(UNBOXED_NUM, 0);
+        answer->type = e->type;
+        answer->num = lispval_to_double(e);
+        answer->integer = e->type == LISPVAL_INT ? e->integer : 0;
+        return answer;
+    }
+    if (e->type == LISPVAL_SYM) {
+        int i = unboxed_variable_index(variables, e->sym);
+        if (i < 0)
+            return NULL;
+        unboxed_expr* answer = new_unboxed_expr(UNBOXED_VARIABLE, 0);
+        answer->index = i;
+        return answer;
+    }
+    // (op a b ...). Single-element s-expressions evaluate to themselves, not to numbers.
+    if (e->type != LISPVAL_SEXPR || e->count < 2 || e->cell[0]->type != LISPVAL_SYM || unboxed_variable_index(variables, e->cell[0]->sym) >= 0)
+        return NULL;
+
+    char* op = e->cell[0]->sym;
+    int math_op = strcmp(op, "+") == 0 ? UNBOXED_ADD
+        : strcmp(op, "-") == 0          ? UNBOXED_SUBSTRACT
+        : strcmp(op, "*") == 0          ? UNBOXED_MULTIPLY
+        : strcmp(op, "/") == 0          ? UNBOXED_DIVIDE
+                                        : -1;
+    int comparison = strcmp(op, ">") == 0 ? UNBOXED_GREATER_THAN
+        : strcmp(op, "=") == 0            ? UNBOXED_EQUAL
+                                          : -1;
+    unboxed_expr* answer = NULL;
+    if (math_op == UNBOXED_SUBSTRACT && e->count == 2) {
+        answer = new_unboxed_expr(UNBOXED_NEGATE, 1);
+        answer->args[0] = compile_unboxed_expr(e->cell[1], name, variables);
+    } else if (math_op >= 0 && e->count > 2) {
+        // (+ a b c) => (+ (+ a b) c), the same order as in builtin_math_ops
+        answer = compile_unboxed_expr(e->cell[1], name, variables);
+        for (int i = 2; i < e->count && answer != NULL; i++) {
+            unboxed_expr* left = answer;
+            answer = new_unboxed_expr(math_op, 2);
+            answer->args[0] = left;
+            answer->args[1] = compile_unboxed_expr(e->cell[i], name, variables);
+            if (answer->args[1] == NULL) {
+                delete_unboxed_expr(answer);
+                return NULL;
             }
         }
-        return x;
+        return answer;
+    } else if (comparison >= 0 && e->count == 3) {
+        answer = new_unboxed_expr(comparison, 2);
+        answer->args[0] = compile_unboxed_expr(e->cell[1], name, variables);
+        answer->args[1] = compile_unboxed_expr(e->cell[2], name, variables);
+    } else if ((strcmp(op, "if") == 0 || strcmp(op, "ifelse") == 0) && e->count == 4) {
+        answer = new_unboxed_expr(UNBOXED_IFELSE, 3);
+        answer->args[0] = compile_unboxed_expr(e->cell[1], name, variables);
+        answer->args[1] = compile_unboxed_branch(e->cell[2], name, variables);
+        answer->args[2] = compile_unboxed_branch(e->cell[3], name, variables);
+    } else if (name != NULL && strcmp(op, name) == 0 && e->count - 1 == variables->count) {
+        answer = new_unboxed_expr(UNBOXED_SELF_CALL, e->count - 1);
+        for (int i = 1; i < e->count; i++) {
+            answer->args[i - 1] = compile_unboxed_expr(e->cell[i], name, variables);
+        }
     } else {
-        lispval* err = lispval_err("Unknown AST type.");
-        return err;
+        return NULL;
+    }
+    for (int i = 0; i < answer->count; i++) {
+        if (answer->args[i] == NULL) {
+            delete_unboxed_expr(answer);
+            return NULL;
+        }
     }
+    return answer;
 }
 
-// Print
-void print_env(lispenv* env)
+int unboxed_expr_is_integral(unboxed_expr* e)
 {
-    printfln("Environment: ");
-    for (int i = 0; i < env->count; i++) {
-        printfln("Value for symbol %s: ", env->syms[i]);
-        print_lispval_tree(env->vals[i], 2);
+    // With integer variables, every node is then an integer, as in the interpreter
+    if (e->op == UNBOXED_NUM)
+        return e->type == LISPVAL_INT;
+    for (int i = 0; i < e->count; i++) {
+        if (!unboxed_expr_is_integral(e->args[i]))
+            return 0;
     }
+    return 1;
 }
-void print_lispval_tree(lispval* v, int indent_level)
+
+int unboxed_double_type(unboxed_expr* e)
 {
-    char* indent = malloc(sizeof(char) * (indent_level + 1));
-    for (int i = 0; i < indent_level; i++) {
-        indent[i] = ' ';
+    // The type the interpreter gives e when the variables are doubles, or -1
+    // if evaluating it on doubles could give a different answer. Arithmetic
+    // on integers only, e.g., on literals, is left to the interpreter.
+    // Calls to the function itself are taken to give doubles, which
+    // get_unboxed_body checks.
+    int types[3] = { 0, 0, 0 };
+    for (int i = 0; i < e->count && i < 3; i++) {
+        types[i] = unboxed_double_type(e->args[i]);
+        if (types[i] < 0)
+            return -1;
     }
-    indent[indent_level] = '\0';
+    switch (e->op) {
+    case UNBOXED_NUM:
+        return e->type;
+    case UNBOXED_VARIABLE:
+        return LISPVAL_NUM;
+    case UNBOXED_NEGATE:
+        return types[0] == LISPVAL_NUM ? LISPVAL_NUM : -1;
+    case UNBOXED_ADD:
+    case UNBOXED_SUBSTRACT:
+    case UNBOXED_MULTIPLY:
+    case UNBOXED_DIVIDE:
+        return types[0] == LISPVAL_NUM || types[1] == LISPVAL_NUM ? LISPVAL_NUM : -1;
+    case UNBOXED_GREATER_THAN:
+    case UNBOXED_EQUAL:
+        return LISPVAL_INT;
+    case UNBOXED_IFELSE:
+        return types[1] == types[2] ? types[1] : -1;
+    case UNBOXED_SELF_CALL:
+        for (int i = 0; i < e->count; i++) {
+            if (unboxed_double_type(e->args[i]) != LISPVAL_NUM)
+                return -1;
+        }
+        return LISPVAL_NUM;
+    default:
+        return -1;
+    }
+}
 
-    switch (v->type) {
-    case LISPVAL_NUM:
-        printfln("%sNumber: %f", indent, v->num);
-        break;
-    case LISPVAL_ERR:
-        printfln("%s%s", indent, v->err);
-        break;
-    case LISPVAL_SYM:
-        printfln("%sSymbol: %s", indent, v->sym);
-        break;
-    case LISPVAL_BUILTIN_FUNC:
-        printfln("%sFunction, name: %s, pointer: %p", indent, v->builtin_func_name, v->builtin_func);
-        break;
-    case LISPVAL_USER_FUNC:
-        printfln("%sUser-defined function: %p", indent, v->env); // Identify it with its environment?
-        print_lispval_tree(v->variables, indent_level + 2);
-        print_lispval_tree(v->manipulation, indent_level + 2);
-        break;
-    case LISPVAL_SEXPR:
-        printfln("%sSExpr, with %d children:", indent, v->count);
-        for (int i = 0; i < v->count; i++) {
-            print_lispval_tree(v->cell[i], indent_level + 2);
+int unboxed_expr_has_self_calls(unboxed_expr* e)
+{
+    if (e == NULL)
+        return 0;
+    if (e->op == UNBOXED_SELF_CALL)
+        return 1;
+    for (int i = 0; i < e->count; i++) {
+        if (unboxed_expr_has_self_calls(e->args[i]))
+            return 1;
+    }
+    return 0;
+}
+
+int unboxed_expr_operators(unboxed_expr* e)
+{
+    // The operators e calls by name, as a bitmask of 1 << UNBOXED_*
+    if (e == NULL)
+        return 0;
+    int operators = e->op >= UNBOXED_NEGATE && e->op <= UNBOXED_EQUAL ? 1 << e->op : 0;
+    for (int i = 0; i < e->count; i++) {
+        operators |= unboxed_expr_operators(e->args[i]);
+    }
+    return operators;
+}
+
+unboxed_expr* get_unboxed_body(lispval* f)
+{
+    // Compiled on first use; NULL if the function isn't purely numeric.
+    lispfunc_info* info = f->func_info;
+    if (!info->unboxed_tried) {
+        info->unboxed_tried = 1;
+        if (f->variables->count > 0) {
+            info->unboxed = compile_unboxed_branch(f->manipulation, info->name, f->variables);
         }
-        break;
-    case LISPVAL_QEXPR:
-        printfln("%sQExpr, with %d children:", indent, v->count);
-        for (int i = 0; i < v->count; i++) {
-            print_lispval_tree(v->cell[i], indent_level + 2);
+        info->unboxed_self_calls = unboxed_expr_has_self_calls(info->unboxed);
+        info->unboxed_operators = unboxed_expr_operators(info->unboxed);
+        if (info->unboxed != NULL && unboxed_expr_is_integral(info->unboxed))
+            info->unboxed_types |= 1 << LISPVAL_INT;
+        if (info->unboxed != NULL && unboxed_double_type(info->unboxed) == LISPVAL_NUM)
+            info->unboxed_types |= 1 << LISPVAL_NUM;
+    }
+    return info->unboxed;
+}
+
+// The symbol and builtin each operator is compiled from
+char* unboxed_operator_symbols[] = {
+    [UNBOXED_NEGATE] = "-",
+    [UNBOXED_ADD] = "+",
+    [UNBOXED_SUBSTRACT] = "-",
+    [UNBOXED_MULTIPLY] = "*",
+    [UNBOXED_DIVIDE] = "/",
+    [UNBOXED_GREATER_THAN] = ">",
+    [UNBOXED_EQUAL] = "=",
+};
+lispbuiltin unboxed_operator_builtins[] = {
+    [UNBOXED_NEGATE] = builtin_substract,
+    [UNBOXED_ADD] = builtin_add,
+    [UNBOXED_SUBSTRACT] = builtin_substract,
+    [UNBOXED_MULTIPLY] = builtin_multiply,
+    [UNBOXED_DIVIDE] = builtin_divide,
+    [UNBOXED_GREATER_THAN] = builtin_greater_than,
+    [UNBOXED_EQUAL] = builtin_equal,
+};
+
+int unboxed_self_calls_resolve(lispval* f, lispenv* env)
+{
+    // Calls to the symbol f was def'd to are compiled as direct recursion,
+    // which is only right while that symbol, looked up from where f is
+    // called, is still f, e.g., not after def {g} f and then def {f} ...
+    // Looking it up from inside f would find the same, since f's variables
+    // can't shadow it.
+    lispfunc_info* info = f->func_info;
+    if (!info->unboxed_self_calls)
+        return 1;
+    lispval* bound = lookup_in_lispenv(info->name, env);
+    return bound != NULL && bound->type == LISPVAL_USER_FUNC && bound->func_info == info;
+}
+
+int unboxed_operators_resolve(lispval* f, lispenv* env)
+{
+    // Likewise, the operators are compiled as the builtins, which is only
+    // right while their symbols are still bound to them, e.g., not after
+    // def {+} -
+    lispfunc_info* info = f->func_info;
+    for (int op = UNBOXED_NEGATE; op <= UNBOXED_EQUAL; op++) {
+        if (!(info->unboxed_operators & (1 << op)))
+            continue;
+        lispval* bound = lookup_in_lispenv(unboxed_operator_symbols[op], env);
+        if (bound == NULL || bound->type != LISPVAL_BUILTIN_FUNC || bound->builtin_func != unboxed_operator_builtins[op])
+            return 0;
+    }
+    return 1;
+}
+
+#define UNBOXED_DEOPTIMIZE 2 // bailout, and don't evaluate the function on integers again
+
+double evaluate_unboxed_expr(unboxed_expr* e, double* frame, unboxed_expr* body, int* bailout)
+{
+    // Division by zero, which is an error in the interpreter, sets *bailout;
+    // the call is then redone by the interpreter.
+    if (*bailout)
+        return 0;
+    switch (e->op) {
+    case UNBOXED_NUM:
+        return e->num;
+    case UNBOXED_VARIABLE:
+        return frame[e->index];
+    case UNBOXED_NEGATE:
+        return -evaluate_unboxed_expr(e->args[0], frame, body, bailout);
+    case UNBOXED_ADD:
+        return evaluate_unboxed_expr(e->args[0], frame, body, bailout) + evaluate_unboxed_expr(e->args[1], frame, body, bailout);
+    case UNBOXED_SUBSTRACT:
+        return evaluate_unboxed_expr(e->args[0], frame, body, bailout) - evaluate_unboxed_expr(e->args[1], frame, body, bailout);
+    case UNBOXED_MULTIPLY:
+        return evaluate_unboxed_expr(e->args[0], frame, body, bailout) * evaluate_unboxed_expr(e->args[1], frame, body, bailout);
+    case UNBOXED_DIVIDE: {
+        double x = evaluate_unboxed_expr(e->args[0], frame, body, bailout);
+        double y = evaluate_unboxed_expr(e->args[1], frame, body, bailout);
+        if (y == 0) {
+            *bailout = 1;
+            return 0;
         }
-        break;
+        return x / y;
+    }
+    case UNBOXED_GREATER_THAN:
+        return evaluate_unboxed_expr(e->args[0], frame, body, bailout) > evaluate_unboxed_expr(e->args[1], frame, body, bailout);
+    case UNBOXED_EQUAL:
+        return evaluate_unboxed_expr(e->args[0], frame, body, bailout) == evaluate_unboxed_expr(e->args[1], frame, body, bailout);
+    case UNBOXED_IFELSE:
+        if (evaluate_unboxed_expr(e->args[0], frame, body, bailout) != 0)
+            return evaluate_unboxed_expr(e->args[1], frame, body, bailout);
+        return evaluate_unboxed_expr(e->args[2], frame, body, bailout);
+    case UNBOXED_SELF_CALL: {
+        if ((--EVAL_POLL_COUNTDOWN <= 0 && evaluation_should_stop()) || evaluation_stack_exhausted()) {
+            *bailout = 1;
+            return 0;
+        }
+        double new_frame[e->count];
+        for (int i = 0; i < e->count; i++) {
+            new_frame[i] = evaluate_unboxed_expr(e->args[i], frame, body, bailout);
+        }
+        return evaluate_unboxed_expr(body, new_frame, body, bailout);
+    }
     default:
-        if (VERBOSE)
-            printfln("Error: unknown lispval type\n");
-        // printfln("%s", v->sym);
+        *bailout = 1;
+        return 0;
     }
-    if (VERBOSE > 1)
-        printfln("Freeing indent");
-    if (indent != NULL)
-        free(indent);
-    indent = NULL;
-    if (VERBOSE > 1)
-        printfln("Freed indent");
 }
 
-void print_lispval_parenthesis(lispval* v)
+long long evaluate_unboxed_integer_expr(unboxed_expr* e, long long* frame, unboxed_expr* body, int* bailout)
+{
+    // As evaluate_unboxed_expr. Overflows and inexact divisions, which give
+    // doubles in the interpreter, set *bailout to UNBOXED_DEOPTIMIZE.
+    if (*bailout)
+        return 0;
+    long long x, y, result;
+    switch (e->op) {
+    case UNBOXED_NUM:
+        return e->integer;
+    case UNBOXED_VARIABLE:
+        return frame[e->index];
+    case UNBOXED_NEGATE:
+        x = evaluate_unboxed_integer_expr(e->args[0], frame, body, bailout);
+        if (x == LLONG_MIN) {
+            *bailout = UNBOXED_DEOPTIMIZE;
+            return 0;
+        }
+        return -x;
+    case UNBOXED_ADD:
+    case UNBOXED_SUBSTRACT:
+    case UNBOXED_MULTIPLY:
+    case UNBOXED_DIVIDE:
+        x = evaluate_unboxed_integer_expr(e->args[0], frame, body, bailout);
+        y = evaluate_unboxed_integer_expr(e->args[1], frame, body, bailout);
+        if (*bailout)
+            return 0;
+        if (e->op == UNBOXED_DIVIDE) {
+            if (y == 0) {
+                *bailout = 1;
+                return 0;
+            }
+            if ((x == LLONG_MIN && y == -1) || x % y != 0) {
+                *bailout = UNBOXED_DEOPTIMIZE;
+                return 0;
+            }
+            return x / y;
+        }
+        if (e->op == UNBOXED_ADD ? add_overflows(x, y, &result)
+                : e->op == UNBOXED_SUBSTRACT ? substract_overflows(x, y, &result)
+                                             : multiply_overflows(x, y, &result)) {
+            *bailout = UNBOXED_DEOPTIMIZE;
+            return 0;
+        }
+        return result;
+    case UNBOXED_GREATER_THAN:
+        x = evaluate_unboxed_integer_expr(e->args[0], frame, body, bailout);
+        return x > evaluate_unboxed_integer_expr(e->args[1], frame, body, bailout);
+    case UNBOXED_EQUAL:
+        x = evaluate_unboxed_integer_expr(e->args[0], frame, body, bailout);
+        return x == evaluate_unboxed_integer_expr(e->args[1], frame, body, bailout);
+    case UNBOXED_IFELSE:
+        if (evaluate_unboxed_integer_expr(e->args[0], frame, body, bailout) != 0)
+            return evaluate_unboxed_integer_expr(e->args[1], frame, body, bailout);
+        return evaluate_unboxed_integer_expr(e->args[2], frame, body, bailout);
+    case UNBOXED_SELF_CALL: {
+        if ((--EVAL_POLL_COUNTDOWN <= 0 && evaluation_should_stop()) || evaluation_stack_exhausted()) {
+            *bailout = 1;
+            return 0;
+        }
+        long long new_frame[e->count];
+        for (int i = 0; i < e->count; i++) {
+            new_frame[i] = evaluate_unboxed_integer_expr(e->args[i], frame, body, bailout);
+        }
+        return evaluate_unboxed_integer_expr(body, new_frame, body, bailout);
+    }
+    default:
+        *bailout = 1;
+        return 0;
+    }
+}
+
+// Type feedback
+#define FEEDBACK_WARMUP_CALLS 2
+lispval* unboxed_call_lispfunc_readonly(lispval* l, lispenv* env)
+{
+    // In pmap's threads, f's lispfunc_info is shared, so it is only read:
+    // the call is evaluated unboxed if the main thread already compiled the
+    // body for the types of these arguments, and no feedback is recorded.
+    lispfunc_info* info = l->cell[0]->func_info;
+    int n = l->count - 1;
+    if (!info->unboxed_tried || info->unboxed == NULL || n == 0 || !unboxed_self_calls_resolve(l->cell[0], env) || !unboxed_operators_resolve(l->cell[0], env))
+        return NULL;
+    int type = l->cell[1]->type;
+    if ((type != LISPVAL_NUM && type != LISPVAL_INT) || !(info->unboxed_types & (1 << type)))
+        return NULL;
+    for (int i = 1; i < n; i++) {
+        if (l->cell[i + 1]->type != type)
+            return NULL;
+    }
+    int bailout = 0;
+    if (type == LISPVAL_INT) {
+        long long frame[n];
+        for (int i = 0; i < n; i++) {
+            frame[i] = l->cell[i + 1]->integer;
+        }
+        long long result = evaluate_unboxed_integer_expr(info->unboxed, frame, info->unboxed, &bailout);
+        return bailout ? NULL : lispval_int(result);
+    }
+    double frame[n];
+    for (int i = 0; i < n; i++) {
+        frame[i] = l->cell[i + 1]->num;
+    }
+    double result = evaluate_unboxed_expr(info->unboxed, frame, info->unboxed, &bailout);
+    return bailout ? NULL : lispval_num(result);
+}
+
+lispval* unboxed_call_lispfunc(lispval* l, lispenv* env)
+{
+    // l is (f arg1 arg2 ...), called from env. Records the types f is called with, and once
+    // f has only ever seen doubles, or only integers, evaluates it unboxed.
+    // Returns NULL if the interpreter should handle the call.
+    lispval* f = l->cell[0];
+    lispfunc_info* info = f->func_info;
+    int n = l->count - 1;
+    if (PARALLEL_WORKER)
+        return unboxed_call_lispfunc_readonly(l, env);
+    int seen_types = info->seen_types;
+    for (int i = 0; i < n; i++) {
+        info->seen_types |= 1 << l->cell[i + 1]->type;
+    }
+    info->calls++;
+    if (info->seen_types != (1 << LISPVAL_NUM) && info->seen_types != (1 << LISPVAL_INT)) {
+        if (VERBOSE && seen_types != info->seen_types && info->unboxed != NULL)
+            printfln("Deoptimizing %s: called with mixed types or non-numbers", info->name ? info->name : "(anonymous)");
+        return NULL;
+    }
+    if (info->calls < FEEDBACK_WARMUP_CALLS)
+        return NULL;
+    unboxed_expr* body = get_unboxed_body(f);
+    if (body == NULL || !(info->unboxed_types & info->seen_types))
+        return NULL;
+    if (!unboxed_self_calls_resolve(f, env) || !unboxed_operators_resolve(f, env))
+        return NULL;
+
+    int bailout = 0;
+    if (info->seen_types == (1 << LISPVAL_INT)) {
+        long long frame[n];
+        for (int i = 0; i < n; i++) {
+            frame[i] = l->cell[i + 1]->integer;
+        }
+        long long result = evaluate_unboxed_integer_expr(body, frame, body, &bailout);
+        if (bailout == UNBOXED_DEOPTIMIZE) {
+            if (VERBOSE)
+                printfln("Deoptimizing %s: its result doesn't always fit in 64 bits", info->name ? info->name : "(anonymous)");
+            info->unboxed_types &= ~(1 << LISPVAL_INT);
+        }
+        return bailout ? NULL : lispval_int(result);
+    }
+    double frame[n];
+    for (int i = 0; i < n; i++) {
+        frame[i] = l->cell[i + 1]->num;
+    }
+    double result = evaluate_unboxed_expr(body, frame, body, &bailout);
+    if (bailout)
+        return NULL;
+    return lispval_num(result);
+}
+
+// Just-in-time compilation
+// User-defined functions which only do arithmetic on numbers, e.g.,
+// def {fibonacci} (@ {x} {if (> x 1) { + (fibonacci (- x 2)) ( fibonacci ( - x 1 ) ) } 1} )
+// can be compiled to x86-64 machine code. Enable with JIT=1 in the repl.
+// The code is generated from the unboxed_expr tree of the body, so the same
+// subset is supported. Anything else falls back to the interpreter.
+//
+// The generated function has the C signature double f(double* frame),
+// where the i-th of n variables is at frame[2 * (n - 1 - i)]. This is the
+// layout that pushing the arguments onto the stack in 16 byte slots leaves,
+// so that calls to itself can just pass the stack pointer.
+// Functions called with integers get a second version,
+// long long f(long long* frame), with the same layout.
+// Division by zero, which is an error in the interpreter, sets JIT_BAILOUT
+// and returns; the call is then redone by the interpreter. Integer overflows
+// and inexact divisions set it to UNBOXED_DEOPTIMIZE instead.
+// The code embeds the addresses of the main thread's JIT_BAILOUT and
+// evaluation limits, so pmap's threads never run it.
+int JIT = 0;
+char JIT_BAILOUT = 0;
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#include <sys/mman.h>
+#include <unistd.h>
+
+typedef struct jit_buffer {
+    unsigned char* code;
+    int size;
+    int capacity;
+    int failed;
+    int variables_count;
+    int bailout_jumps[256]; // positions of rel32s to be pointed at the bailout code
+    int bailout_jumps_count;
+    int exit_jumps[256]; // positions of rel32s to be pointed at the epilogue
+    int exit_jumps_count;
+    int deoptimize_jumps[256]; // positions of rel32s to be pointed at the deoptimization code
+    int deoptimize_jumps_count;
+} jit_buffer;
+
+void jit_emit(jit_buffer* b, char* bytes, int n)
+{
+    if (b->size + n > b->capacity) {
+        b->capacity = 2 * (b->size + n);
+        b->code = realloc(b->code, b->capacity);
+    }
+    memcpy(b->code + b->size, bytes, n);
+    b->size += n;
+}
+
+void jit_emit_u32(jit_buffer* b, unsigned int x)
+{
+    jit_emit(b, (char*)&x, 4);
+}
+
+void jit_emit_u64(jit_buffer* b, unsigned long long x)
+{
+    jit_emit(b, (char*)&x, 8);
+}
+
+void jit_patch_rel32(jit_buffer* b, int at, int target)
+{
+    int rel = target - (at + 4);
+    memcpy(b->code + at, &rel, 4);
+}
+
+int jit_emit_jump_rel32(jit_buffer* b, char* opcode, int n)
+{
+    // Returns the position of the rel32, to be patched later
+    jit_emit(b, opcode, n);
+    int at = b->size;
+    jit_emit_u32(b, 0);
+    return at;
+}
+
+void jit_emit_jump_to_bailout(jit_buffer* b, char* opcode, int n)
+{
+    if (b->bailout_jumps_count == 256) {
+        b->failed = 1;
+        return;
+    }
+    b->bailout_jumps[b->bailout_jumps_count++] = jit_emit_jump_rel32(b, opcode, n);
+}
+
+void jit_emit_jump_to_exit(jit_buffer* b, char* opcode, int n)
+{
+    if (b->exit_jumps_count == 256) {
+        b->failed = 1;
+        return;
+    }
+    b->exit_jumps[b->exit_jumps_count++] = jit_emit_jump_rel32(b, opcode, n);
+}
+
+void jit_emit_jump_to_deoptimize(jit_buffer* b, char* opcode, int n)
 {
-    switch (v->type) {
-    case LISPVAL_NUM:
-        printf("%f ", v->num);
-        break;
-    case LISPVAL_ERR:
-        printf("%s ", v->err);
+    if (b->deoptimize_jumps_count == 256) {
+        b->failed = 1;
+        return;
+    }
+    b->deoptimize_jumps[b->deoptimize_jumps_count++] = jit_emit_jump_rel32(b, opcode, n);
+}
+
+void jit_emit_push_xmm0(jit_buffer* b)
+{
+    jit_emit(b, "\x48\x83\xec\x10", 4); // sub rsp, 16
+    jit_emit(b, "\xf2\x0f\x11\x04\x24", 5); // movsd [rsp], xmm0
+}
+
+void jit_emit_pop_left_operand(jit_buffer* b)
+{
+    // right operand in xmm0 => left operand in xmm0, right operand in xmm1
+    jit_emit(b, "\x66\x0f\x28\xc8", 4); // movapd xmm1, xmm0
+    jit_emit(b, "\xf2\x0f\x10\x04\x24", 5); // movsd xmm0, [rsp]
+    jit_emit(b, "\x48\x83\xc4\x10", 4); // add rsp, 16
+}
+
+void jit_emit_load_constant(jit_buffer* b, double x)
+{
+    unsigned long long bits;
+    memcpy(&bits, &x, 8);
+    jit_emit(b, "\x48\xb8", 2); // mov rax, imm64
+    jit_emit_u64(b, bits);
+    jit_emit(b, "\x66\x48\x0f\x6e\xc0", 5); // movq xmm0, rax
+}
+
+void jit_compile_expression(jit_buffer* b, unboxed_expr* e)
+{
+    // Leaves the value of e in xmm0
+    switch (e->op) {
+    case UNBOXED_NUM:
+        jit_emit_load_constant(b, e->num);
         break;
-    case LISPVAL_SYM:
-        printf("%s ", v->sym);
+    case UNBOXED_VARIABLE:
+        jit_emit(b, "\xf2\x0f\x10\x83", 4); // movsd xmm0, [rbx + disp32]
+        jit_emit_u32(b, 16 * (b->variables_count - 1 - e->index));
         break;
-    case LISPVAL_BUILTIN_FUNC:
-        printf("<function, name: %s, pointer: %p> ", v->builtin_func_name, v->builtin_func);
+    case UNBOXED_NEGATE:
+        jit_compile_expression(b, e->args[0]);
+        jit_emit(b, "\x48\xb8", 2); // mov rax, sign bit
+        jit_emit_u64(b, 0x8000000000000000ULL);
+        jit_emit(b, "\x66\x48\x0f\x6e\xc8", 5); // movq xmm1, rax
+        jit_emit(b, "\x66\x0f\x57\xc1", 4); // xorpd xmm0, xmm1
         break;
-    case LISPVAL_USER_FUNC:
-        printf("<user-defined function, pointer: %p> ", v->env);
+    case UNBOXED_ADD:
+    case UNBOXED_SUBSTRACT:
+    case UNBOXED_MULTIPLY:
+    case UNBOXED_DIVIDE:
+        jit_compile_expression(b, e->args[0]);
+        jit_emit_push_xmm0(b);
+        jit_compile_expression(b, e->args[1]);
+        jit_emit_pop_left_operand(b);
+        if (e->op == UNBOXED_ADD) {
+            jit_emit(b, "\xf2\x0f\x58\xc1", 4); // addsd xmm0, xmm1
+        } else if (e->op == UNBOXED_SUBSTRACT) {
+            jit_emit(b, "\xf2\x0f\x5c\xc1", 4); // subsd xmm0, xmm1
+        } else if (e->op == UNBOXED_MULTIPLY) {
+            jit_emit(b, "\xf2\x0f\x59\xc1", 4); // mulsd xmm0, xmm1
+        } else {
+            jit_emit(b, "\x66\x0f\x57\xd2", 4); // xorpd xmm2, xmm2
+            jit_emit(b, "\x66\x0f\x2e\xca", 4); // ucomisd xmm1, xmm2
+            jit_emit(b, "\x7a\x06", 2); // jp over the je (NaN isn't 0)
+            jit_emit_jump_to_bailout(b, "\x0f\x84", 2); // je bailout
+            jit_emit(b, "\xf2\x0f\x5e\xc1", 4); // divsd xmm0, xmm1
+        }
         break;
-    case LISPVAL_SEXPR:
-        printf("( ");
-        for (int i = 0; i < v->count; i++) {
-            print_lispval_parenthesis(v->cell[i]);
+    case UNBOXED_GREATER_THAN:
+    case UNBOXED_EQUAL:
+        jit_compile_expression(b, e->args[0]);
+        jit_emit_push_xmm0(b);
+        jit_compile_expression(b, e->args[1]);
+        jit_emit_pop_left_operand(b);
+        jit_emit(b, "\x66\x0f\x2e\xc1", 4); // ucomisd xmm0, xmm1
+        if (e->op == UNBOXED_GREATER_THAN) {
+            jit_emit(b, "\x0f\x97\xc0", 3); // seta al
+        } else {
+            jit_emit(b, "\x0f\x94\xc0", 3); // sete al
+            jit_emit(b, "\x0f\x9b\xc1", 3); // setnp cl
+            jit_emit(b, "\x20\xc8", 2); // and al, cl
         }
-        printf(") ");
+        jit_emit(b, "\x0f\xb6\xc0", 3); // movzx eax, al
+        jit_emit(b, "\xf2\x0f\x2a\xc0", 4); // cvtsi2sd xmm0, eax
         break;
-    case LISPVAL_QEXPR:
-        printf("{ ");
-        for (int i = 0; i < v->count; i++) {
-            print_lispval_parenthesis(v->cell[i]);
+    case UNBOXED_IFELSE: {
+        jit_compile_expression(b, e->args[0]);
+        jit_emit(b, "\x66\x0f\x57\xc9", 4); // xorpd xmm1, xmm1
+        jit_emit(b, "\x66\x0f\x2e\xc1", 4); // ucomisd xmm0, xmm1
+        int to_result = jit_emit_jump_rel32(b, "\x0f\x8a", 2); // jp result (NaN is truthy)
+        int to_alternative = jit_emit_jump_rel32(b, "\x0f\x84", 2); // je alternative
+        jit_patch_rel32(b, to_result, b->size);
+        jit_compile_expression(b, e->args[1]);
+        int to_end = jit_emit_jump_rel32(b, "\xe9", 1); // jmp end
+        jit_patch_rel32(b, to_alternative, b->size);
+        jit_compile_expression(b, e->args[2]);
+        jit_patch_rel32(b, to_end, b->size);
+        break;
+    }
+    case UNBOXED_SELF_CALL: {
+        for (int i = 0; i < e->count; i++) {
+            jit_compile_expression(b, e->args[i]);
+            jit_emit_push_xmm0(b);
         }
-        printf("} ");
+        jit_emit(b, "\x48\x89\xe7", 3); // mov rdi, rsp
+        int to_self = jit_emit_jump_rel32(b, "\xe8", 1); // call self
+        jit_patch_rel32(b, to_self, 0);
+        jit_emit(b, "\x48\x81\xc4", 3); // add rsp, imm32
+        jit_emit_u32(b, 16 * e->count);
+        jit_emit(b, "\x48\xb8", 2); // mov rax, &JIT_BAILOUT
+        jit_emit_u64(b, (unsigned long long)&JIT_BAILOUT);
+        jit_emit(b, "\x80\x38\x00", 3); // cmp byte [rax], 0
+        jit_emit_jump_to_exit(b, "\x0f\x85", 2); // jne exit
         break;
+    }
     default:
-        if (VERBOSE)
-            printfln("Error: unknown lispval type\n");
-        // printfln("%s", v->sym);
+        b->failed = 1;
     }
 }
 
-void print_ast(mpc_ast_t* ast, int indent_level)
+void jit_emit_push_rax(jit_buffer* b)
 {
-    char* indent = malloc(sizeof(char) * (indent_level + 1)); // "";
-    for (int i = 0; i < indent_level; i++) {
-        indent[i] = ' ';
-    }
-    indent[indent_level] = '\0';
-    printfln("%sTag: %s", indent, ast->tag);
-    printfln("%sContents: %s", indent,
-        strcmp(ast->contents, "") ? ast->contents : "None");
-    printfln("%sNumber of children: %i", indent, ast->children_num);
-    /* Print the children */
-    for (int i = 0; i < ast->children_num; i++) {
-        mpc_ast_t* child_i = ast->children[i];
-        printfln("%sChild #%d", indent, i);
-        print_ast(child_i, indent_level + 2);
-    }
-    free(indent);
-    indent = NULL;
+    jit_emit(b, "\x48\x83\xec\x10", 4); // sub rsp, 16
+    jit_emit(b, "\x48\x89\x04\x24", 4); // mov [rsp], rax
 }
 
-// Cloners
-lispval* clone_lispval(lispval* old)
+void jit_emit_pop_left_integer_operand(jit_buffer* b)
 {
-    lispval* new;
-    switch (old->type) {
-    case LISPVAL_NUM:
-        new = lispval_num(old->num);
-        break;
-    case LISPVAL_ERR:
-        new = lispval_err(old->err);
+    // right operand in rax => left operand in rax, right operand in rcx
+    jit_emit(b, "\x48\x89\xc1", 3); // mov rcx, rax
+    jit_emit(b, "\x48\x8b\x04\x24", 4); // mov rax, [rsp]
+    jit_emit(b, "\x48\x83\xc4\x10", 4); // add rsp, 16
+}
+
+void jit_compile_integer_expression(jit_buffer* b, unboxed_expr* e)
+{
+    // Leaves the value of e in rax. As in evaluate_unboxed_integer_expr,
+    // overflows and inexact divisions deoptimize.
+    switch (e->op) {
+    case UNBOXED_NUM:
+        jit_emit(b, "\x48\xb8", 2); // mov rax, imm64
+        jit_emit_u64(b, (unsigned long long)e->integer);
         break;
-    case LISPVAL_SYM:
-        new = lispval_sym(old->sym);
+    case UNBOXED_VARIABLE:
+        jit_emit(b, "\x48\x8b\x83", 3); // mov rax, [rbx + disp32]
+        jit_emit_u32(b, 16 * (b->variables_count - 1 - e->index));
         break;
-    case LISPVAL_BUILTIN_FUNC:
-        new = lispval_builtin_func(old->builtin_func, old->builtin_func_name);
+    case UNBOXED_NEGATE:
+        jit_compile_integer_expression(b, e->args[0]);
+        jit_emit(b, "\x48\xf7\xd8", 3); // neg rax
+        jit_emit_jump_to_deoptimize(b, "\x0f\x80", 2); // jo deoptimize
         break;
-    case LISPVAL_USER_FUNC:
-        if(VERBOSE) printfln("Cloning function. This generally shouldn't be happening, given that I've decided to just add functions to the environment and just clean them when the environment is cleaned. One situation where it should happen is in def {id} (@ {x} {x}), there is a lambda function in the arguments, which should get collected. ");
-				lispval* variables = clone_lispval(old->variables);
-				lispval* manipulation = clone_lispval(old->manipulation);
-				lispenv* env = clone_lispenv(old->env);
-				new = lispval_lambda_func(variables, manipulation, env);
-        // new = lispval_lambda_func(old->variables, old->manipulation, old->env);
-        // Also, fun to notice how these choices around implementation would determine tricky behaviour details around variable shadowing.
+    case UNBOXED_ADD:
+    case UNBOXED_SUBSTRACT:
+    case UNBOXED_MULTIPLY:
+    case UNBOXED_DIVIDE:
+        jit_compile_integer_expression(b, e->args[0]);
+        jit_emit_push_rax(b);
+        jit_compile_integer_expression(b, e->args[1]);
+        jit_emit_pop_left_integer_operand(b);
+        if (e->op == UNBOXED_ADD) {
+            jit_emit(b, "\x48\x01\xc8", 3); // add rax, rcx
+            jit_emit_jump_to_deoptimize(b, "\x0f\x80", 2); // jo deoptimize
+        } else if (e->op == UNBOXED_SUBSTRACT) {
+            jit_emit(b, "\x48\x29\xc8", 3); // sub rax, rcx
+            jit_emit_jump_to_deoptimize(b, "\x0f\x80", 2); // jo deoptimize
+        } else if (e->op == UNBOXED_MULTIPLY) {
+            jit_emit(b, "\x48\x0f\xaf\xc1", 4); // imul rax, rcx
+            jit_emit_jump_to_deoptimize(b, "\x0f\x80", 2); // jo deoptimize
+        } else {
+            jit_emit(b, "\x48\x85\xc9", 3); // test rcx, rcx
+            jit_emit_jump_to_bailout(b, "\x0f\x84", 2); // je bailout
+            // idiv faults on LLONG_MIN / -1, so divisions by -1 are negations
+            jit_emit(b, "\x48\x83\xf9\xff", 4); // cmp rcx, -1
+            jit_emit(b, "\x75\x0b", 2); // jne over the negation
+            jit_emit(b, "\x48\xf7\xd8", 3); // neg rax
+            jit_emit_jump_to_deoptimize(b, "\x0f\x80", 2); // jo deoptimize
+            jit_emit(b, "\xeb\x0e", 2); // jmp over the division
+            jit_emit(b, "\x48\x99", 2); // cqo
+            jit_emit(b, "\x48\xf7\xf9", 3); // idiv rcx
+            jit_emit(b, "\x48\x85\xd2", 3); // test rdx, rdx
+            jit_emit_jump_to_deoptimize(b, "\x0f\x85", 2); // jnz deoptimize
+        }
         break;
-    case LISPVAL_SEXPR:
-        new = lispval_sexpr();
+    case UNBOXED_GREATER_THAN:
+    case UNBOXED_EQUAL:
+        jit_compile_integer_expression(b, e->args[0]);
+        jit_emit_push_rax(b);
+        jit_compile_integer_expression(b, e->args[1]);
+        jit_emit_pop_left_integer_operand(b);
+        jit_emit(b, "\x48\x39\xc8", 3); // cmp rax, rcx
+        if (e->op == UNBOXED_GREATER_THAN) {
+            jit_emit(b, "\x0f\x9f\xc0", 3); // setg al
+        } else {
+            jit_emit(b, "\x0f\x94\xc0", 3); // sete al
+        }
+        jit_emit(b, "\x48\x0f\xb6\xc0", 4); // movzx rax, al
         break;
-    case LISPVAL_QEXPR:
-        new = lispval_qexpr();
+    case UNBOXED_IFELSE: {
+        jit_compile_integer_expression(b, e->args[0]);
+        jit_emit(b, "\x48\x85\xc0", 3); // test rax, rax
+        int to_alternative = jit_emit_jump_rel32(b, "\x0f\x84", 2); // je alternative
+        jit_compile_integer_expression(b, e->args[1]);
+        int to_end = jit_emit_jump_rel32(b, "\xe9", 1); // jmp end
+        jit_patch_rel32(b, to_alternative, b->size);
+        jit_compile_integer_expression(b, e->args[2]);
+        jit_patch_rel32(b, to_end, b->size);
         break;
-    default:
-        return lispval_err("Error: Cloning element of unknown type.");
     }
-
-    if ((old->type == LISPVAL_QEXPR || old->type == LISPVAL_SEXPR) && (old->count > 0)) {
-        for (int i = 0; i < old->count; i++) {
-            lispval* temp_child = old->cell[i];
-            lispval* child = clone_lispval(temp_child);
-            lispval_append_child(new, child);
+    case UNBOXED_SELF_CALL: {
+        for (int i = 0; i < e->count; i++) {
+            jit_compile_integer_expression(b, e->args[i]);
+            jit_emit_push_rax(b);
         }
+        jit_emit(b, "\x48\x89\xe7", 3); // mov rdi, rsp
+        int to_self = jit_emit_jump_rel32(b, "\xe8", 1); // call self
+        jit_patch_rel32(b, to_self, 0);
+        jit_emit(b, "\x48\x81\xc4", 3); // add rsp, imm32
+        jit_emit_u32(b, 16 * e->count);
+        jit_emit(b, "\x48\xb9", 2); // mov rcx, &JIT_BAILOUT
+        jit_emit_u64(b, (unsigned long long)&JIT_BAILOUT);
+        jit_emit(b, "\x80\x39\x00", 3); // cmp byte [rcx], 0
+        jit_emit_jump_to_exit(b, "\x0f\x85", 2); // jne exit
+        break;
+    }
+    default:
+        b->failed = 1;
     }
-    return new;
-}
-
-// Operations
-// Ops for q-expressions
-lispval* builtin_head(lispval* v, lispenv* e)
-{
-    // printfln("Entering builtin_head with v->count = %d and v->cell[0]->type = %d\n", v->count, v->cell[0]->type);
-    // head { 1 2 3 }
-    // But actually, that gets processd into head ({ 1 2 3 }), hence the v->cell[0]->cell[0];
-    LISPVAL_ASSERT(v->count == 1, "Error: function head passed too many arguments");
-    LISPVAL_ASSERT(v->cell[0]->type == LISPVAL_QEXPR, "Error: Argument passed to head is not a q-expr, i.e., a bracketed list.");
-    LISPVAL_ASSERT(v->cell[0]->count != 0, "Error: Argument passed to head is {}");
-    lispval* result = clone_lispval(v->cell[0]->cell[0]);
-    return result;
-    // Returns something that should be freed later: yes.
-    // Returns something that doesn't share pointers with the input: yes.
 }
 
-lispval* builtin_tail(lispval* v, lispenv* env)
+void* jit_compile_lispfunc(lispval* f, int type, size_t* size)
 {
-    // tail { 1 2 3 }
-    LISPVAL_ASSERT(v->count == 1, "Error: function tail passed too many arguments");
+    // Returns NULL if f can't be compiled for arguments of this type,
+    // LISPVAL_NUM or LISPVAL_INT
+    unboxed_expr* body = get_unboxed_body(f);
+    if (body == NULL || !(f->func_info->unboxed_types & (1 << type)))
+        return NULL;
+    jit_buffer b = { 0 };
+    b.variables_count = f->variables->count;
 
-    lispval* old = v->cell[0];
-    LISPVAL_ASSERT(old->type == LISPVAL_QEXPR, "Error: Argument passed to tail is not a q-expr, i.e., a bracketed list.");
-    LISPVAL_ASSERT(old->count != 0, "Error: Argument passed to tail is {}");
+    jit_emit(&b, "\x55", 1); // push rbp
+    jit_emit(&b, "\x48\x89\xe5", 3); // mov rbp, rsp
+    jit_emit(&b, "\x53", 1); // push rbx
+    jit_emit(&b, "\x48\x83\xec\x08", 4); // sub rsp, 8, to keep the stack 16-byte aligned
+    jit_emit(&b, "\x48\x89\xfb", 3); // mov rbx, rdi
+    // Check the limits on evaluation, as evaluate_lispval does
+    jit_emit(&b, "\x48\xb8", 2); // mov rax, &EVAL_STACK_LIMIT
+    jit_emit_u64(&b, (unsigned long long)&EVAL_STACK_LIMIT);
+    jit_emit(&b, "\x48\x3b\x20", 3); // cmp rsp, [rax]
+    jit_emit_jump_to_bailout(&b, "\x0f\x82", 2); // jb bailout
+    jit_emit(&b, "\x48\xb8", 2); // mov rax, &EVAL_POLL_COUNTDOWN
+    jit_emit_u64(&b, (unsigned long long)&EVAL_POLL_COUNTDOWN);
+    jit_emit(&b, "\xff\x08", 2); // dec dword [rax]
+    jit_emit(&b, "\x7f\x14", 2); // jg over the call
+    jit_emit(&b, "\x48\xb8", 2); // mov rax, evaluation_should_stop
+    jit_emit_u64(&b, (unsigned long long)&evaluation_should_stop);
+    jit_emit(&b, "\xff\xd0", 2); // call rax
+    jit_emit(&b, "\x85\xc0", 2); // test eax, eax
+    jit_emit_jump_to_bailout(&b, "\x0f\x85", 2); // jne bailout
 
-    lispval* new = lispval_qexpr();
-    if (old->count == 1) {
-        return new;
-    } else if (old->count > 1 && old->type == LISPVAL_QEXPR) {
-        for (int i = 1; i < (old->count); i++) {
-            // lispval_append_child(new, clone_lispval(old->cell[i]));
-            lispval_append_child(new, clone_lispval(old->cell[i]));
-        }
-        return new;
+    if (type == LISPVAL_INT) {
+        jit_compile_integer_expression(&b, body);
     } else {
-        delete_lispval(new);
-        return lispval_err("Error: Unreachable point reached in tail function");
+        jit_compile_expression(&b, body);
     }
 
-    // Returns something that should be freed later: yes.
-    // Returns something that doesn't share pointers with the input: yes.
+    int to_exit = jit_emit_jump_rel32(&b, "\xe9", 1); // jmp exit
+    int deoptimize = b.size;
+    jit_emit(&b, "\x48\xb8", 2); // mov rax, &JIT_BAILOUT
+    jit_emit_u64(&b, (unsigned long long)&JIT_BAILOUT);
+    jit_emit(&b, "\xc6\x00\x02", 3); // mov byte [rax], UNBOXED_DEOPTIMIZE
+    int deoptimize_to_exit = jit_emit_jump_rel32(&b, "\xe9", 1); // jmp exit
+    int bailout = b.size;
+    jit_emit(&b, "\x48\xb8", 2); // mov rax, &JIT_BAILOUT
+    jit_emit_u64(&b, (unsigned long long)&JIT_BAILOUT);
+    jit_emit(&b, "\xc6\x00\x01", 3); // mov byte [rax], 1
+    int exit = b.size;
+    jit_emit(&b, "\x48\x8d\x65\xf8", 4); // lea rsp, [rbp - 8]
+    jit_emit(&b, "\x5b", 1); // pop rbx
+    jit_emit(&b, "\x5d", 1); // pop rbp
+    jit_emit(&b, "\xc3", 1); // ret
+
+    jit_patch_rel32(&b, to_exit, exit);
+    jit_patch_rel32(&b, deoptimize_to_exit, exit);
+    for (int i = 0; i < b.deoptimize_jumps_count; i++) {
+        jit_patch_rel32(&b, b.deoptimize_jumps[i], deoptimize);
+    }
+    for (int i = 0; i < b.bailout_jumps_count; i++) {
+        jit_patch_rel32(&b, b.bailout_jumps[i], bailout);
+    }
+    for (int i = 0; i < b.exit_jumps_count; i++) {
+        jit_patch_rel32(&b, b.exit_jumps[i], exit);
+    }
+
+    if (b.failed) {
+        free(b.code);
+        return NULL;
+    }
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    *size = ((b.size + page_size - 1) / page_size) * page_size;
+    void* code = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        free(b.code);
+        return NULL;
+    }
+    memcpy(code, b.code, b.size);
+    free(b.code);
+    if (mprotect(code, *size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, *size);
+        return NULL;
+    }
+    if (VERBOSE)
+        printfln("Compiled user-defined function %s to %d bytes of machine code", f->func_info->name ? f->func_info->name : "(anonymous)", b.size);
+    return code;
 }
 
-lispval* builtin_list(lispval* v, lispenv* e)
+void free_jit_func(lispfunc_info* info)
 {
-    // list ( 1 2 3 )
-    LISPVAL_ASSERT(v->count == 1, "Error: function list passed too many arguments");
-    lispval* old = v->cell[0];
-    LISPVAL_ASSERT(old->type == LISPVAL_SEXPR, "Error: Argument passed to list is not an s-expr, i.e., a list with parenthesis.");
-    lispval* new = clone_lispval(old);
-    new->type = LISPVAL_QEXPR;
-    return new;
-    // Returns something that should be freed later: yes.
-    // Returns something that is independent of the input: yes.
+    if (info->jit_func != NULL)
+        munmap((void*)info->jit_func, info->jit_size);
+    info->jit_func = NULL;
+    if (info->jit_integer_func != NULL)
+        munmap((void*)info->jit_integer_func, info->jit_integer_size);
+    info->jit_integer_func = NULL;
 }
-
-lispval* builtin_len(lispval* v, lispenv* e)
+#else
+void* jit_compile_lispfunc(lispval* f, int type, size_t* size)
 {
-    // len { 1 2 3 }
-    LISPVAL_ASSERT(v->count == 1, "Error: function len passed too many arguments");
-
-    lispval* source = v->cell[0];
-    LISPVAL_ASSERT(source->type == LISPVAL_QEXPR, "Error: Argument passed to len is not a q-expr, i.e., a bracketed list.");
-    lispval* new = lispval_num(source->count);
-    return new;
-    // Returns something that should be freed later: yes.
-    // Returns something that doesn't share pointers with the input: yes.
+    return NULL;
 }
 
-lispval* builtin_eval(lispval* v, lispenv* env)
+void free_jit_func(lispfunc_info* info)
 {
-    // eval { + 1 2 3 }
-    // not sure how this will end up working, but we'll see
-    LISPVAL_ASSERT(v->count == 1, "Error: function eval passed too many arguments");
-    lispval* old = v->cell[0];
-    LISPVAL_ASSERT(old->type == LISPVAL_QEXPR || old->type == LISPVAL_QEXPR, "Error: Argument passed to eval is not a q-expr, i.e., a bracketed list.");
-    lispval* temp = clone_lispval(old);
-    temp->type = LISPVAL_SEXPR;
-    lispval* answer = evaluate_lispval(temp, env);
-    answer = evaluate_lispval(answer, env);
-    // ^ needed to make this example work:
-    //  (eval {head {+ -}}) 1 2 3
-    //  though I'm not sure why
-    delete_lispval(temp);
-    return answer;
-    // Returns something that should be freed later: probably.
-    // Returns something that is independent of the input: depends on the output of evaluate_lispval.
 }
+#endif
 
-lispval* builtin_join(lispval* l, lispenv* e)
+lispval* jit_call_lispfunc(lispval* l, lispenv* env)
 {
-    // return lispval_err("Error: Join not ready yet.");
-    // join { {1 2} {3 4} }
-    print_lispval_parenthesis(l);
-    LISPVAL_ASSERT(l->count == 1, "Error: function join passed too many arguments");
-    lispval* old = l->cell[0];
-    LISPVAL_ASSERT(old->type == LISPVAL_QEXPR, "Error: function join not passed q-expression");
-    lispval* result = lispval_qexpr();
-    for (int i = 0; i < old->count; i++) {
-        lispval* temp = old->cell[i];
-        LISPVAL_ASSERT(temp->type == LISPVAL_QEXPR, "Error: function join not passed a q expression with other q-expressions");
+    // l is (f arg1 arg2 ...), called from env. Returns NULL if the interpreter should handle the call.
+    lispval* f = l->cell[0];
+    lispfunc_info* info = f->func_info;
+    int n = l->count - 1;
+    int type = n > 0 ? l->cell[1]->type : LISPVAL_NUM;
+    for (int i = 0; i < n; i++) {
+        if (l->cell[i + 1]->type != type)
+            return NULL;
+    }
+    if (type != LISPVAL_NUM && type != LISPVAL_INT)
+        return NULL;
+    if (!(info->jit_tried & (1 << type))) {
+        info->jit_tried |= 1 << type;
+        if (type == LISPVAL_INT) {
+            info->jit_integer_func = (lispjit_integer_func)jit_compile_lispfunc(f, type, &info->jit_integer_size);
+        } else {
+            info->jit_func = (lispjit_func)jit_compile_lispfunc(f, type, &info->jit_size);
+        }
+    }
 
-        for (int j = 0; j < temp->count; j++) {
-            lispval_append_child(result, clone_lispval(temp->cell[j]));
+    if (!unboxed_self_calls_resolve(f, env) || !unboxed_operators_resolve(f, env))
+        return NULL;
+
+    JIT_BAILOUT = 0;
+    lispval* answer = NULL;
+    if (type == LISPVAL_INT) {
+        if (info->jit_integer_func == NULL || !(info->unboxed_types & (1 << LISPVAL_INT)))
+            return NULL;
+        long long frame[2 * n];
+        for (int i = 0; i < n; i++) {
+            frame[2 * (n - 1 - i)] = l->cell[i + 1]->integer;
+        }
+        long long result = info->jit_integer_func(frame);
+        answer = JIT_BAILOUT ? NULL : lispval_int(result);
+    } else {
+        if (info->jit_func == NULL)
+            return NULL;
+        double frame[2 * n];
+        for (int i = 0; i < n; i++) {
+            frame[2 * (n - 1 - i)] = l->cell[i + 1]->num;
         }
+        double result = info->jit_func(frame);
+        answer = JIT_BAILOUT ? NULL : lispval_num(result);
     }
-    return result;
-    // Returns something that should be freed later: yes.
-    // Returns something that is independent of the input: yes.
+    if (JIT_BAILOUT == UNBOXED_DEOPTIMIZE) {
+        if (VERBOSE)
+            printfln("Deoptimizing %s: its result doesn't always fit in 64 bits", info->name ? info->name : "(anonymous)");
+        info->unboxed_types &= ~(1 << LISPVAL_INT);
+    }
+    JIT_BAILOUT = 0;
+    return answer;
 }
 
-// Define a variable
-lispval* builtin_def(lispval* v, lispenv* env)
+// Profiling
+// (profile expr) evaluates expr while a SIGPROF timer samples the stack of
+// user-defined functions being called, which evaluate_lispval keeps in
+// SHADOW_STACK. Each sample counts towards the self samples of the innermost
+// function, and towards the total samples of every function on the stack.
+// Calls made from within jit'd or unboxed code aren't seen by the profiler.
+#define SHADOW_STACK_SIZE 4096
+#define PROFILE_SAMPLE_INTERVAL_US 1000
+int PROFILING = 0;
+lispfunc_info* volatile SHADOW_STACK[SHADOW_STACK_SIZE];
+volatile int SHADOW_STACK_DEPTH = 0; // can be larger than SHADOW_STACK_SIZE
+volatile long profile_samples = 0;
+volatile long profile_top_level_samples = 0;
+lispfunc_info** profiled_funcs = NULL; // each holds a reference until the report
+int profiled_funcs_count = 0;
+
+long long monotonic_ns(void)
 {
-    // Takes two arguments: argument: def {a} 1; def {init} (@ {x y} {x})
-    lispval* symbol_wrapper = v->cell[0];
-    lispval* value = v->cell[1];
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
 
-    insert_in_current_lispenv(symbol_wrapper->cell[0]->sym, value, env);
-    lispval* source = v->cell[0];
-    return lispval_sexpr(); // ()
-    LISPVAL_ASSERT(v->count == 1, "Error: function def passed too many arguments");
-    LISPVAL_ASSERT(source->type == LISPVAL_QEXPR, "Error: Argument passed to def is not a q-expr, i.e., a bracketed list.");
-    LISPVAL_ASSERT(source->count == 2, "Error: Argument passed to def should be a q expr with two q expressions as children: def { { a b } { 1 2 } } ");
-    LISPVAL_ASSERT(source->cell[0]->type == LISPVAL_QEXPR, "Error: Argument passed to def should be a q expr with two q expressions as children: def { { a b } { 1 2 } } ");
-    LISPVAL_ASSERT(source->cell[1]->type == LISPVAL_QEXPR || source->cell[1]->type == LISPVAL_SEXPR, "Error: Argument passed to def should be a q expr with two q expressions as children: def { { a b } { 1 2 } } ");
-    LISPVAL_ASSERT(source->cell[0]->count == source->cell[1]->count, "Error: In function \"def\" both subarguments should have the same length");
+void profile_enter(lispval* f)
+{
+    lispfunc_info* info = f->func_info;
+    if (info->prof_calls == 0 && info->prof_active == 0) {
+        char anonymous_name[32];
+        format_lispfunc_name(f, anonymous_name); // while f's body is at hand
+        info->refcount++;
+        profiled_funcs_count++;
+        profiled_funcs = realloc(profiled_funcs, sizeof(lispfunc_info*) * profiled_funcs_count);
+        profiled_funcs[profiled_funcs_count - 1] = info;
+    }
+    info->prof_calls++;
+    if (info->prof_active++ == 0) {
+        info->prof_entered_ns = monotonic_ns();
+    }
+    if (SHADOW_STACK_DEPTH < SHADOW_STACK_SIZE) {
+        SHADOW_STACK[SHADOW_STACK_DEPTH] = info;
+    }
+    SHADOW_STACK_DEPTH++;
+}
 
-    lispval* symbols = source->cell[0];
-    lispval* values = source->cell[1];
-    for (int i = 0; i < symbols->count; i++) {
-        LISPVAL_ASSERT(symbols->cell[i]->type == LISPVAL_SYM, "Error: in function def, the first list of items should be of type symbol:  def { { a b } { 1 2 } }");
-        if (VERBOSE)
-            print_lispval_tree(symbols, 0);
-        if (VERBOSE)
-            print_lispval_tree(values, 0);
-        if (VERBOSE)
-            printf("\n");
-        insert_in_current_lispenv(symbols->cell[i]->sym, clone_lispval(values->cell[i]), env);
+void profile_exit(lispfunc_info* info)
+{
+    SHADOW_STACK_DEPTH--;
+    if (--info->prof_active == 0) {
+        // Only the outermost of recursive calls counts towards the time
+        info->prof_time_ns += monotonic_ns() - info->prof_entered_ns;
     }
-    return lispval_sexpr(); // ()
 }
 
-// A builtin for defining a function
-lispval* builtin_define_lambda(lispval* v, lispenv* env)
+void handle_sigprof(int signal)
 {
-    // @ { {x y} { + x y } }
-    // def { {plus} {{@ {x y} {+ x y}} }}
-    // (eval plus) 1 2
-    // (@ { {x y} { + x y } }) 1 2
-    LISPVAL_ASSERT(v->count == 2, "Lambda definition requires two arguments; try (@ {x y} { + x y }) ");
-    LISPVAL_ASSERT(v->cell[0]->type == LISPVAL_QEXPR, "Lambda definition (@) requires that the first sub-arg be a q-expression; try @ {x y} { + x y }");
-    LISPVAL_ASSERT(v->cell[1]->type == LISPVAL_QEXPR, "Lambda definition (@) requires that the second sub-arg be a q-expression; try @ {x y} { + x y }");
+    long sample = ++profile_samples;
+    int depth = SHADOW_STACK_DEPTH;
+    if (depth > SHADOW_STACK_SIZE)
+        depth = SHADOW_STACK_SIZE;
+    if (depth == 0) {
+        profile_top_level_samples++;
+        return;
+    }
+    SHADOW_STACK[depth - 1]->prof_self_samples++;
+    for (int i = 0; i < depth; i++) {
+        lispfunc_info* info = SHADOW_STACK[i];
+        if (info->prof_last_sample != sample) {
+            info->prof_last_sample = sample;
+            info->prof_total_samples++;
+        }
+    }
+}
 
-    lispval* variables = clone_lispval(v->cell[0]);
-    lispval* manipulation = clone_lispval(v->cell[1]);
+void start_profile(void)
+{
+    PROFILING = 1;
+    SHADOW_STACK_DEPTH = 0;
+    profile_samples = 0;
+    profile_top_level_samples = 0;
 
-    for (int i = 0; i > variables->count; i++) {
-        LISPVAL_ASSERT(variables->cell[i]->type == LISPVAL_SYM, "First argument in function definition must only be symbols. Try @ { {x y} { + x y } }");
-    }
-		lispenv* new_env = clone_lispenv(env);
-		// So env at the time of creation!
-    lispval* lambda = lispval_lambda_func(variables, manipulation, new_env);
-    return lambda;
+    struct sigaction action = { 0 };
+    action.sa_handler = handle_sigprof;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, NULL);
+    struct itimerval timer = { 0 };
+    timer.it_interval.tv_usec = PROFILE_SAMPLE_INTERVAL_US;
+    timer.it_value.tv_usec = PROFILE_SAMPLE_INTERVAL_US;
+    setitimer(ITIMER_PROF, &timer, NULL);
 }
 
-// Conditionals
+int compare_profiled_funcs(const void* a, const void* b)
+{
+    lispfunc_info* x = *(lispfunc_info**)a;
+    lispfunc_info* y = *(lispfunc_info**)b;
+    if (x->prof_self_samples != y->prof_self_samples)
+        return x->prof_self_samples < y->prof_self_samples ? 1 : -1;
+    return x->prof_time_ns < y->prof_time_ns ? 1 : (x->prof_time_ns > y->prof_time_ns ? -1 : 0);
+}
 
-lispval* builtin_ifelse(lispval* v, lispenv* e)
+void stop_profile(void)
 {
-    // ifelse 1 {a} b
-    LISPVAL_ASSERT(v->count == 3, "Error: function ifelse passed too many arguments. Try ifelse choice result alternative, e.g., if (1 (a) {b})");
+    struct itimerval timer = { 0 };
+    setitimer(ITIMER_PROF, &timer, NULL);
+    signal(SIGPROF, SIG_DFL);
+    PROFILING = 0;
 
-    lispval* choice = v->cell[0];
-    lispval* result = v->cell[1];
-    lispval* alternative = v->cell[2];
-		
-		if( choice->type == LISPVAL_NUM && choice->num == 0){
-			lispval* answer = clone_lispval(alternative);
-			if(answer->type == LISPVAL_QEXPR){
-				answer->type = LISPVAL_SEXPR;
-				answer = evaluate_lispval(answer, e);
-			}
-			return answer;
-		}else {
-			lispval* answer = clone_lispval(result);
-			if(answer->type == LISPVAL_QEXPR){
-				// answer = builtin_eval(answer, e);
-				answer->type = LISPVAL_SEXPR;
-				answer = evaluate_lispval(answer, e);
-			}
-			return answer;
-		}
+    if (profiled_funcs_count > 0)
+        qsort(profiled_funcs, profiled_funcs_count, sizeof(lispfunc_info*), compare_profiled_funcs);
+    printf("\nProfile: %ld samples, one every %d us of cpu time\n", profile_samples, PROFILE_SAMPLE_INTERVAL_US);
+    printf("%-24s %12s %10s %10s %12s %14s\n", "function", "calls", "self", "total", "time (ms)", "avg (us/call)");
+    for (int i = 0; i < profiled_funcs_count; i++) {
+        lispfunc_info* info = profiled_funcs[i];
+        char anonymous_name[32];
+        snprintf(anonymous_name, 32, "lambda-%016llx", info->body_hash);
+        printf("%-24s %12ld %10ld %10ld %12.3f %14.3f\n", info->name ? info->name : anonymous_name,
+            info->prof_calls, info->prof_self_samples, info->prof_total_samples,
+            info->prof_time_ns / 1e6, info->prof_time_ns / 1e3 / info->prof_calls);
+        info->prof_calls = 0;
+        info->prof_self_samples = 0;
+        info->prof_total_samples = 0;
+        info->prof_last_sample = 0;
+        info->prof_time_ns = 0;
+        release_lispfunc_info(info);
+    }
+    if (profile_top_level_samples > 0)
+        printf("%-24s %12s %10ld\n", "(outside functions)", "", profile_top_level_samples);
+    free(profiled_funcs);
+    profiled_funcs = NULL;
+    profiled_funcs_count = 0;
 }
 
-// Comparators: =, > (also potentially <, >=, <=, <=)
-// For numbers. 
+// Tracing
+// With ./mumble --trace file, every call to a user-defined function is
+// recorded, and after each evaluation the time spent in each stack of calls
+// is written to file in the folded format that flamegraph.pl takes, e.g.:
+//   fibonacci;fibonacci;fibonacci 1234
+// where 1234 is the time in nanoseconds spent in the innermost call itself.
+// Anonymous functions are named after a hash of their body.
+// The file is rewritten after each evaluation, rather than only on exit,
+// since Ctrl+C at the prompt ends the process without returning from main.
+// While tracing, functions aren't jit'd or unboxed, so that every call is seen.
+typedef struct trace_node {
+    char* name;
+    long long self_ns;
+    long long entered_ns;
+    long long children_ns;
+    struct trace_node* parent;
+    struct trace_node* children;
+    struct trace_node* next; // next sibling
+} trace_node;
+char* TRACE_FILE = NULL;
+int TRACING = 0;
+trace_node* trace_root = NULL;
+trace_node* trace_current = NULL;
 
-lispval* builtin_equal(lispval* v, lispenv* e)
+trace_node* new_trace_node(char* name, trace_node* parent)
 {
-    // ifelse 1 {a} b
-    LISPVAL_ASSERT(v->count == 2, "Error: function = takes two numeric arguments. Try (= 1 2)");
+    trace_node* node = malloc(sizeof(trace_node));
+    node->name = malloc(strlen(name) + 1);
+    strcpy(node->name, name);
+    node->self_ns = 0;
+    node->entered_ns = 0;
+    node->children_ns = 0;
+    node->parent = parent;
+    node->children = NULL;
+    node->next = NULL;
+    return node;
+}
 
-    lispval* a = v->cell[0];
-    lispval* b = v->cell[1];
-	  
-		LISPVAL_ASSERT(a->type == LISPVAL_NUM, "Error: Functio = only takes numeric arguments.");
-		LISPVAL_ASSERT(b->type == LISPVAL_NUM, "Error: Functio = only takes numeric arguments.");
+void delete_trace_node(trace_node* node)
+{
+    trace_node* child = node->children;
+    while (child != NULL) {
+        trace_node* next = child->next;
+        delete_trace_node(child);
+        child = next;
+    }
+    free(node->name);
+    free(node);
+}
 
-		if(a->num == b->num){
-			return lispval_num(1);
-		}else {
-			return lispval_num(0);
-		}
+void start_trace(void)
+{
+    TRACING = 1;
+    trace_root = new_trace_node("", NULL);
+    trace_current = trace_root;
 }
 
+void trace_enter(lispval* f)
+{
+    char anonymous_name[32];
+    char* name = format_lispfunc_name(f, anonymous_name);
+    trace_node* node = trace_current->children;
+    while (node != NULL && strcmp(node->name, name) != 0) {
+        node = node->next;
+    }
+    if (node == NULL) {
+        node = new_trace_node(name, trace_current);
+        node->next = trace_current->children;
+        trace_current->children = node;
+    }
+    node->children_ns = 0;
+    node->entered_ns = monotonic_ns();
+    trace_current = node;
+}
 
-lispval* builtin_greater_than(lispval* v, lispenv* e)
+void trace_exit(void)
 {
-    // ifelse 1 {a} b
-    LISPVAL_ASSERT(v->count == 2, "Error: function = takes two numeric arguments. Try (= 1 2)");
+    trace_node* node = trace_current;
+    long long elapsed_ns = monotonic_ns() - node->entered_ns;
+    node->self_ns += elapsed_ns - node->children_ns;
+    trace_current = node->parent;
+    trace_current->children_ns += elapsed_ns;
+}
 
-    lispval* a = v->cell[0];
-    lispval* b = v->cell[1];
-	  
-		LISPVAL_ASSERT(a->type == LISPVAL_NUM, "Error: Functio = only takes numeric arguments.");
-		LISPVAL_ASSERT(b->type == LISPVAL_NUM, "Error: Functio = only takes numeric arguments.");
+void write_trace_node(FILE* file, trace_node* node, char* path, size_t path_length)
+{
+    for (trace_node* child = node->children; child != NULL; child = child->next) {
+        size_t child_path_length = path_length + strlen(child->name) + (path_length > 0 ? 1 : 0);
+        char* child_path = malloc(child_path_length + 1);
+        sprintf(child_path, "%s%s%s", path, path_length > 0 ? ";" : "", child->name);
+        if (child->self_ns > 0)
+            fprintf(file, "%s %lld\n", child_path, child->self_ns);
+        write_trace_node(file, child, child_path, child_path_length);
+        free(child_path);
+    }
+}
 
-		if(a->num > b->num){
-			return lispval_num(1);
-		}else {
-			return lispval_num(0);
-		}
+void write_trace(void)
+{
+    FILE* file = fopen(TRACE_FILE, "w");
+    if (file == NULL) {
+        printfln("Error: could not write trace to %s", TRACE_FILE);
+    } else {
+        write_trace_node(file, trace_root, "", 0);
+        fclose(file);
+    }
 }
 
+void stop_trace(void)
+{
+    TRACING = 0;
+    write_trace();
+    delete_trace_node(trace_root);
+    trace_root = NULL;
+    trace_current = NULL;
+}
 
-// Simple math ops
-lispval* builtin_math_ops(char* op, lispval* v, lispenv* e)
+// Special forms
+// These get the unevaluated expression, so that they can decide what to evaluate.
+// E.g., in if (> x 1) (fibonacci x) 0, (fibonacci x) is only evaluated if x > 1.
+// The builtins of the same name remain in the environment, for when they are
+// used as values, e.g., in (eval {head {if}}) 1 2 3
+int is_truthy(lispval* v)
 {
-    // For now, ensure all args are numbers
-    for (int i = 0; i < v->count; i++) {
-        if (v->cell[i]->type != LISPVAL_NUM) {
-            return lispval_err("Error: Operating on non-numbers. This can be caused by an input like (+ 1 2 (3 * 4)). Because the (3 * 4) doesn't have the correct operation order, it isn't simplified, and then + can't sum over it.");
-        }
+    return !((v->type == LISPVAL_NUM && v->num == 0) || (v->type == LISPVAL_INT && v->integer == 0));
+}
+
+lispval* evaluate_branch(lispval* branch, lispenv* env)
+{
+    // if 1 {+ 1 2} 3: a q-expression branch is code to be run.
+    if (branch->type == LISPVAL_QEXPR) {
+        branch->type = LISPVAL_SEXPR;
     }
-    // Check how many elements
-    if (v->count == 0) {
-        return lispval_err("Error: No numbers on which to operate!");
-    } else if (v->count == 1) {
-        if (strcmp(op, "-") == 0) {
-            return lispval_num(-v->cell[0]->num);
-        } else {
-            return lispval_err("Error: Non minus unary operation");
-        }
-    } else if (v->count >= 2) {
-        lispval* x = clone_lispval(v->cell[0]);
+    return evaluate_lispval(branch, env);
+}
 
-        for (int i = 1; i < v->count; i++) {
-            lispval* y = v->cell[i];
-            if (strcmp(op, "+") == 0) {
-                x->num += y->num;
-            }
-            if (strcmp(op, "-") == 0) {
-                x->num -= y->num;
-            }
-            if (strcmp(op, "*") == 0) {
-                x->num *= y->num;
-            }
+lispval* special_form_ifelse(lispval* l, lispenv* env)
+{
+    // if (> x 1) {+ x 1} 0
+    LISPVAL_ASSERT_CONSUMING(l->count == 4, l, "Error: function ifelse passed too many arguments. Try ifelse choice result alternative, e.g., if (1 (a) {b})");
 
-            if (strcmp(op, "/") == 0) {
-                if (y->num == 0) {
-                    delete_lispval(x);
-                    delete_lispval(y);
-                    return lispval_err("Error: Division By Zero!");
-                }
-                x->num /= y->num;
-            }
-        }
-        return x;
-    } else {
-        return lispval_err("Error: Incorrect number of args. Perhaps a lispval->count was wrongly initialized?");
+    lispval* choice = evaluate_lispval(lispval_take_child(l, 1), env);
+    if (choice->type == LISPVAL_ERR) {
+        delete_lispval(l);
+        return choice;
     }
-    // Returns something that should be freed later: yes.
-    // Returns something that is independent of the input: yes.
+    int branch = is_truthy(choice) ? 2 : 3;
+    delete_lispval(choice);
+
+    lispval* answer = evaluate_branch(lispval_take_child(l, branch), env);
+    delete_lispval(l);
+    return answer;
 }
 
-// Fit the simple math ops using the above code
-lispval* builtin_add(lispval* v, lispenv* env)
+lispval* special_form_def(lispval* l, lispenv* env)
 {
-    return builtin_math_ops("+", v, env);
+    // def {x} 100; def {sq} (@ {x} {* x x}); def {a b} 1 2
+    LISPVAL_ASSERT_CONSUMING(l->count >= 3, l, "Error: function def takes a q-expression of symbols and their values, e.g., def {a b} 1 2");
+    if (l->cell[1]->type == LISPVAL_SEXPR || l->cell[1]->type == LISPVAL_SYM) {
+        l->cell[1] = evaluate_lispval(l->cell[1], env);
+        l->cell_hash = 0;
+    }
+    lispval* symbols = l->cell[1];
+    if (symbols->type == LISPVAL_ERR)
+        return lispval_take_child_and_delete(l, 1);
+    LISPVAL_ASSERT_CONSUMING(symbols->type == LISPVAL_QEXPR, l, "Error: Argument passed to def is not a q-expr, i.e., a bracketed list.");
+    LISPVAL_ASSERT_CONSUMING(symbols->count == l->count - 2, l, "Error: In function \"def\" there should be as many symbols as values: def {a b} 1 2");
+    for (int i = 0; i < symbols->count; i++) {
+        LISPVAL_ASSERT_CONSUMING(symbols->cell[i]->type == LISPVAL_SYM, l, "Error: in function def, the first list of items should be of type symbol: def {a b} 1 2");
+    }
+
+    // Evaluate all the values before binding any, so that an error binds nothing
+    for (int i = 2; i < l->count; i++) {
+        l->cell[i] = evaluate_lispval(l->cell[i], env);
+        l->cell_hash = 0;
+        if (l->cell[i]->type == LISPVAL_ERR)
+            return lispval_take_child_and_delete(l, i);
+    }
+    for (int i = 0; i < symbols->count; i++) {
+        lispval* value = lispval_take_child(l, i + 2);
+        if (value->type == LISPVAL_USER_FUNC && value->func_info->name == NULL) {
+            // Remember the name, so that e.g. the jit can recognize recursive calls
+            value->func_info->name = malloc(strlen(symbols->cell[i]->sym) + 1);
+            strcpy(value->func_info->name, symbols->cell[i]->sym);
+        }
+        insert_in_current_lispenv_without_clone(symbols->cell[i]->sym, value, env);
+    }
+    delete_lispval(l);
+    return lispval_sexpr(); // ()
 }
 
-lispval* builtin_substract(lispval* v, lispenv* env)
+lispval* special_form_define_lambda(lispval* l, lispenv* env)
 {
-    return builtin_math_ops("-", v, env);
+    // @ {x y} { + x y }
+    LISPVAL_ASSERT_CONSUMING(l->count == 3, l, "Lambda definition requires two arguments; try (@ {x y} { + x y }) ");
+    LISPVAL_ASSERT_CONSUMING(l->cell[1]->type == LISPVAL_QEXPR, l, "Lambda definition (@) requires that the first sub-arg be a q-expression; try @ {x y} { + x y }");
+    LISPVAL_ASSERT_CONSUMING(l->cell[2]->type == LISPVAL_QEXPR, l, "Lambda definition (@) requires that the second sub-arg be a q-expression; try @ {x y} { + x y }");
+    for (int i = 0; i < l->cell[1]->count; i++) {
+        LISPVAL_ASSERT_CONSUMING(l->cell[1]->cell[i]->type == LISPVAL_SYM, l, "First argument in function definition must only be symbols. Try @ { {x y} { + x y } }");
+    }
+
+    // The q-expressions are not evaluated, so they can be taken as they are.
+    lispval* variables = lispval_take_child(l, 1);
+    lispval* manipulation = lispval_take_child(l, 2);
+    delete_lispval(l);
+    // Functions are evaluated in the environment they are called from,
+    // so there is no need to clone the current one.
+    return lispval_lambda_func(variables, manipulation, NULL, NULL);
 }
 
-lispval* builtin_multiply(lispval* v, lispenv* env)
+lispval* special_form_and_or(lispval* l, lispenv* env, int is_and)
 {
-    return builtin_math_ops("*", v, env);
+    // and (> x 0) (> 10 x): stops at the first false argument
+    // or (= x 0) (= x 1): stops at the first true argument
+    for (int i = 1; i < l->count; i++) {
+        lispval* answer = evaluate_branch(lispval_take_child(l, i), env);
+        if (answer->type == LISPVAL_ERR) {
+            delete_lispval(l);
+            return answer;
+        }
+        int truthy = is_truthy(answer);
+        delete_lispval(answer);
+        if (truthy != is_and) {
+            delete_lispval(l);
+            return lispval_int(truthy);
+        }
+    }
+    delete_lispval(l);
+    return lispval_int(is_and);
 }
 
-lispval* builtin_divide(lispval* v, lispenv* env)
+lispval* special_form_profile(lispval* l, lispenv* env)
 {
-    return builtin_math_ops("/", v, env);
+    // profile (fibonacci 20)
+    LISPVAL_ASSERT_CONSUMING(l->count == 2, l, "Error: profile takes one expression, e.g., profile (fibonacci 20)");
+    LISPVAL_ASSERT_CONSUMING(!PROFILING, l, "Error: profile can't be nested");
+    start_profile();
+    lispval* answer = evaluate_branch(lispval_take_child(l, 1), env);
+    stop_profile();
+    delete_lispval(l);
+    return answer;
 }
 
-// Add builtins to an env
-void lispenv_add_builtin(char* builtin_func_name, lispbuiltin func, lispenv* env)
+lispval* evaluate_special_form(lispval* l, lispenv* env)
 {
-    if (VERBOSE)
-        printfln("Adding func: name: %s, pointer: %p", builtin_func_name, func);
-    lispval* f = lispval_builtin_func(func, builtin_func_name);
-    if (VERBOSE)
-        print_lispval_tree(f, 0);
-    insert_in_current_lispenv(builtin_func_name, f, env);
-    delete_lispval(f);
+    // Returns NULL if l isn't a special form
+    if (l->count == 0 || l->cell[0]->type != LISPVAL_SYM) {
+        return NULL;
+    }
+    char* sym = l->cell[0]->sym;
+    if (strcmp(sym, "if") == 0 || strcmp(sym, "ifelse") == 0) {
+        return special_form_ifelse(l, env);
+    } else if (strcmp(sym, "def") == 0) {
+        return special_form_def(l, env);
+    } else if (strcmp(sym, "@") == 0) {
+        return special_form_define_lambda(l, env);
+    } else if (strcmp(sym, "and") == 0) {
+        return special_form_and_or(l, env, 1);
+    } else if (strcmp(sym, "or") == 0) {
+        return special_form_and_or(l, env, 0);
+    } else if (strcmp(sym, "profile") == 0) {
+        return special_form_profile(l, env);
+    }
+    return NULL;
 }
-void lispenv_add_builtins(lispenv* env)
+
+// Call a user-defined function: l is (f arg1 arg2 ...)
+lispval* evaluate_user_func_call(lispval* l, lispenv* env)
 {
-    // Math functions
-    lispenv_add_builtin("+", builtin_add, env);
-    lispenv_add_builtin("-", builtin_substract, env);
-    lispenv_add_builtin("*", builtin_multiply, env);
-    lispenv_add_builtin("/", builtin_divide, env);
+    lispval* f = l->cell[0]; // clone_lispval(l->cell[0]);
+    if (VERBOSE) {
+        printfln("Evaluating user-defined function");
+        print_lispval_tree(f, 2);
+        printfln("Expected %d variables, found %d variables.", f->variables->count, l->count - 1);
+    }
 
-    //
-    /* List Functions */
-    lispenv_add_builtin("list", builtin_list, env);
-    lispenv_add_builtin("head", builtin_head, env);
-    lispenv_add_builtin("tail", builtin_tail, env);
-    lispenv_add_builtin("eval", builtin_eval, env);
-    lispenv_add_builtin("join", builtin_join, env);
-    lispenv_add_builtin("len", builtin_len, env);
-    lispenv_add_builtin("def", builtin_def, env);
-    lispenv_add_builtin("@", builtin_define_lambda, env);
-    lispenv_add_builtin("ifelse", builtin_ifelse, env);
-    lispenv_add_builtin("if", builtin_ifelse, env);
-    lispenv_add_builtin("=", builtin_equal, env);
-    lispenv_add_builtin(">", builtin_greater_than, env);
+    LISPVAL_ASSERT_CONSUMING(f->variables->count == (l->count - 1), l, "Error: Incorrect number of variables given to user-defined function");
+    if (evaluation_stack_exhausted()) {
+        delete_lispval(l);
+        return lispval_err(EVAL_STOPPED);
+    }
+    lispval* fast_answer = (JIT && !TRACING && !PARALLEL_WORKER) ? jit_call_lispfunc(l, env) : NULL;
+    if (fast_answer == NULL && !TRACING) {
+        fast_answer = unboxed_call_lispfunc(l, env);
+    }
+    if (fast_answer != NULL) {
+        delete_lispval(l);
+        return fast_answer;
+    }
+
+    lispenv* evaluation_env = new_lispenv();
+    evaluation_env->parent = env;
+    if (VERBOSE) {
+        printfln("Number of variables match");
+        printfln("Function vars:");
+        print_lispval_tree(f->variables, 2);
+        printfln("Function manipulation:");
+        print_lispval_tree(f->manipulation, 2);
+    }
+
+    for (int i = 0; i < f->variables->count; i++) {
+        insert_in_current_lispenv_without_clone(f->variables->cell[i]->sym, lispval_take_child(l, i + 1), evaluation_env);
+    }
+    if (VERBOSE) {
+        printfln("Evaluation environment: ");
+        print_env(evaluation_env);
+    }
+    lispval* temp_expression = clone_lispval(f->manipulation);
+    temp_expression->type = LISPVAL_SEXPR;
+    lispval* answer = evaluate_lispval(temp_expression, evaluation_env);
+    // temp_expression is consumed by evaluate_lispval
+    destroy_lispenv(evaluation_env);
+    delete_lispval(l);
+    // lispval* answer = builtin_eval(f->manipulation, f->env);
+    // destroy_lispenv(f->env);
+    return answer;
 }
 
 // Evaluate the lispval
+lispval* profile_user_func_call(lispval* l, lispenv* env)
+{
+    // evaluate_user_func_call, recorded in the profile and the trace if they are on
+    if (!PROFILING && !TRACING)
+        return evaluate_user_func_call(l, env);
+    lispfunc_info* info = l->cell[0]->func_info;
+    info->refcount++; // l, and with it the function, is consumed by the call
+    if (PROFILING)
+        profile_enter(l->cell[0]);
+    if (TRACING)
+        trace_enter(l->cell[0]);
+    lispval* answer = evaluate_user_func_call(l, env);
+    if (TRACING)
+        trace_exit();
+    if (PROFILING)
+        profile_exit(info);
+    release_lispfunc_info(info);
+    return answer;
+}
+
 lispval* evaluate_lispval(lispval* l, lispenv* env)
 {
+    if (--EVAL_POLL_COUNTDOWN <= 0 && evaluation_should_stop()) {
+        delete_lispval(l);
+        return lispval_err(EVAL_STOPPED);
+    }
     if (VERBOSE)
         printfln("Evaluating lispval");
     // Check if this is neither an s-expression nor a symbol; otherwise return as is.
@@ -1033,6 +7014,12 @@ lispval* evaluate_lispval(lispval* l, lispenv* env)
         return answer;
     }
 
+    // Special forms decide themselves which children to evaluate
+    lispval* special_form_answer = evaluate_special_form(l, env);
+    if (special_form_answer != NULL) {
+        return special_form_answer;
+    }
+
     // Evaluate the children if needed
     if (VERBOSE)
         printfln("%s", "Evaluating children");
@@ -1045,6 +7032,7 @@ lispval* evaluate_lispval(lispval* l, lispenv* env)
             // delete_lispval(l->cell[i]);
             // ^ gave me a "double free" error.
             l->cell[i] = new;
+            l->cell_hash = 0;
             if (VERBOSE)
                 printfln("%s", "");
         }
@@ -1066,6 +7054,7 @@ lispval* evaluate_lispval(lispval* l, lispenv* env)
 			*/
         if (VERBOSE)
             printfln("Returning error");
+        delete_lispval(l);
         return err;
     }
 
@@ -1085,7 +7074,7 @@ lispval* evaluate_lispval(lispval* l, lispenv* env)
         if (VERBOSE)
             printfln("Constructing function and operands");
 
-        lispval* f = clone_lispval(l->cell[0]);
+        lispval* f = l->cell[0];
         lispval* operands = lispval_sexpr();
 
         for (int i = 1; i < l->count; i++) {
@@ -1094,59 +7083,137 @@ lispval* evaluate_lispval(lispval* l, lispenv* env)
         if (VERBOSE)
             printfln("Applying function to operands");
         // lispval* answer = lispval_num(42);
+        TRACE_EVENT(TRACE_EVENT_CALL, f);
         lispval* answer = f->builtin_func(operands, env);
+        TRACE_EVENT(TRACE_EVENT_RETURN, answer);
         if (VERBOSE)
             printfln("Applied function to operands");
 
         if (VERBOSE)
             printfln("Cleaning up");
-        delete_lispval(f);
+        // operands owns l->cell[1..], so only f and the shell of l remain.
         delete_lispval(operands);
-        // delete_lispval(temp);
+        delete_lispval(f);
+        free(l->cell);
+        free(l);
         if (VERBOSE)
             printfln("Cleaned up. Returning");
         return answer;
     }
 
     if (l->count >= 2 && ((l->cell[0])->type == LISPVAL_USER_FUNC)) {
-        lispval* f = l->cell[0]; // clone_lispval(l->cell[0]);
-				if (VERBOSE) {
-            printfln("Evaluating user-defined function");
-            print_lispval_tree(f, 2);
-						printfln("Expected %d variables, found %d variables.", f->variables->count, l->count - 1);
-        }
-        
-				lispenv* evaluation_env = new_lispenv();
-				evaluation_env->parent = env;
-
-        LISPVAL_ASSERT(f->variables->count == (l->count - 1), "Error: Incorrect number of variables given to user-defined function");
-        if (VERBOSE) {
-            printfln("Number of variables match");
-            printfln("Function vars:");
-            print_lispval_tree(f->variables, 2);
-            printfln("Function manipulation:");
-            print_lispval_tree(f->manipulation, 2);
-        }
-
-        for (int i = 0; i < f->variables->count; i++) {
-            insert_in_current_lispenv(f->variables->cell[i]->sym, l->cell[i + 1], evaluation_env);
-        }
-        if (VERBOSE) {
-            printfln("Evaluation environment: ");
-            print_env(evaluation_env);
-        }
-        lispval* temp_expression = clone_lispval(f->manipulation);
-        temp_expression->type = LISPVAL_SEXPR;
-        lispval* answer = evaluate_lispval(temp_expression, evaluation_env);
-				// delete_lispval(temp_expression);
-				destroy_lispenv(evaluation_env);
-        // lispval* answer = builtin_eval(f->manipulation, f->env);
-        // destroy_lispenv(f->env);
+        TRACE_EVENT(TRACE_EVENT_CALL, l->cell[0]);
+        lispval* answer = profile_user_func_call(l, env);
+        TRACE_EVENT(TRACE_EVENT_RETURN, answer);
         return answer;
     }
 
     return l;
 }
+// Call a function from C
+lispval* call_lispval_func(lispval* f, lispval** args, int n, lispenv* env)
+{
+    // f applied to clones of args. Unlike the children of an s-expression,
+    // the arguments aren't evaluated again, so symbols in a list stay symbols.
+    if (f->type == LISPVAL_BUILTIN_FUNC) {
+        lispval* operands = lispval_sexpr();
+        for (int i = 0; i < n; i++) {
+            lispval_append_child(operands, clone_lispval(args[i]));
+        }
+        TRACE_EVENT(TRACE_EVENT_CALL, f);
+        lispval* answer = f->builtin_func(operands, env);
+        TRACE_EVENT(TRACE_EVENT_RETURN, answer);
+        delete_lispval(operands);
+        return answer;
+    }
+    LISPVAL_ASSERT(f->variables->count == n, "Error: Incorrect number of variables given to user-defined function");
+    lispval* call = lispval_sexpr();
+    lispval_append_child(call, clone_lispval(f));
+    for (int i = 0; i < n; i++) {
+        lispval_append_child(call, clone_lispval(args[i]));
+    }
+    TRACE_EVENT(TRACE_EVENT_CALL, f);
+    lispval* answer = profile_user_func_call(call, env);
+    TRACE_EVENT(TRACE_EVENT_RETURN, answer);
+    return answer;
+}
+
+// Calling a function many times
+// map, filter, the folds and sort call the same function once per element.
+// A lispfunc_frame holds what can be reused across those calls: the
+// environment which binds a user-defined function's variables, and the
+// (f arg1 arg2 ...) s-expression for the jit'd and unboxed paths, whose
+// cells are borrowed rather than cloned.
+struct lispfunc_frame {
+    lispval* f; // borrowed
+    int n;
+    lispenv* caller;
+    lispenv* env; // NULL until needed
+    lispval* call;
+};
+
+lispfunc_frame* new_lispfunc_frame(lispval* f, int n, lispenv* caller)
+{
+    lispfunc_frame* frame = malloc(sizeof(lispfunc_frame));
+    frame->f = f;
+    frame->n = n;
+    frame->caller = caller;
+    frame->env = NULL;
+    frame->call = lispval_sexpr();
+    frame->call->cell = malloc(sizeof(lispval*) * (n + 1));
+    return frame;
+}
+
+void delete_lispfunc_frame(lispfunc_frame* frame)
+{
+    if (frame->env != NULL)
+        destroy_lispenv(frame->env);
+    frame->call->count = 0; // its cells are borrowed
+    delete_lispval(frame->call);
+    free(frame);
+}
+
+lispval* call_lispfunc_frame(lispfunc_frame* frame, lispval** args)
+{
+    // Like call_lispval_func, for frame->n arguments
+    lispval* f = frame->f;
+    int n = frame->n;
+    if (f->type != LISPVAL_USER_FUNC || PROFILING || TRACING)
+        return call_lispval_func(f, args, n, frame->caller);
+    LISPVAL_ASSERT(f->variables->count == n, "Error: Incorrect number of variables given to user-defined function");
+    if (--EVAL_POLL_COUNTDOWN <= 0 && evaluation_should_stop())
+        return lispval_err(EVAL_STOPPED);
+    TRACE_EVENT(TRACE_EVENT_CALL, f);
+    frame->call->cell[0] = f;
+    for (int i = 0; i < n; i++) {
+        frame->call->cell[i + 1] = args[i];
+    }
+    frame->call->count = n + 1;
+    lispval* answer = (JIT && !PARALLEL_WORKER) ? jit_call_lispfunc(frame->call, frame->caller) : NULL;
+    if (answer == NULL)
+        answer = unboxed_call_lispfunc(frame->call, frame->caller);
+    frame->call->count = 0;
+    if (answer == NULL) {
+        // A body which def'd local variables gets a fresh environment next time
+        if (frame->env != NULL && frame->env->count > n) {
+            destroy_lispenv(frame->env);
+            frame->env = NULL;
+        }
+        if (frame->env == NULL) {
+            frame->env = new_lispenv();
+            frame->env->parent = frame->caller;
+        }
+        for (int i = 0; i < n; i++) {
+            insert_in_current_lispenv_without_clone(f->variables->cell[i]->sym, clone_lispval(args[i]), frame->env);
+        }
+        lispval* body = clone_lispval(f->manipulation);
+        body->type = LISPVAL_SEXPR;
+        answer = evaluate_lispval(body, frame->env);
+    }
+    TRACE_EVENT(TRACE_EVENT_RETURN, answer);
+    return answer;
+}
+
 // Increase or decrease verbosity level manually
 int modify_verbosity(char* command)
 {
@@ -1166,10 +7233,121 @@ int modify_verbosity(char* command)
     }
     return 0;
 }
+// Set limits on evaluation
+int modify_evaluation_limits(char* command)
+{
+    long long n;
+    char extra;
+    if (sscanf(command, "BUDGET=%lld%c", &n, &extra) == 1 && n >= 0) {
+        EVAL_STEP_BUDGET = n;
+        return 1;
+    }
+    if (sscanf(command, "TIMEOUT=%lld%c", &n, &extra) == 1 && n >= 0) {
+        EVAL_TIMEOUT_MS = n;
+        return 1;
+    }
+    return 0;
+}
+// Turn the jit on or off
+int modify_jit(char* command)
+{
+    if (strcmp("JIT=0", command) == 0) {
+        JIT = 0;
+        return 1;
+    }
+    if (strcmp("JIT=1", command) == 0) {
+        JIT = 1;
+        return 1;
+    }
+    return 0;
+}
+// Write the trace events to a file
+int dump_trace_events_to_file(char* command)
+{
+    if (strncmp("DUMP=", command, 5) != 0)
+        return 0;
+    if (!save_trace_events(command + 5))
+        printfln("Could not dump trace events to %s; they are only recorded by make trace builds", command + 5);
+    return 1;
+}
+
+// Benchmark the math kernels against libm, with --bench-math
+double ulps_between(double x, double reference)
+{
+    if (x == reference || (x != x && reference != reference))
+        return 0;
+    double magnitude = fabs(reference);
+    return fabs(x - reference) / (nextafter(magnitude, INFINITY) - magnitude);
+}
+
+void bench_math_kernels(void)
+{
+    long n = 1 << 20;
+    int rounds = 20;
+    double* input = malloc(n * sizeof(double));
+    double* output = malloc(n * sizeof(double));
+    char* names[] = { "sqrt", "exp", "log", "sin", "cos", "abs" };
+    double (*scalars[])(double) = { sqrt, exp, log, sin, cos, fabs };
+    void (*kernels[])(double*, long) = { vec_sqrt, vec_exp, vec_log, vec_sin, vec_cos, vec_abs };
+    double lows[] = { 0, -700, 1e-300, -100, -100, -1e6 };
+    double highs[] = { 1e6, 700, 1e300, 100, 100, 1e6 };
+    printf("%d rounds over %ld doubles\n", rounds, n);
+    printf("%-6s %12s %12s %10s %10s\n", "", "libm ns/el", "vec ns/el", "speedup", "max ulps");
+    for (int f = 0; f < 6; f++) {
+        uint64_t state = 0x9e3779b97f4a7c15ULL;
+        for (long i = 0; i < n; i++) {
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            double u = (double)(state >> 11) / 9007199254740992.0;
+            // log is tried over many orders of magnitude
+            input[i] = f == 2 ? exp(log(lows[f]) + u * (log(highs[f]) - log(lows[f])))
+                              : lows[f] + u * (highs[f] - lows[f]);
+        }
+        volatile double sink = 0;
+        long long start = monotonic_ns();
+        for (int r = 0; r < rounds; r++) {
+            for (long i = 0; i < n; i++)
+                output[i] = scalars[f](input[i]);
+            sink += output[r];
+        }
+        double scalar_ns = (double)(monotonic_ns() - start) / rounds / n;
+        start = monotonic_ns();
+        for (int r = 0; r < rounds; r++) {
+            memcpy(output, input, n * sizeof(double));
+            kernels[f](output, n);
+            sink += output[r];
+        }
+        double kernel_ns = (double)(monotonic_ns() - start) / rounds / n;
+        double max_ulps = 0;
+        for (long i = 0; i < n; i++) {
+            double ulps = ulps_between(output[i], scalars[f](input[i]));
+            max_ulps = ulps > max_ulps ? ulps : max_ulps;
+        }
+        printf("%-6s %12.2f %12.2f %9.2fx %10.2f\n", names[f], scalar_ns, kernel_ns, scalar_ns / kernel_ns, max_ulps);
+    }
+    free(input);
+    free(output);
+}
 
 // Main
 int main(int argc, char** argv)
 {
+    // Command line options
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            TRACE_FILE = argv[++i];
+        } else if (strcmp(argv[i], "--bench-math") == 0) {
+            bench_math_kernels();
+            return 0;
+        } else {
+            fprintf(stderr, "Usage: %s [--trace file] [--bench-math]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (TRACE_FILE != NULL)
+        start_trace();
+    install_crash_handlers();
+    init_random();
+
     // Info
     printfln("%s", "Mumble version 0.0.2\n");
     printfln("%s", "Press Ctrl+C to exit\n");
@@ -1177,6 +7355,7 @@ int main(int argc, char** argv)
     /* Create Some Parsers */
     mpc_parser_t* Number = mpc_new("number");
     mpc_parser_t* Symbol = mpc_new("symbol");
+    mpc_parser_t* String = mpc_new("string");
     mpc_parser_t* Sexpr = mpc_new("sexpr");
     mpc_parser_t* Qexpr = mpc_new("qexpr");
     mpc_parser_t* Expr = mpc_new("expr");
@@ -1186,12 +7365,13 @@ int main(int argc, char** argv)
     mpca_lang(MPCA_LANG_DEFAULT, "                           \
     number   : /-?[0-9]+\\.?([0-9]+)?/ ;                     \
     symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&@]+/ ;         \
+    string   : /\"(\\\\.|[^\"])*\"/ ;                       \
 		sexpr : '(' <expr>* ')' ;                                \
 		qexpr : '{' <expr>* '}' ;                                \
-    expr     : <number> | <symbol> | <sexpr> | <qexpr>;      \
+    expr     : <number> | <symbol> | <string> | <sexpr> | <qexpr>; \
     mumble    : /^/ <expr>* /$/ ;                            \
   ",
-        Number, Symbol, Sexpr, Qexpr, Expr, Mumble);
+        Number, Symbol, String, Sexpr, Qexpr, Expr, Mumble);
 
     // Create an environment
     if (VERBOSE)
@@ -1220,7 +7400,7 @@ int main(int argc, char** argv)
         if (input == NULL) {
             break;
         } else {
-            if (modify_verbosity(input)) {
+            if (modify_verbosity(input) || modify_jit(input) || modify_evaluation_limits(input) || dump_trace_events_to_file(input)) {
                 continue;
             }
             /* Attempt to Parse the user Input */
@@ -1249,7 +7429,11 @@ int main(int argc, char** argv)
 
                 // Eval the lispval in that environment.
 
+                start_evaluation_limits();
                 lispval* answer = evaluate_lispval(l, env);
+                stop_evaluation_limits();
+                if (TRACING)
+                    write_trace();
                 {
                     if (VERBOSE)
                         printfln("Result: ");
@@ -1259,6 +7443,8 @@ int main(int argc, char** argv)
                     printf("\n");
                 }
                 delete_lispval(answer);
+                if (VERBOSE)
+                    dump_trace_events();
                 if (VERBOSE > 1)
                     printfln("variable \"answer\" after deletion: %p ", answer);
                 // delete_lispval(answer); // do this twice, just to see.
@@ -1283,6 +7469,9 @@ int main(int argc, char** argv)
         input = NULL;
     }
 
+    if (TRACING)
+        stop_trace();
+
     // Clear the history
     rl_uninitialize();
     // rl_free_line_state();
@@ -1290,7 +7479,7 @@ int main(int argc, char** argv)
     destroy_lispenv(env);
 
     /* Undefine and Delete our Parsers */
-    mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Mumble);
+    mpc_cleanup(7, Number, Symbol, String, Sexpr, Qexpr, Expr, Mumble);
 
     return 0;
 }
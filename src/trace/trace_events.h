@@ -0,0 +1,76 @@
+// Binary trace events, recorded by mumble when built with -DMUMBLE_TRACE_EVENTS
+// (make trace), and read back by tracedump.
+//
+// A dump is a trace_events_header followed by header.count trace_events,
+// oldest first, in the byte order of the machine that wrote it.
+#ifndef MUMBLE_TRACE_EVENTS_H
+#define MUMBLE_TRACE_EVENTS_H
+
+#include <stdint.h>
+
+#define TRACE_EVENTS_MAGIC "MUMBLEEV"
+#define TRACE_EVENTS_VERSION 1
+#define TRACE_EVENTS_SIZE 65536 // events kept in the ring buffer; a power of two
+#define TRACE_EVENTS_CRASH_FILE "mumble-events.bin"
+
+enum {
+    TRACE_EVENT_ALLOC, // pointer: the new lispval
+    TRACE_EVENT_FREE, // pointer: the lispval being deleted
+    TRACE_EVENT_ENV_INSERT, // pointer: the value inserted
+    TRACE_EVENT_ENV_LOOKUP, // pointer: the value found, which is then cloned
+    TRACE_EVENT_CALL, // pointer: the function being called
+    TRACE_EVENT_RETURN, // pointer: the value it returned
+};
+
+// The names are only defined where they are read, i.e., in tracedump and in
+// mumble built with -DMUMBLE_TRACE_EVENTS, so that other builds don't warn
+// about unused variables.
+#if defined(MUMBLE_TRACE_EVENTS) || defined(MUMBLE_TRACEDUMP)
+static const char* trace_event_kind_names[] = {
+    "alloc",
+    "free",
+    "env-insert",
+    "env-lookup",
+    "call",
+    "return",
+};
+
+// Indexed by the LISPVAL_* types
+static const char* trace_event_type_names[] = {
+    "num",
+    "err",
+    "sym",
+    "builtin",
+    "lambda",
+    "sexpr",
+    "qexpr",
+    "int",
+    "bigint",
+    "vec",
+    "range",
+    "map",
+    "str",
+    "stream",
+    "transient",
+};
+
+_Static_assert(sizeof(trace_event_kind_names) / sizeof(trace_event_kind_names[0]) == TRACE_EVENT_RETURN + 1, "trace_event_kind_names should have a name for each TRACE_EVENT_*");
+#endif
+
+typedef struct trace_event {
+    uint64_t timestamp_ns; // CLOCK_MONOTONIC
+    uint64_t pointer;
+    uint8_t kind;
+    uint8_t type;
+    uint8_t padding[6];
+} trace_event;
+
+typedef struct trace_events_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t event_size;
+    uint64_t recorded; // all events recorded, including those overwritten
+    uint64_t count; // events in this dump
+} trace_events_header;
+
+#endif
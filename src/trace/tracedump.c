@@ -0,0 +1,50 @@
+// Prints the binary trace events that mumble dumps, one per line:
+// timestamp (ns since the first event), kind, type and pointer.
+// Usage: tracedump mumble-events.bin
+#include <stdio.h>
+#include <string.h>
+
+#define MUMBLE_TRACEDUMP
+#include "trace_events.h"
+
+#define COUNT_OF(array) (sizeof(array) / sizeof(array[0]))
+
+int main(int argc, char** argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s file\n", argv[0]);
+        return 1;
+    }
+    FILE* file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    trace_events_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TRACE_EVENTS_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s: not a mumble trace events file\n", argv[1]);
+        fclose(file);
+        return 1;
+    }
+    if (header.version != TRACE_EVENTS_VERSION || header.event_size != sizeof(trace_event)) {
+        fprintf(stderr, "%s: unsupported version %u, or event size %u\n", argv[1], header.version, header.event_size);
+        fclose(file);
+        return 1;
+    }
+    if (header.recorded > header.count) {
+        printf("# %llu earlier events were overwritten\n", (unsigned long long)(header.recorded - header.count));
+    }
+
+    trace_event event;
+    uint64_t first_timestamp = 0;
+    for (uint64_t i = 0; i < header.count && fread(&event, sizeof(event), 1, file) == 1; i++) {
+        if (i == 0)
+            first_timestamp = event.timestamp_ns;
+        const char* kind = event.kind < COUNT_OF(trace_event_kind_names) ? trace_event_kind_names[event.kind] : "?";
+        const char* type = event.type < COUNT_OF(trace_event_type_names) ? trace_event_type_names[event.type] : "?";
+        printf("%12llu %-10s %-8s 0x%llx\n", (unsigned long long)(event.timestamp_ns - first_timestamp), kind, type, (unsigned long long)event.pointer);
+    }
+    fclose(file);
+    return 0;
+}